@@ -9,10 +9,20 @@ i686-elf-gcc -c src/main.cpp         -o main.o         $COMMON_FLAGS
 i686-elf-gcc -c src/interrupts.cpp   -o interrupts.o   $COMMON_FLAGS -mgeneral-regs-only
 i686-elf-gcc -c src/vga.cpp          -o vga.o          $COMMON_FLAGS
 i686-elf-gcc -c src/heap.cpp         -o heap.o         $COMMON_FLAGS
+i686-elf-gcc -c src/page_allocator.cpp -o page_allocator.o $COMMON_FLAGS
 i686-elf-gcc -c src/ide.cpp          -o ide.o          $COMMON_FLAGS
 i686-elf-gcc -c src/vmware_svga2.cpp -o vmware_svga2.o $COMMON_FLAGS
 i686-elf-gcc -c src/math.cpp         -o math.o         $COMMON_FLAGS
+i686-elf-gcc -c src/cpu.cpp          -o cpu.o          $COMMON_FLAGS
+i686-elf-gcc -c src/memory.cpp       -o memory.o       $COMMON_FLAGS
+i686-elf-gcc -c src/arena.cpp        -o arena.o        $COMMON_FLAGS
+i686-elf-gcc -c src/acpi.cpp         -o acpi.o         $COMMON_FLAGS
+i686-elf-gcc -c src/apic.cpp         -o apic.o         $COMMON_FLAGS
+i686-elf-gcc -c src/timer.cpp        -o timer.o        $COMMON_FLAGS -mgeneral-regs-only
+i686-elf-gcc -c src/thread.cpp       -o thread.o       $COMMON_FLAGS -mgeneral-regs-only
+i686-elf-gcc -c src/smp.cpp          -o smp.o          $COMMON_FLAGS
+i686-elf-gcc -c src/wait_queue.cpp   -o wait_queue.o   $COMMON_FLAGS -mgeneral-regs-only
 
-i686-elf-ld -T linker.ld -o myos.bin -O2 -nostdlib boot.o main.o interrupts.o vga.o heap.o ide.o vmware_svga2.o math.o
+i686-elf-ld -T linker.ld -o myos.bin -O2 -nostdlib boot.o main.o interrupts.o vga.o heap.o page_allocator.o ide.o vmware_svga2.o math.o cpu.o memory.o arena.o acpi.o apic.o timer.o thread.o smp.o wait_queue.o
 
 rm *.o
@@ -0,0 +1,39 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "kernel.h"
+
+// Just enough ACPI to find the static tables the firmware leaves in memory, there is no AML interpreter.
+
+struct PACKED Acpi_Rsdp {
+    char signature[8]; // "RSD PTR "
+    u8 checksum;       // over the first 20 bytes
+    char oem_id[6];
+    u8 revision;       // 0 for ACPI 1.0, 2 and up have the fields below
+    u32 rsdt_address;
+    
+    u32 length;
+    u64 xsdt_address;
+    u8 extended_checksum;
+    u8 reserved[3];
+};
+
+struct PACKED Acpi_Sdt_Header {
+    char signature[4];
+    u32 length; // including this header
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+};
+
+// looks for the RSDP in the EBDA and the BIOS area, returns false if there is none
+bool acpi_init();
+
+// the first table with this signature, mapped for reading, or null if there is none or its checksum is wrong
+Acpi_Sdt_Header *acpi_find_table(char *signature);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include "kernel.h"
+
+// local APIC registers, byte offsets from its base
+#define LAPIC_ID                 0x020
+#define LAPIC_VERSION            0x030
+#define LAPIC_TASK_PRIORITY      0x080
+#define LAPIC_EOI                0x0B0
+#define LAPIC_SPURIOUS_VECTOR    0x0F0
+#define LAPIC_ERROR_STATUS       0x280
+#define LAPIC_INTERRUPT_COMMAND_LOW  0x300
+#define LAPIC_INTERRUPT_COMMAND_HIGH 0x310
+#define LAPIC_LVT_TIMER          0x320
+#define LAPIC_LVT_LINT0          0x350
+#define LAPIC_LVT_LINT1          0x360
+#define LAPIC_LVT_ERROR          0x370
+#define LAPIC_TIMER_INITIAL_COUNT 0x380
+#define LAPIC_TIMER_CURRENT_COUNT 0x390
+#define LAPIC_TIMER_DIVIDE       0x3E0
+
+#define LAPIC_SPURIOUS_ENABLE (1 << 8)
+#define LAPIC_LVT_MASKED      (1 << 16)
+
+#define LAPIC_TIMER_ONE_SHOT     (0 << 17)
+#define LAPIC_TIMER_PERIODIC     (1 << 17)
+#define LAPIC_TIMER_DIVIDE_BY_16 0x3
+
+// in LAPIC_INTERRUPT_COMMAND_LOW, the destination APIC id goes in the top byte of the high half
+#define LAPIC_ICR_FIXED          (0 << 8)
+#define LAPIC_ICR_INIT           (5 << 8)
+#define LAPIC_ICR_STARTUP        (6 << 8)
+#define LAPIC_ICR_SEND_PENDING   (1 << 12)
+#define LAPIC_ICR_ASSERT         (1 << 14)
+#define LAPIC_ICR_LEVEL          (1 << 15)
+
+#define APIC_BASE_ENABLE (1 << 11) // in MSR_IA32_APIC_BASE
+#define APIC_BASE_BSP    (1 << 8)
+
+// the local APIC doesn't want an EOI for its spurious vector, and the low 4 bits have to be set on old ones
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+// once the APIC takes over, the 8259s are moved here so that a spurious irq from them can't look like a real one
+#define PIC_DISABLED_VECTOR_BASE 0xE0
+
+#define LAPIC_TIMER_VECTOR 0xD0
+
+// another cpu wants this one to run schedule(), see thread.cpp
+#define IPI_RESCHEDULE_VECTOR 0xD1
+
+// another cpu changed the page tables and wants this one to drop what it has in its TLB, see tlb_shootdown()
+#define IPI_TLB_SHOOTDOWN_VECTOR 0xD2
+
+#define APIC_MAX_IO_APICS 8
+#define APIC_MAX_CPUS     16
+
+// finds the local APIC and the IOAPICs in the ACPI MADT and turns them on, with every IOAPIC input masked.
+// returns false, leaving everything alone, if there is no APIC or no MADT
+bool apic_init();
+
+u32 lapic_read(u32 reg);
+void lapic_write(u32 reg, u32 value);
+
+void lapic_eoi();
+u32 lapic_id();
+
+// the part of apic_init() every other cpu has to do for its own local APIC, with its timer masked
+void lapic_init_ap();
+
+// a fixed interrupt on vector for the cpu with this APIC id, returns once its local APIC has taken it
+void lapic_send_ipi(u32 apic_id, u8 vector);
+
+// what it takes to start another cpu: INIT, then STARTUP with the page it starts executing at in real mode
+void lapic_send_init(u32 apic_id);
+void lapic_send_startup(u32 apic_id, u32 physical_page);
+
+// routes an irq to vector IRQ_VECTOR_BASE + irq on this cpu and masks or unmasks it. irqs below 16 are
+// ISA irqs and go through the MADT overrides, anything else is a global system interrupt number.
+void ioapic_set_masked(s32 irq, bool masked);
+
+// the local APIC ids of the cpus the MADT lists as usable, the bootstrap cpu included
+u32 apic_cpu_count();
+u32 apic_cpu_id(u32 index);
+
+#endif
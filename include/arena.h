@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "kernel.h"
+
+// A bump allocator for memory that all dies at the same time, like everything a frame of the shell
+// allocates. Individual frees are ignored, arena_reset() takes everything back at once.
+
+#define ARENA_DEFAULT_BLOCK_SIZE (16 * 1024)
+
+struct Arena_Block {
+    Arena_Block *next; // the block we filled before this one
+    u32 size;          // usable bytes after this header
+    u32 used;
+};
+
+struct Arena {
+    Arena_Block *current = nullptr;
+    u32 block_size = ARENA_DEFAULT_BLOCK_SIZE;
+    void *last = nullptr; // the most recent allocation, the only one that can be resized
+};
+
+void *arena_alloc(Arena *arena, u32 size);
+
+// resizes mem in place, which only works for the most recent allocation and only while the block has room
+bool arena_resize(Arena *arena, void *mem, u32 size);
+
+// everything allocated from the arena is gone after this. If that didn't fit into one block, the blocks are
+// replaced by a single one that is big enough, so the next round doesn't have to chain blocks again.
+void arena_reset(Arena *arena);
+
+// gives all blocks back to the heap
+void arena_free_all(Arena *arena);
+
+// allocator_type has no room for a context pointer, so there is one allocator function per arena
+template <Arena *arena>
+void *arena_allocator(ALLOCATOR_MODE mode, void *existing, s64 size) {
+    if (mode == ALLOCATOR_MODE_ALLOC) return arena_alloc(arena, static_cast<u32>(size));
+    if (mode == ALLOCATOR_MODE_RESIZE) return arena_resize(arena, existing, static_cast<u32>(size)) ? existing : nullptr;
+    return nullptr;
+}
+
+#endif
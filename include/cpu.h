@@ -0,0 +1,82 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "kernel.h"
+
+#define CPUID_LEAF_VENDOR   0x00000000
+#define CPUID_LEAF_FEATURES 0x00000001
+#define CPUID_LEAF_EXTENDED 0x80000000
+#define CPUID_LEAF_POWER_MANAGEMENT 0x80000007
+#define CPUID_LEAF_ADDRESS_SIZES 0x80000008
+
+#define CPUID_FEATURES_EDX_PSE  (1 << 3)
+#define CPUID_FEATURES_EDX_TSC  (1 << 4)
+#define CPUID_FEATURES_EDX_APIC (1 << 9)
+#define CPUID_FEATURES_EDX_MTRR (1 << 12)
+#define CPUID_FEATURES_EDX_PGE  (1 << 13)
+#define CPUID_FEATURES_EDX_PAT  (1 << 16)
+#define CPUID_FEATURES_EDX_FXSR (1 << 24)
+#define CPUID_FEATURES_EDX_SSE  (1 << 25)
+#define CPUID_FEATURES_EDX_SSE2 (1 << 26)
+
+#define CPUID_POWER_MANAGEMENT_EDX_INVARIANT_TSC (1 << 8) // runs at the same rate in every P-, C- and T-state
+
+#define CR0_MONITOR_COPROCESSOR (1 << 1)
+#define CR0_EMULATION           (1 << 2)
+#define CR0_NOT_WRITE_THROUGH   (1 << 29)
+#define CR0_CACHE_DISABLE       (1 << 30)
+
+#define CR4_PSE        (1 << 4)  // 4MiB pages
+#define CR4_PGE        (1 << 7)  // global pages
+#define CR4_OSFXSR     (1 << 9)  // we save SSE state with fxsave, this is what enables SSE
+#define CR4_OSXMMEXCPT (1 << 10) // we handle SIMD floating point exceptions
+
+#define MSR_IA32_APIC_BASE        0x01B
+#define MSR_IA32_MTRRCAP          0x0FE
+#define MSR_IA32_MTRR_PHYSBASE(n) (0x200 + 2 * (n))
+#define MSR_IA32_MTRR_PHYSMASK(n) (0x201 + 2 * (n))
+#define MSR_IA32_PAT              0x277
+#define MSR_IA32_MTRR_DEF_TYPE    0x2FF
+
+#define MTRRCAP_VARIABLE_COUNT_MASK 0xFF
+#define MTRRCAP_WRITE_COMBINING     (1 << 10)
+#define MTRR_PHYSMASK_VALID         (1 << 11)
+#define MTRR_DEF_TYPE_ENABLE        (1 << 11)
+
+#define MEMORY_TYPE_UNCACHEABLE     0x00
+#define MEMORY_TYPE_WRITE_COMBINING 0x01
+#define MEMORY_TYPE_WRITE_THROUGH   0x04
+#define MEMORY_TYPE_WRITE_PROTECT   0x05
+#define MEMORY_TYPE_WRITE_BACK      0x06
+#define MEMORY_TYPE_UNCACHED        0x07 // UC-, can be overridden by an MTRR
+
+struct Cpu_Features {
+    u32 max_leaf;
+    char vendor[13];
+    
+    u32 physical_address_bits;
+    
+    bool pse;
+    bool tsc;
+    bool invariant_tsc;
+    bool apic;
+    bool pge;
+    bool pat;
+    bool mtrr;
+    bool sse2; // only set once SSE is enabled
+};
+
+extern Cpu_Features cpu_features;
+
+// detects what the cpu supports and turns on the features we use, must run before paging is touched
+void cpu_init();
+
+// turns on the same features on another cpu, cpu_init() has to have run on the bootstrap cpu
+void cpu_init_ap();
+
+// programs a free variable range MTRR as write-combining, for cpus without PAT. cpu_init_ap() programs the
+// others the same way, so new ranges can only be added before smp_start_aps(), it returns false after.
+// the range has to be a power of two in size and aligned to it, returns false if that or a free MTRR is missing
+bool cpu_add_write_combining_range(u32 physical, u32 size);
+
+#endif
@@ -2,8 +2,10 @@
 #define HEAP_H
 
 #include "kernel.h"
+#include "spinlock.h"
 
 #define HEAP_VIRTUAL_BASE_ADDRESS 0x10000000
+#define HEAP_MAX_SIZE             0x40000000
 
 void init_heap();
 void *heap_alloc(u32 size);
@@ -13,4 +15,20 @@ void heap_free(void *mem);
 
 void *heap_allocator(ALLOCATOR_MODE mode, void *existing, s64 size);
 
+// backs a not-present heap page with a zeroed one, returns false if address isn't in the heap
+bool heap_handle_page_fault(u32 address);
+
+struct Heap_Stats {
+    u32 mapped_bytes;     // memory backed by physical pages, which only happens once a page is touched
+    u32 span_bytes;       // address space carved into spans, in use or free
+    u32 free_span_bytes;  // spans sitting in the free bins
+    u32 allocated_bytes;  // handed out to callers, rounded up to the size class or whole pages
+    u32 slab_count;
+    u32 large_span_count;
+    
+    Lock_Stats lock;
+};
+
+Heap_Stats heap_get_stats();
+
 #endif
@@ -11,18 +11,92 @@
 #define INTERRUPT_PRESENT           (1 << 7)
 #define INTERRUPT_STORAGE_SEGMENT   (1 << 4)
 
+// page fault error code
+#define PAGE_FAULT_PROTECTION_VIOLATION (1 << 0) // 0; the page was not present
+#define PAGE_FAULT_WRITE                (1 << 1)
+#define PAGE_FAULT_USER_MODE            (1 << 2)
+#define PAGE_FAULT_RESERVED_BIT         (1 << 3)
+#define PAGE_FAULT_INSTRUCTION_FETCH    (1 << 4)
+
 extern "C"
 void set_idt(void *idt, u16 size);
 
 void init_interrupt_descriptor_table();
 
+// the table is shared, every other cpu only has to load it
+void load_interrupt_descriptor_table();
+
+// irq n arrives on vector IRQ_VECTOR_BASE + n. The 8259s only ever raise the first 16,
+// the rest are global system interrupts of an IOAPIC.
+#define IRQ_VECTOR_BASE 0x20
+#define IRQ_COUNT       64
+
+void irq_mask(s32 irq);
+void irq_unmask(s32 irq);
+void irq_eoi(s32 irq);
+
+// moves interrupt delivery from the 8259s to the local APIC and the IOAPICs, keeping the irqs that are
+// unmasked. Returns false if there is no APIC to be found, the PIC stays in charge then.
+bool switch_irqs_to_apic();
+
+// the 8259s until switch_irqs_to_apic() succeeds
+extern bool irq_use_apic;
+
 #define IRQ_RESULT_CONTINUE 0
 #define IRQ_RESULT_HANDLED  1
 
 typedef s32 irq_result_type;
 typedef irq_result_type (*irq_handler_type)(s32 irq, void *dev);
 
+// handlers sharing one irq line
+#define IRQ_MAX_HANDLERS 4
+
 void register_irq_handler(s32 irq, String device_name, irq_handler_type handler,  void *dev);
 void detach_irq_handler(s32 irq, void *dev);
 
+// cycles are time stamp counter ticks, counted around every handler call in run_interrupt_handlers()
+struct Irq_Handler_Stats {
+    String device_name;
+    u32 count;
+    u64 cycles;
+    u64 max_cycles;
+};
+
+struct Irq_Stats {
+    u32 count;
+    u64 cycles; // all handlers of the line together
+    u64 max_cycles;
+    u32 spurious;  // raised by the 8259s without the irq being in service, only irq 7 and 15 can see these
+    u32 unhandled; // no handler returned IRQ_RESULT_HANDLED
+    u32 deferred_work_dropped;
+    
+    u32 handler_count;
+    Irq_Handler_Stats handlers[IRQ_MAX_HANDLERS];
+};
+
+Irq_Stats irq_get_stats(s32 irq);
+
+// Bottom halves. An irq handler should only acknowledge its device and hand the rest of the work to
+// schedule_deferred_work(), which wakes the deferred work thread to run it with interrupts enabled. Each
+// irq line has its own queue, so a slow or chatty device can't push out the work of another one.
+#define DEFERRED_WORK_QUEUE_SIZE 64
+
+typedef void (*deferred_work_type)(void *dev, u32 arg);
+
+// only call this from the handler of that irq, returns false if its queue is full and the work was dropped
+bool schedule_deferred_work(s32 irq, deferred_work_type work, void *dev, u32 arg);
+
+// runs everything that has been scheduled so far. @Volatile there must only ever be one caller at a
+// time, the queues have a single consumer. Once the deferred work thread is running that is its job.
+void run_deferred_work();
+
+// needs threads_init(), work scheduled before this waits for the thread
+void start_deferred_work_thread();
+
+// whether any queue has work in it, checked by the deferred work thread before it blocks
+bool deferred_work_pending();
+
+// work dropped because the queue of that irq was full
+u32 deferred_work_dropped(s32 irq);
+
 #endif // INTERRUPTS_H
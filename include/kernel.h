@@ -12,10 +12,44 @@
 
 #define KERNEL_VIRTUAL_BASE_ADDRESS 0xC0000000
 
+// physical memory starting at 0 is mapped here, see physical_to_virtual()
+#define DIRECT_MAP_VIRTUAL_ADDRESS 0xD0000000
+#define DIRECT_MAP_MAX_SIZE        0x20000000
+
+// a page for each cpu for zero_physical_page() to map pages the direct map doesn't reach
+#define ZERO_PAGE_SCRATCH_VIRTUAL_ADDRESS 0xF0000000
+
+// ACPI tables the direct map doesn't reach, see acpi.cpp
+#define ACPI_TABLE_VIRTUAL_ADDRESS 0xF0400000
+#define ACPI_TABLE_MAX_SIZE        0x00400000
+
+// the local APIC registers, followed by one page for each IOAPIC
+#define APIC_VIRTUAL_ADDRESS 0xF0800000
+
 #define UNUSED(x) do { (void)(x); } while (0)
 
+// u64 / u32 without libgcc, which we don't link against. The high half goes first so the second divl can't overflow.
+static inline u64 div_u64(u64 dividend, u32 divisor) {
+    u32 high = static_cast<u32>(dividend >> 32);
+    u32 low;
+    u32 remainder = high % divisor;
+    asm("divl %[divisor]" : "=a"(low), "+d"(remainder) : "0"(static_cast<u32>(dividend)), [divisor] "rm"(divisor));
+    return (static_cast<u64>(high / divisor) << 32) | low;
+}
+
 // #define kNEW(type) (reinterpret_cast<type *>( zero_memory(heap_alloc(sizeof(type)), sizeof(type)) ))
 
+enum ALLOCATOR_MODE {
+    ALLOCATOR_MODE_FREE,
+    ALLOCATOR_MODE_ALLOC,
+    
+    // grow or shrink existing to size without moving it. Returns existing, or nullptr if the block would have
+    // to move, in which case the caller allocates, copies and frees since only it knows how much to copy.
+    ALLOCATOR_MODE_RESIZE,
+};
+
+typedef void *(*allocator_type)(ALLOCATOR_MODE, void *existing, s64 size);
+
 #include "string.h"
 
 void _kassert(bool arg, String s, String file, u32 line);
@@ -61,17 +95,15 @@ void ps2_wait_for_response();
 void ps2_wait_for_output_clear();
 void ps2_wait_for_input_ready();
 
-enum ALLOCATOR_MODE {
-    ALLOCATOR_MODE_FREE,
-    ALLOCATOR_MODE_ALLOC,
-};
-
-typedef void *(*allocator_type)(ALLOCATOR_MODE, void *existing, s64 size);
-
 #include "heap.h"
 
 #define For(x) for (auto it : (x) )
 
+// placement new, for constructing elements in memory we allocated ourselves. There is no <new> in a freestanding build.
+inline void *operator new(decltype(sizeof(0)), void *where) { return where; }
+
+#define ARRAY_MIN_CAPACITY 32
+
 template <typename T>
 struct Array {
     T *data = nullptr;
@@ -84,32 +116,60 @@ struct Array {
         return data[index];
     }
     
+    // makes room for exactly size elements, resize() and add() go through grow() instead
     void reserve(s64 size) {
         kassert(allocator);
         
         if (size > allocated) {
-        	if (size < 32) size = 32;
+            if (size < ARRAY_MIN_CAPACITY) size = ARRAY_MIN_CAPACITY;
             
-            kassert(allocator == heap_allocator);
+            if (data && allocator(ALLOCATOR_MODE_RESIZE, data, size * sizeof(T))) {
+                allocated = size;
+                return;
+            }
             
             T *ndata;
             ndata = reinterpret_cast<T *>(allocator(ALLOCATOR_MODE_ALLOC, nullptr, size * sizeof(T)));
-            memcpy(ndata, data, count * sizeof(T));
+            kassert(ndata);
+            relocate(ndata, data, count);
             if (data) allocator(ALLOCATOR_MODE_FREE, data, 0);
             data = ndata;
             allocated = size;
         }
     }
     
+    // doubles the capacity until size fits, so n adds cost O(n) copying overall instead of O(n^2)
+    void grow(s64 size) {
+        if (size <= allocated) return;
+        
+        s64 capacity = allocated * 2;
+        if (capacity < size) capacity = size;
+        reserve(capacity);
+    }
+    
+    // moves count elements into uninitialized memory, leaving src destroyed
+    static void relocate(T *dst, T *src, s64 count) {
+        if (__is_trivially_copyable(T)) {
+            memcpy(dst, src, count * sizeof(T));
+            return;
+        }
+        
+        for (s64 i = 0; i < count; ++i) {
+            new (&dst[i]) T(static_cast<T &&>(src[i]));
+            src[i].~T();
+        }
+    }
+    
     void resize(s64 size) {
-        reserve(size);
+        grow(size);
         
         count = size;
     }
     
     void add(T item) {
-    	resize(count+1);
-    	data[count-1] = item;
+        grow(count+1);
+        new (&data[count]) T(static_cast<T &&>(item));
+        count++;
     }
     
     void clear() {
@@ -27,7 +27,11 @@ typedef u64 fixed32_32;
 #define PAGE_HAS_BEEN_ACCESSD  (1 << 5)
 #define PAGE_IS_DIRTY          (1 << 6)
 #define PAGE_SIZE_4MiB         (1 << 7) // 1; page size 4MiB, otherwise page size 4KiB 
-#define PAGE_GLOBAL_BIT        (1 << 8)
+#define PAGE_GLOBAL_BIT        (1 << 8) // survives cr3 reloads once CR4.PGE is on, for mappings every address space shares
+#define PAGE_WRITE_COMBINING   (1 << 9) // available to software, map_range() turns it into the write-combining PAT entry
+
+#define PAGE_PAT_BIT       (1 << 7)  // in a page table entry
+#define PAGE_LARGE_PAT_BIT (1 << 12) // in a 4MiB page directory entry
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,16 +39,55 @@ extern "C" {
     
     void map_page_table(u32 *table, u32 virtual_addr);
     
+    // single pages, served from a small cache in front of alloc_pages()
     u32 next_free_page();
+    void free_page(u32 physical);
+    
+    // a page that is already zeroed, from a pool the idle loop keeps filled. Free it with free_page()
+    u32 alloc_zeroed_page();
+    
+    // physically contiguous, naturally aligned blocks of 2^order pages, returns 0 when out of memory
+    u32 alloc_pages(u32 order);
+    void free_pages(u32 physical, u32 order);
+    
     
     u32 virtual_to_physical_address(u32 virtual_addr);
     
+    // returns null if the address is beyond the direct map
+    void *physical_to_virtual(u32 physical);
+    
+    // through the direct map, or a scratch mapping for pages beyond it
+    void zero_physical_page(u32 physical);
+    
     void map_page(u32 physical, u32 virtual_addr, u32 flags);
     
     void unmap_page(u32 virtual_addr);
     
+    // count pages starting at physical, page tables are made as needed and the TLB is flushed once at the end
+    void map_range(u32 physical, u32 virtual_addr, u32 count, u32 flags);
+    
+    void unmap_range(u32 virtual_addr, u32 count);
+    
+    // maps a single page unless something already is, returns false if so. For racing page faults
+    bool map_page_if_unmapped(u32 physical, u32 virtual_addr, u32 flags);
+    
+    // tlb maintenance. tlb_shootdown() is what map_range/unmap_range use after changing entries, on every cpu. It drops
+    // global entries as well. tlb_flush_address_space() is for switching cr3 and keeps the global kernel entries.
+    void tlb_shootdown(u32 virtual_addr, u32 count);
+    void tlb_shootdown_poll(); // answers a pending tlb_shootdown() of another cpu, for the IPI and spin loops
+    void tlb_flush_address_space();
+    void tlb_flush_all();
+    
     void memcpy(void *dst, void *src, u32 num);
     
+    // like memcpy, but dst and src may overlap
+    void *memmove(void *dst, void *src, u32 num);
+    
+    void *memset(void *dst, u8 value, u32 num);
+    
+    // count u32s, dst has to be 4 byte aligned. For pixel fills
+    void *memset32(void *dst, u32 value, u32 count);
+    
     void *zero_memory(void *dst, u32 size);
     
     s64 strlen(char *c_string);
@@ -60,6 +103,23 @@ extern "C" {
     u32 _read_eflags();
     u32 _write_eflags(u32 eflags);
     
+    // regs gets eax, ebx, ecx, edx
+    void _cpuid(u32 leaf, u32 subleaf, u32 *regs);
+    
+    u32 _read_cr0();
+    void _write_cr0(u32 cr0);
+    u32 _read_cr2();
+    u32 _read_cr4();
+    void _write_cr4(u32 cr4);
+    
+    u64 _read_tsc();
+    
+    // pushes the callee saved registers, stores esp in *old_esp and pops them again off new_esp
+    void _switch_stack(u32 *old_esp, u32 new_esp);
+    
+    u64 _read_msr(u32 msr);
+    void _write_msr(u32 msr, u64 value);
+    
 #define DISABLE_INTERRUPTS() _read_eflags(); asm("cli")
 #define RESTORE_INTERRUPTS(flags) _write_eflags(flags)
     
@@ -90,6 +150,12 @@ extern "C" {
     
     u16 pic_get_isr();
     
+    void set_irq_mask(u8 irq_line);
+    void clear_irq_mask(u8 irq_line);
+    
+    // moves the 8259s out of the way of the APIC and masks all their inputs
+    void pic_disable();
+    
 #ifdef __cplusplus
 }
 #endif
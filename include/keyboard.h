@@ -2,6 +2,8 @@
 #define KEYBOARD_H
 
 #include "kernel.h"
+#include "ring_buffer.h"
+#include "interrupts.h"
 
 struct Input {
 	u8 ctrl_pressed;
@@ -13,7 +15,13 @@ struct Input {
 	u8 utf8_code[4];
 };
 
-extern Array<Input> keyboard_event_queue;
+// filled by the keyboard interrupt, drained once per frame by the GUI loop
+#define KEYBOARD_EVENT_QUEUE_SIZE 256
+
+extern Ring_Buffer<Input, KEYBOARD_EVENT_QUEUE_SIZE> keyboard_event_queue;
+
+// irq 1, reads the scancode and leaves the rest to a bottom half
+irq_result_type keyboard_irq_handler(s32 irq, void *dev);
 
 #define KEY_PRESS        1
 #define KEY_RELEASE      2
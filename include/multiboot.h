@@ -0,0 +1,41 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include "kernel.h"
+
+#define MULTIBOOT_INFO_MEMORY  (1 << 0) // mem_lower and mem_upper are valid
+#define MULTIBOOT_INFO_MEM_MAP (1 << 6) // mmap_addr and mmap_length are valid
+
+struct Multiboot_Mmap {
+    u32 size; // size of the rest of this entry, not including this field
+    u64 base_addr;
+    u64 length;
+    
+    enum {
+        MEMORY_AVAILABLE = 1,
+        MEMORY_RESERVED = 2,
+        MEMORY_ACPI_RECLAIMABLE = 3,
+        MEMORY_NVS = 4,
+        MEMORY_BADRAM = 5,
+    };
+    u32 type;
+} PACKED;
+
+struct Multiboot_Information {
+    u32 flags;
+    u32 mem_lower;
+    u32 mem_upper;
+    u32 boot_device;
+    u32 cmdline;
+    u32 mods_count;
+    u32 mods_addr;
+    u8 syms[12];
+    u32 mmap_length;
+    u32 mmap_addr;
+    u32 drives_length;
+    u32 drives_addr;
+    u32 config_table;
+    u32 boot_loader_name;
+};
+
+#endif
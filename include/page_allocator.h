@@ -0,0 +1,42 @@
+#ifndef PAGE_ALLOCATOR_H
+#define PAGE_ALLOCATOR_H
+
+#include "kernel.h"
+#include "multiboot.h"
+#include "spinlock.h"
+
+#define PAGE_ALLOCATOR_MAX_ORDER 10
+
+// builds the physical memory tracking from the multiboot memory map, alloc_pages() and
+// next_free_page() cannot be used before this
+void page_allocator_init(Multiboot_Information *info);
+
+struct Page_Allocator_Stats {
+    u32 total_pages; // usable RAM that we track, including pages the kernel image sits in
+    u32 free_pages;  // including cached_pages
+    u32 used_pages;
+    u32 region_count;
+    
+    u32 cached_pages; // sitting in the per cpu page caches in front of the buddy allocator
+    u32 cache_hits;   // next_free_page() calls served from the cache
+    u32 cache_misses; // next_free_page() calls that had to refill the cache
+    u32 cache_drains; // free_page() calls that had to give a magazine back
+    
+    u32 zeroed_pages;     // sitting in the zero page pool, also counted in free_pages
+    u32 zero_pool_hits;   // alloc_zeroed_page() calls served from the pool
+    u32 zero_pool_misses; // alloc_zeroed_page() calls that zeroed a page themselves
+    
+    Lock_Stats buddy_lock;
+    Lock_Stats zero_pool_lock;
+};
+
+Page_Allocator_Stats page_allocator_get_stats();
+
+// zeroes a few pages into the zero page pool if it isn't full, meant to be called when there is nothing else to do.
+// returns false once the pool is full or there are no free pages left for it
+bool page_zero_pool_refill();
+
+// end of the highest usable memory region
+u32 page_allocator_memory_end();
+
+#endif
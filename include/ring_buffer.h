@@ -0,0 +1,49 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include "kernel.h"
+
+// A fixed size queue for handing items from exactly one producer to exactly one consumer, typically from an
+// interrupt handler to the main loop. Neither side takes a lock or disables interrupts: the producer only
+// writes head, the consumer only writes tail, and each publishes its index after it is done with the slot.
+// head and tail count up forever and are masked on access, so a full ring is head - tail == capacity.
+
+template <typename T, u32 capacity>
+struct Ring_Buffer {
+    static_assert(capacity && (capacity & (capacity-1)) == 0, "Ring_Buffer capacity must be a power of two");
+    
+    T items[capacity];
+    u32 head = 0;    // next slot the producer writes
+    u32 tail = 0;    // next slot the consumer reads
+    u32 dropped = 0; // pushes that found the ring full, producer only
+    
+    // producer side. Returns false and drops item if the consumer hasn't caught up.
+    bool push(T item) {
+        u32 h = head;
+        if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == capacity) {
+            dropped++;
+            return false;
+        }
+        
+        items[h & (capacity-1)] = item;
+        __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    
+    // consumer side
+    bool pop(T *out) {
+        u32 t = tail;
+        if (t == __atomic_load_n(&head, __ATOMIC_ACQUIRE)) return false;
+        
+        *out = items[t & (capacity-1)];
+        __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    
+    // only exact when called from the consumer side, the producer may have added more since
+    u32 count() {
+        return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - tail;
+    }
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "kernel.h"
+#include "apic.h"
+#include "spinlock.h"
+#include "timer.h"
+
+// Every cpu has a Cpu of its own that GS points at, so this_cpu() is a single load. The bootstrap cpu is
+// cpus[0], the others are numbered in the order they come online. Each has a data segment descriptor in the
+// GDT with its Cpu as the base, past the code and data segments everybody shares.
+
+#define GDT_CPU_DATA_FIRST    3
+#define GDT_ENTRY_COUNT       (GDT_CPU_DATA_FIRST + APIC_MAX_CPUS)
+#define GDT_CPU_DATA_SELECTOR(index) ((GDT_CPU_DATA_FIRST + (index)) * 8)
+
+// @Volatile the trampoline in boot.s is assembled to run at this physical address, it has to be page
+// aligned, below 1MiB and not used by the page allocator
+#define AP_TRAMPOLINE_ADDRESS 0x8000
+
+struct Thread;
+
+struct Cpu {
+    Cpu *self; // at gs:0, so that this_cpu() doesn't have to know where cpus[] is
+    u32 spin_locks_held; // spinlock.h's, at CPU_SPIN_LOCKS_HELD_OFFSET
+    u32 index;
+    u32 apic_id;
+    volatile bool online;
+    
+    // thread.cpp's. The run queue lock also covers the state of every thread in it, or about to be put in it
+    Spin_Lock run_queue_lock;
+    Thread *run_queue_head;
+    Thread *run_queue_tail;
+    u32 run_queue_length;
+    
+    Thread *current;
+    Thread *idle; // never in a run queue
+    Thread *switched_from; // whose stack we just left, its on_cpu is cleared once we are off it
+    volatile bool need_resched;
+    Timer slice_timer;
+    
+    u64 online_ns;
+    u64 last_switch_ns;
+    u64 idle_ns; // up to last_switch_ns
+    u32 switches;
+    u32 steals; // threads this cpu took from the run queue of another
+    
+    // main.cpp's, set by a cpu that wants this one to work on its tlb_shootdown() request
+    volatile bool tlb_shootdown_pending;
+};
+
+#if SPINLOCK_PER_CPU
+static_assert(__builtin_offsetof(Cpu, spin_locks_held) == CPU_SPIN_LOCKS_HELD_OFFSET, "spinlock.h can't find spin_locks_held");
+#endif
+
+extern Cpu cpus[APIC_MAX_CPUS];
+extern u32 cpu_count; // cpus that are online, they are cpus[0] to cpus[cpu_count-1]
+
+inline Cpu *this_cpu() {
+    Cpu *cpu;
+    asm volatile("movl %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// loads the GDT kernel_main() built and reloads the segment registers, GS included, on every cpu
+void gdt_load();
+
+// loads GS for cpus[0], right after the GDT has been set up
+void smp_init_bsp();
+
+// starts every other cpu the MADT lists, one at a time. Needs the local APIC, the TSC for its delays and threads_init()
+void smp_start_aps();
+
+#endif
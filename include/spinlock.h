@@ -0,0 +1,242 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "kernel.h"
+
+// Locks for state more than one cpu touches, all of them spin. With interrupts left on, an irq handler that
+// takes the same lock on the same cpu spins forever, so anything an irq handler or timer callback may take
+// has to be held with the _irqsave variants. A holder that is preempted keeps everybody else spinning until
+// it runs again, so don't sit on one with interrupts on for long. A zeroed lock is an unlocked one.
+//
+// Spin_Lock is a test-and-test-and-set lock, cheap when nobody else wants it but unfair: whoever sees the
+// store that frees it first gets it. Ticket_Lock hands the lock out in the order it was asked for, at the
+// price of every waiter spinning on the same line. RW_Lock lets any number of readers in at once; a
+// waiting writer keeps new readers out so that it can't be starved.
+
+// Every lock counts how often it was taken and how often somebody had to wait for it. The counters are
+// only written by the holder, so they cost no atomics, but they share the cache line with the lock word.
+#ifndef SPINLOCK_STATS
+#define SPINLOCK_STATS 1
+#endif
+
+// Every cpu counts the locks it holds in its Cpu, which is where GS points, so that tlb_shootdown() can check
+// that it doesn't hold any but paging_lock and thread_preempt() doesn't switch away from a holder.
+//
+// A cpu that waits for us in tlb_shootdown() may be the one holding the lock we are spinning on, and with
+// interrupts off its IPI can't get in. So every spin loop answers a pending shootdown itself.
+//
+// The host tools have no GS and no other cpus, they turn both off.
+#ifndef SPINLOCK_PER_CPU
+#define SPINLOCK_PER_CPU 1
+#endif
+
+// @Volatile smp.h checks that Cpu::spin_locks_held is here
+#define CPU_SPIN_LOCKS_HELD_OFFSET 4
+
+inline void spin_locks_held_inc() {
+#if SPINLOCK_PER_CPU
+    asm volatile("incl %%gs:%c0" : : "i"(CPU_SPIN_LOCKS_HELD_OFFSET) : "memory");
+#endif
+}
+
+inline void spin_locks_held_dec() {
+#if SPINLOCK_PER_CPU
+    asm volatile("decl %%gs:%c0" : : "i"(CPU_SPIN_LOCKS_HELD_OFFSET) : "memory");
+#endif
+}
+
+// once around a spin loop
+inline void spin_relax() {
+    asm volatile("pause");
+#if SPINLOCK_PER_CPU
+    tlb_shootdown_poll();
+#endif
+}
+
+struct Lock_Stats {
+    u32 acquisitions;
+    u32 contentions; // acquisitions that had to wait
+    u32 spins;       // times a waiter went around its loop, wraps
+};
+
+// with the lock held
+inline void lock_stats_acquired(Lock_Stats *stats, u32 spins) {
+#if SPINLOCK_STATS
+    stats->acquisitions++;
+    if (spins) {
+        stats->contentions++;
+        stats->spins += spins;
+    }
+#else
+    UNUSED(stats);
+    UNUSED(spins);
+#endif
+}
+
+struct Spin_Lock {
+    volatile u32 locked;
+    Lock_Stats stats;
+};
+
+inline void spin_lock(Spin_Lock *lock) {
+    u32 spins = 0;
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        // wait on a plain read, so the cache line isn't bounced around while somebody else holds it
+        do {
+            spin_relax();
+            spins++;
+        } while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED));
+    }
+    
+    spin_locks_held_inc();
+    lock_stats_acquired(&lock->stats, spins);
+}
+
+inline bool spin_try_lock(Spin_Lock *lock) {
+    if (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) return false;
+    if (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) return false;
+    
+    spin_locks_held_inc();
+    lock_stats_acquired(&lock->stats, 0);
+    return true;
+}
+
+inline void spin_unlock(Spin_Lock *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    spin_locks_held_dec();
+}
+
+// returns the eflags to hand back to spin_unlock_irqrestore()
+inline u32 spin_lock_irqsave(Spin_Lock *lock) {
+    u32 eflags = DISABLE_INTERRUPTS();
+    spin_lock(lock);
+    return eflags;
+}
+
+inline void spin_unlock_irqrestore(Spin_Lock *lock, u32 eflags) {
+    spin_unlock(lock);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+struct Ticket_Lock {
+    volatile u32 next;  // the ticket the next one to come along draws
+    volatile u32 owner; // the ticket being served
+    Lock_Stats stats;
+};
+
+inline void ticket_lock(Ticket_Lock *lock) {
+    u32 ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    
+    u32 spins = 0;
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        spin_relax();
+        spins++;
+    }
+    
+    spin_locks_held_inc();
+    lock_stats_acquired(&lock->stats, spins);
+}
+
+inline bool ticket_try_lock(Ticket_Lock *lock) {
+    // only draw a ticket if it would be served right away
+    u32 owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+    if (!__atomic_compare_exchange_n(&lock->next, &owner, owner + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return false;
+    
+    spin_locks_held_inc();
+    lock_stats_acquired(&lock->stats, 0);
+    return true;
+}
+
+inline void ticket_unlock(Ticket_Lock *lock) {
+    // only the holder writes owner
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+    spin_locks_held_dec();
+}
+
+inline u32 ticket_lock_irqsave(Ticket_Lock *lock) {
+    u32 eflags = DISABLE_INTERRUPTS();
+    ticket_lock(lock);
+    return eflags;
+}
+
+inline void ticket_unlock_irqrestore(Ticket_Lock *lock, u32 eflags) {
+    ticket_unlock(lock);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+#define RW_LOCK_WRITER         0x80000000
+#define RW_LOCK_WRITER_WAITING 0x40000000
+#define RW_LOCK_READERS_MASK   0x3FFFFFFF
+
+struct RW_Lock {
+    volatile u32 value; // the number of readers, or RW_LOCK_WRITER, and RW_LOCK_WRITER_WAITING
+    Lock_Stats stats;   // only counts the writers, the readers would have to update it atomically
+};
+
+inline void rw_read_lock(RW_Lock *lock) {
+    while (true) {
+        u32 value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+        if (!(value & (RW_LOCK_WRITER | RW_LOCK_WRITER_WAITING))) {
+            if (__atomic_compare_exchange_n(&lock->value, &value, value + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+            continue;
+        }
+        
+        spin_relax();
+    }
+    
+    spin_locks_held_inc();
+}
+
+inline void rw_read_unlock(RW_Lock *lock) {
+    __atomic_fetch_sub(&lock->value, 1, __ATOMIC_RELEASE);
+    spin_locks_held_dec();
+}
+
+inline void rw_write_lock(RW_Lock *lock) {
+    u32 spins = 0;
+    while (true) {
+        u32 value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+        if (!(value & (RW_LOCK_WRITER | RW_LOCK_READERS_MASK))) {
+            // clears RW_LOCK_WRITER_WAITING, any other writer still waiting sets it again
+            if (__atomic_compare_exchange_n(&lock->value, &value, RW_LOCK_WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+            continue;
+        }
+        
+        if (!(value & RW_LOCK_WRITER_WAITING)) __atomic_fetch_or(&lock->value, RW_LOCK_WRITER_WAITING, __ATOMIC_RELAXED);
+        spin_relax();
+        spins++;
+    }
+    
+    spin_locks_held_inc();
+    lock_stats_acquired(&lock->stats, spins);
+}
+
+inline void rw_write_unlock(RW_Lock *lock) {
+    // leaves RW_LOCK_WRITER_WAITING alone, another writer may have set it since we got in
+    __atomic_fetch_and(&lock->value, ~static_cast<u32>(RW_LOCK_WRITER), __ATOMIC_RELEASE);
+    spin_locks_held_dec();
+}
+
+inline u32 rw_read_lock_irqsave(RW_Lock *lock) {
+    u32 eflags = DISABLE_INTERRUPTS();
+    rw_read_lock(lock);
+    return eflags;
+}
+
+inline void rw_read_unlock_irqrestore(RW_Lock *lock, u32 eflags) {
+    rw_read_unlock(lock);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+inline u32 rw_write_lock_irqsave(RW_Lock *lock) {
+    u32 eflags = DISABLE_INTERRUPTS();
+    rw_write_lock(lock);
+    return eflags;
+}
+
+inline void rw_write_unlock_irqrestore(RW_Lock *lock, u32 eflags) {
+    rw_write_unlock(lock);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+#endif
@@ -19,9 +19,12 @@ struct String {
 
 void advance(String *s, s64 amount);
 
+#define STRING_BUILDER_MIN_CAPACITY 32
+
 struct String_Builder {
     String data;
     s64 allocated;
+    allocator_type allocator; // heap_allocator if null, so a zeroed String_Builder is ready to use
 };
 
 int append(String_Builder *builder, String s);
@@ -30,6 +33,9 @@ int string_builder_putchar(void *payload, u8 c);
 
 String sprint(String fmt, ...);
 
+// the result is allocated with allocator instead of the heap
+String sprint(allocator_type allocator, String fmt, ...);
+
 s64 find_char(String *s, u8 needle);
 
 bool strings_match(String a, String b);
@@ -51,14 +57,26 @@ int string_builder_putchar(void *payload, u8 c) {
     String_Builder *builder = reinterpret_cast<String_Builder *>(payload);
     
     if (builder->data.length + 1 >= builder->allocated) {
-        u8 *new_data = reinterpret_cast<u8 *>(heap_alloc(builder->allocated + 32));
-        builder->allocated += 32;
-        // @TOOD check for nullptr returned from heap_alloc
-        if (builder->data.data) {
-            memcpy(new_data, builder->data.data, builder->data.length);
-            heap_free(builder->data.data);
+        allocator_type allocator = builder->allocator ? builder->allocator : heap_allocator;
+        
+        // doubles like Array::grow(). An arena can usually extend its last block in place, and doesn't get
+        // anything back from the FREE either, so RESIZE is tried first like Array::reserve() does
+        s64 size = builder->allocated * 2;
+        if (size < STRING_BUILDER_MIN_CAPACITY) size = STRING_BUILDER_MIN_CAPACITY;
+        
+        if (builder->data.data && allocator(ALLOCATOR_MODE_RESIZE, builder->data.data, size)) {
+            builder->allocated = size;
+        } else {
+            u8 *new_data = reinterpret_cast<u8 *>(allocator(ALLOCATOR_MODE_ALLOC, nullptr, size));
+            kassert(new_data);
+            if (builder->data.data) {
+                memcpy(new_data, builder->data.data, builder->data.length);
+                allocator(ALLOCATOR_MODE_FREE, builder->data.data, 0);
+            }
+            
+            builder->data.data = new_data;
+            builder->allocated = size;
         }
-        builder->data.data = new_data;
     }
     
     builder->data.data[builder->data.length++] = c;
@@ -75,6 +93,17 @@ String sprint(String fmt, ...) {
     return builder.data;
 }
 
+String sprint(allocator_type allocator, String fmt, ...) {
+    va_list a_list;
+    va_start(a_list, fmt);
+    String_Builder builder;
+    zero_memory(&builder, sizeof(String_Builder));
+    builder.allocator = allocator;
+    print_valist_callback(fmt, a_list, &builder, string_builder_putchar);
+    va_end(a_list);
+    return builder.data;
+}
+
 // @FixMe this doesnt support UTF8 but all Strings should be considered a UTF8 string
 s64 find_char(String *s, u8 needle) {
     for (s64 i = 0; i < s->length; ++i) {
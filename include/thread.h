@@ -0,0 +1,97 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "kernel.h"
+#include "spinlock.h"
+#include "timer.h"
+
+struct Cpu;
+
+// Kernel threads, scheduled round-robin on every cpu. A thread runs until it blocks, yields or its time slice
+// runs out; the slice is only armed while another thread is waiting to run on the same cpu. Switches happen
+// with interrupts disabled, either from one of the calls below or on the way out of an irq, after its EOI.
+
+#define THREAD_STACK_SIZE     (PAGE_SIZE * 4)
+#define THREAD_FPU_STATE_SIZE 512 // fxsave, fnsave only needs 108
+#define THREAD_TIME_SLICE_NS  10000000
+
+enum THREAD_STATE {
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+};
+
+typedef void (*thread_entry_type)(void *arg);
+
+struct Thread {
+    u32 esp; // saved by _switch_stack()
+    u8 *fpu_state; // THREAD_FPU_STATE_SIZE bytes, 16 byte aligned
+    void *stack;   // null for the thread kernel_main runs on
+    
+    String name;
+    u32 id;
+    THREAD_STATE state;
+    u32 switches; // times it was switched to
+    
+    Cpu *cpu; // whose run queue it is in, or the cpu it last ran on
+    volatile bool on_cpu; // until the cpu that switched away from it is off its stack
+    
+    thread_entry_type entry;
+    void *arg;
+    
+    Thread *next; // in the run queue, or in the list of dead threads
+    Timer sleep_timer;
+};
+
+// turns the flow of control we are on into the first thread and starts the idle thread, needs the heap and timer_init()
+void threads_init();
+
+// on the bootstrap cpu, before it starts cpu. Makes its idle thread and returns the top of the stack the cpu
+// is to start on, which is that of its idle thread
+u32 threads_prepare_cpu(Cpu *cpu);
+
+// on the new cpu, with interrupts disabled: the flow of control it came up on is its idle thread from now on
+void threads_init_ap();
+void threads_run_idle(); // never returns
+
+// the thread is ready to run right away. Returning from entry is the same as calling thread_exit()
+Thread *thread_create(String name, thread_entry_type entry, void *arg);
+void thread_exit();
+
+Thread *thread_current();
+void thread_yield();
+
+// Blocking takes two steps, with interrupts disabled throughout: thread_prepare_block() marks us as blocked,
+// then we check whether we still have to wait and call thread_block(). A thread_wake() from another cpu in
+// between isn't lost, it makes thread_block() return right away. To not block after all, thread_wake()
+// yourself before thread_block().
+void thread_prepare_block();
+void thread_block();
+
+// thread_block(), but wakes up by itself at deadline_ns. Either may return early, check why you were woken.
+void thread_block_until(u64 deadline_ns);
+
+// does nothing unless the thread is blocked, may be called from irq handlers and timer callbacks
+void thread_wake(Thread *thread);
+
+void thread_sleep_until(u64 deadline_ns);
+
+// called by the irq stubs after their EOI, switches if a wakeup or the time slice asked for it
+void thread_preempt();
+
+struct Cpu_Sched_Stats {
+    u32 apic_id;
+    String current;
+    u64 online_ns; // since it came online
+    u64 idle_ns;   // of that, running its idle thread
+    u32 switches;
+    u32 steals;
+    u32 queue_length;
+    Lock_Stats run_queue_lock;
+};
+
+// a snapshot of one of the cpu_count cpus that are online, the numbers aren't taken atomically
+Cpu_Sched_Stats thread_get_cpu_stats(u32 cpu_index);
+
+#endif
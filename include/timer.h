@@ -0,0 +1,47 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "kernel.h"
+
+// Timeouts. Deadlines are absolute, in nanoseconds of clock_monotonic_ns(). With a local APIC its timer runs
+// in one-shot mode and is armed for the earliest pending deadline, nothing interrupts the cpu in between.
+// Without one the PIT ticks at TIMER_PIT_FALLBACK_HZ and deadlines are only as exact as its period.
+
+#define TIMER_PIT_FALLBACK_HZ 1000
+
+// runs inside the timer interrupt with interrupts disabled, keep it short and away from the fpu
+typedef void (*timer_callback_type)(void *data);
+
+// the heap links live in the Timer, so any number of them can be pending. A zeroed Timer is a stopped one.
+struct Timer {
+    u64 deadline_ns;
+    timer_callback_type callback;
+    void *data;
+    
+    bool pending;
+    Timer *heap_child;   // the first of the timers below this one
+    Timer *heap_sibling; // the next one with the same parent
+    Timer *heap_prev;    // the previous sibling, or the parent if this is its first child
+};
+
+// calibrates the TSC and, if switch_irqs_to_apic() succeeded, the local APIC timer against the PIT. Without
+// an APIC the PIT drives the timeouts.
+void timer_init();
+
+// nanoseconds since timer_init(). With a TSC this is an rdtsc and two multiplications, no port or
+// register is read
+u64 clock_monotonic_ns();
+
+// busy waits, usable with interrupts disabled. They fall back to port writes without a TSC and before timer_init()
+void udelay(u32 us);
+void mdelay(u32 ms);
+
+// (re)starts the timer. A deadline that has already passed fires on the next timer interrupt
+void timer_start(Timer *timer, u64 deadline_ns, timer_callback_type callback, void *data);
+void timer_cancel(Timer *timer);
+bool timer_pending(Timer *timer);
+
+// called by the stub of LAPIC_TIMER_VECTOR
+void lapic_timer_interrupt();
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef WAIT_QUEUE_H
+#define WAIT_QUEUE_H
+
+#include "kernel.h"
+#include "spinlock.h"
+
+struct Thread;
+
+// Threads blocked until somebody else lets them go on, in the order they started waiting. The entries
+// live on the stacks of the waiting threads. Waking never blocks, so it may be done from irq handlers and
+// timer callbacks; waiting can only be done by a thread other than an idle thread.
+//
+// Deadlines are clock_monotonic_ns() values like everywhere else, 0 is no deadline.
+
+struct Wait_Entry {
+    Thread *thread;
+    Wait_Entry *next;
+    bool queued;
+};
+
+struct Wait_Queue {
+    Spin_Lock lock; // also covers whatever the waiters are waiting for, see wait_queue_wait()
+    Wait_Entry *head;
+    Wait_Entry *tail;
+};
+
+// called with the lock of the queue held, returns true once what we wait for is there and takes it
+typedef bool (*wait_condition_type)(void *data);
+
+// blocks until try_take(data) returns true or the deadline passes, returns false in the latter case. Whoever
+// makes the condition true has to do so with queue->lock held and wake the queue after.
+bool wait_queue_wait(Wait_Queue *queue, wait_condition_type try_take, void *data, u64 deadline_ns);
+
+void wait_queue_wake_one(Wait_Queue *queue);
+void wait_queue_wake_all(Wait_Queue *queue);
+
+// Counts complete() calls, every completion_wait() takes one. A zeroed Completion has nothing to take.
+struct Completion {
+    Wait_Queue waiters;
+    u32 done;
+};
+
+void completion_reset(Completion *completion);
+void complete(Completion *completion);
+bool completion_wait(Completion *completion, u64 deadline_ns);
+
+// A lock that sleeps instead of spinning, for holding across I/O. Not for irq handlers.
+struct Mutex {
+    Wait_Queue waiters;
+    Thread *owner;
+};
+
+void mutex_lock(Mutex *mutex);
+void mutex_unlock(Mutex *mutex);
+
+#endif
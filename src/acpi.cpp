@@ -0,0 +1,136 @@
+#include "kernel.h"
+#include "acpi.h"
+
+// Tables below the end of the direct map are read through it. The firmware usually puts them near the top
+// of memory though, so anything above gets mapped into a window at ACPI_TABLE_VIRTUAL_ADDRESS. The tables
+// are only read during boot, so the window is a bump allocator that never unmaps anything.
+
+#define ACPI_EBDA_SEGMENT_POINTER 0x40E
+#define ACPI_BIOS_AREA_START 0xE0000
+#define ACPI_BIOS_AREA_END   0x100000
+
+struct {
+    Acpi_Rsdp *rsdp;
+    Acpi_Sdt_Header *root; // the XSDT if there is a usable one, the RSDT otherwise
+    u32 root_entry_size;   // 8 for the XSDT, 4 for the RSDT
+    u32 window_used;
+} acpi;
+
+static void *acpi_map(u32 physical, u32 size) {
+    if (physical_to_virtual(physical) && physical_to_virtual(physical + size - 1)) return physical_to_virtual(physical);
+    
+    u32 first_page = physical & ~(PAGE_SIZE-1);
+    u32 num_pages = (physical + size - first_page + (PAGE_SIZE-1)) / PAGE_SIZE;
+    kassert(acpi.window_used + num_pages * PAGE_SIZE <= ACPI_TABLE_MAX_SIZE && "acpi tables dont fit into their window");
+    
+    u32 virtual_addr = ACPI_TABLE_VIRTUAL_ADDRESS + acpi.window_used;
+    map_range(first_page, virtual_addr, num_pages, 0);
+    acpi.window_used += num_pages * PAGE_SIZE;
+    
+    return reinterpret_cast<void *>(virtual_addr + (physical - first_page));
+}
+
+static bool acpi_checksum_ok(void *data, u32 length) {
+    u8 *bytes = reinterpret_cast<u8 *>(data);
+    u8 sum = 0;
+    for (u32 i = 0; i < length; ++i) sum += bytes[i];
+    return sum == 0;
+}
+
+static bool signature_matches(char *a, char *b, u32 length) {
+    for (u32 i = 0; i < length; ++i) {
+        if (a[i] != b[i]) return false;
+    }
+    return true;
+}
+
+// the RSDP sits on a 16 byte boundary
+static Acpi_Rsdp *acpi_scan_for_rsdp(u32 start, u32 end) {
+    for (u32 addr = start; addr + 20 <= end; addr += 16) {
+        Acpi_Rsdp *rsdp = reinterpret_cast<Acpi_Rsdp *>(physical_to_virtual(addr));
+        if (!rsdp) return nullptr;
+        
+        if (signature_matches(rsdp->signature, "RSD PTR ", 8) && acpi_checksum_ok(rsdp, 20)) return rsdp;
+    }
+    
+    return nullptr;
+}
+
+static Acpi_Sdt_Header *acpi_map_table(u32 physical) {
+    Acpi_Sdt_Header *header = reinterpret_cast<Acpi_Sdt_Header *>(acpi_map(physical, sizeof(Acpi_Sdt_Header)));
+    if (header->length < sizeof(Acpi_Sdt_Header)) return nullptr;
+    
+    header = reinterpret_cast<Acpi_Sdt_Header *>(acpi_map(physical, header->length));
+    if (!acpi_checksum_ok(header, header->length)) return nullptr;
+    return header;
+}
+
+bool acpi_init() {
+    acpi.rsdp = nullptr;
+    acpi.root = nullptr;
+    acpi.root_entry_size = 0;
+    acpi.window_used = 0;
+    
+    u16 *ebda_segment = reinterpret_cast<u16 *>(physical_to_virtual(ACPI_EBDA_SEGMENT_POINTER));
+    if (ebda_segment && *ebda_segment) {
+        u32 ebda = static_cast<u32>(*ebda_segment) << 4;
+        acpi.rsdp = acpi_scan_for_rsdp(ebda, ebda + 1024);
+    }
+    
+    if (!acpi.rsdp) acpi.rsdp = acpi_scan_for_rsdp(ACPI_BIOS_AREA_START, ACPI_BIOS_AREA_END);
+    if (!acpi.rsdp) {
+        kprint("acpi: no RSDP\n");
+        return false;
+    }
+    
+    // From ACPI 2.0 on the XSDT is the one to go by, the RSDT may be missing or out of date. We can only
+    // map it if it is below 4GiB.
+    Acpi_Rsdp *rsdp = acpi.rsdp;
+    bool extended = rsdp->revision >= 2 && rsdp->length >= sizeof(Acpi_Rsdp) && acpi_checksum_ok(rsdp, rsdp->length);
+    if (extended && rsdp->xsdt_address && (rsdp->xsdt_address >> 32) == 0) {
+        u32 xsdt_address = static_cast<u32>(rsdp->xsdt_address);
+        Acpi_Sdt_Header *xsdt = acpi_map_table(xsdt_address);
+        if (xsdt && signature_matches(xsdt->signature, "XSDT", 4)) {
+            acpi.root = xsdt;
+            acpi.root_entry_size = sizeof(u64);
+            kprint("acpi: revision %u, XSDT at %X\n", rsdp->revision, xsdt_address);
+            return true;
+        }
+        
+        kprint("acpi: XSDT at %X is broken, trying the RSDT\n", xsdt_address);
+    }
+    
+    Acpi_Sdt_Header *rsdt = acpi_map_table(rsdp->rsdt_address);
+    if (!rsdt || !signature_matches(rsdt->signature, "RSDT", 4)) {
+        kprint("acpi: RSDT at %X is broken\n", rsdp->rsdt_address);
+        return false;
+    }
+    
+    acpi.root = rsdt;
+    acpi.root_entry_size = sizeof(u32);
+    kprint("acpi: revision %u, RSDT at %X\n", rsdp->revision, rsdp->rsdt_address);
+    return true;
+}
+
+Acpi_Sdt_Header *acpi_find_table(char *signature) {
+    if (!acpi.root) return nullptr;
+    
+    u32 count = (acpi.root->length - sizeof(Acpi_Sdt_Header)) / acpi.root_entry_size;
+    u8 *entries = reinterpret_cast<u8 *>(acpi.root + 1);
+    
+    for (u32 i = 0; i < count; ++i) {
+        // the XSDT entries are only 4 byte aligned
+        u64 address;
+        if (acpi.root_entry_size == sizeof(u64)) address = *reinterpret_cast<u64 *>(entries + i * sizeof(u64));
+        else                                     address = *reinterpret_cast<u32 *>(entries + i * sizeof(u32));
+        if (address >> 32) continue; // out of our reach
+        
+        u32 physical = static_cast<u32>(address);
+        Acpi_Sdt_Header *header = reinterpret_cast<Acpi_Sdt_Header *>(acpi_map(physical, sizeof(Acpi_Sdt_Header)));
+        if (!signature_matches(header->signature, signature, 4)) continue;
+        
+        return acpi_map_table(physical);
+    }
+    
+    return nullptr;
+}
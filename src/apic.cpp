@@ -0,0 +1,308 @@
+#include "kernel.h"
+#include "cpu.h"
+#include "acpi.h"
+#include "apic.h"
+#include "interrupts.h"
+#include "spinlock.h"
+
+// The local APIC and the IOAPICs are found through the MADT ("APIC" table). Each IOAPIC input is a global
+// system interrupt (GSI); the ISA irqs are identity mapped onto the first 16 unless the MADT has an
+// override for them, which may also change their polarity and trigger mode. QEMU, for one, moves the PIT
+// from irq 0 to GSI 2.
+//
+// Every irq is delivered to the bootstrap cpu, on vector IRQ_VECTOR_BASE + irq, so the stubs in
+// interrupts.cpp stay the same as with the 8259s. The other cpus only get IPIs.
+
+#define MADT_FLAG_PCAT_COMPAT 1 // there are 8259s as well, they have to be masked
+
+#define MADT_ENTRY_LOCAL_APIC          0
+#define MADT_ENTRY_IO_APIC             1
+#define MADT_ENTRY_SOURCE_OVERRIDE     2
+#define MADT_ENTRY_LOCAL_APIC_OVERRIDE 5
+
+#define MADT_LOCAL_APIC_ENABLED        (1 << 0)
+#define MADT_LOCAL_APIC_ONLINE_CAPABLE (1 << 1)
+
+// polarity and trigger mode in the flags of an override, 0 means whatever the bus does
+#define MADT_POLARITY_MASK     0x3
+#define MADT_POLARITY_LOW      0x3
+#define MADT_TRIGGER_MASK      0xC
+#define MADT_TRIGGER_LEVEL     0xC
+
+#define IOAPIC_REGISTER_SELECT 0x00
+#define IOAPIC_REGISTER_WINDOW 0x10
+
+#define IOAPIC_ID              0x00
+#define IOAPIC_VERSION         0x01
+#define IOAPIC_REDIRECTION(n)  (0x10 + 2 * (n))
+
+#define IOAPIC_ACTIVE_LOW      (1 << 13)
+#define IOAPIC_LEVEL_TRIGGERED (1 << 15)
+#define IOAPIC_MASKED          (1 << 16)
+
+struct PACKED Madt {
+    Acpi_Sdt_Header header;
+    u32 local_apic_address;
+    u32 flags;
+};
+
+struct PACKED Madt_Entry {
+    u8 type;
+    u8 length;
+};
+
+struct PACKED Madt_Local_Apic {
+    Madt_Entry entry;
+    u8 processor_id;
+    u8 apic_id;
+    u32 flags;
+};
+
+struct PACKED Madt_Io_Apic {
+    Madt_Entry entry;
+    u8 io_apic_id;
+    u8 reserved;
+    u32 address;
+    u32 gsi_base;
+};
+
+struct PACKED Madt_Source_Override {
+    Madt_Entry entry;
+    u8 bus;
+    u8 source;
+    u32 gsi;
+    u16 flags;
+};
+
+struct PACKED Madt_Local_Apic_Override {
+    Madt_Entry entry;
+    u16 reserved;
+    u64 address;
+};
+
+struct Io_Apic {
+    volatile u32 *registers; // a select and a window register, the two writes must not interleave with another cpu's
+    Spin_Lock lock;
+    u32 gsi_base;
+    u32 gsi_count;
+};
+
+struct {
+    volatile u32 *local_apic;
+    u32 bsp_id;
+    
+    Io_Apic io_apics[APIC_MAX_IO_APICS];
+    u32 io_apic_count;
+    
+    u32 isa_gsi[16];
+    u16 isa_flags[16];
+    
+    u32 cpu_ids[APIC_MAX_CPUS];
+    u32 cpu_count;
+} apic;
+
+u32 lapic_read(u32 reg) {
+    return apic.local_apic[reg / 4];
+}
+
+void lapic_write(u32 reg, u32 value) {
+    apic.local_apic[reg / 4] = value;
+}
+
+void lapic_eoi() {
+    apic.local_apic[LAPIC_EOI / 4] = 0;
+}
+
+u32 lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_init_ap() {
+    u64 base = _read_msr(MSR_IA32_APIC_BASE);
+    _write_msr(MSR_IA32_APIC_BASE, base | APIC_BASE_ENABLE);
+    
+    lapic_write(LAPIC_TASK_PRIORITY, 0);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_SPURIOUS_VECTOR, LAPIC_SPURIOUS_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+// with interrupts disabled, somebody else on this cpu could get in between the two halves otherwise
+static void lapic_send_command(u32 apic_id, u32 command) {
+    while (lapic_read(LAPIC_INTERRUPT_COMMAND_LOW) & LAPIC_ICR_SEND_PENDING) asm volatile("pause");
+    
+    lapic_write(LAPIC_INTERRUPT_COMMAND_HIGH, apic_id << 24);
+    lapic_write(LAPIC_INTERRUPT_COMMAND_LOW, command);
+    
+    while (lapic_read(LAPIC_INTERRUPT_COMMAND_LOW) & LAPIC_ICR_SEND_PENDING) asm volatile("pause");
+}
+
+void lapic_send_ipi(u32 apic_id, u8 vector) {
+    u32 eflags = DISABLE_INTERRUPTS();
+    lapic_send_command(apic_id, LAPIC_ICR_FIXED | LAPIC_ICR_ASSERT | vector);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+void lapic_send_init(u32 apic_id) {
+    u32 eflags = DISABLE_INTERRUPTS();
+    lapic_write(LAPIC_ERROR_STATUS, 0);
+    lapic_send_command(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL | LAPIC_ICR_ASSERT);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+void lapic_send_startup(u32 apic_id, u32 physical_page) {
+    kassert((physical_page & (PAGE_SIZE-1)) == 0 && physical_page < 0x100000);
+    
+    u32 eflags = DISABLE_INTERRUPTS();
+    lapic_write(LAPIC_ERROR_STATUS, 0);
+    lapic_send_command(apic_id, LAPIC_ICR_STARTUP | (physical_page >> 12));
+    RESTORE_INTERRUPTS(eflags);
+}
+
+u32 apic_cpu_count() {
+    return apic.cpu_count;
+}
+
+u32 apic_cpu_id(u32 index) {
+    kassert(index < apic.cpu_count);
+    return apic.cpu_ids[index];
+}
+
+static u32 ioapic_read(Io_Apic *io_apic, u32 reg) {
+    io_apic->registers[IOAPIC_REGISTER_SELECT / 4] = reg;
+    return io_apic->registers[IOAPIC_REGISTER_WINDOW / 4];
+}
+
+static void ioapic_write(Io_Apic *io_apic, u32 reg, u32 value) {
+    io_apic->registers[IOAPIC_REGISTER_SELECT / 4] = reg;
+    io_apic->registers[IOAPIC_REGISTER_WINDOW / 4] = value;
+}
+
+static Io_Apic *ioapic_for_gsi(u32 gsi) {
+    for (u32 i = 0; i < apic.io_apic_count; ++i) {
+        Io_Apic *io_apic = &apic.io_apics[i];
+        if (gsi >= io_apic->gsi_base && gsi < io_apic->gsi_base + io_apic->gsi_count) return io_apic;
+    }
+    
+    return nullptr;
+}
+
+void ioapic_set_masked(s32 irq, bool masked) {
+    kassert(irq >= 0 && irq < IRQ_COUNT);
+    
+    // ISA irqs are edge triggered and active high unless overridden, PCI ones are level triggered and active low
+    u32 gsi = static_cast<u32>(irq);
+    u32 low = IRQ_VECTOR_BASE + irq;
+    if (irq < 16) {
+        gsi = apic.isa_gsi[irq];
+        if ((apic.isa_flags[irq] & MADT_POLARITY_MASK) == MADT_POLARITY_LOW) low |= IOAPIC_ACTIVE_LOW;
+        if ((apic.isa_flags[irq] & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL) low |= IOAPIC_LEVEL_TRIGGERED;
+    } else {
+        low |= IOAPIC_ACTIVE_LOW | IOAPIC_LEVEL_TRIGGERED;
+    }
+    
+    if (masked) low |= IOAPIC_MASKED;
+    
+    Io_Apic *io_apic = ioapic_for_gsi(gsi);
+    if (!io_apic) {
+        kprint("apic: no IOAPIC has GSI %u for irq %d\n", gsi, irq);
+        return;
+    }
+    
+    u32 pin = gsi - io_apic->gsi_base;
+    u32 eflags = spin_lock_irqsave(&io_apic->lock);
+    
+    // masked while we change it, the high half holds the destination
+    ioapic_write(io_apic, IOAPIC_REDIRECTION(pin), IOAPIC_MASKED);
+    ioapic_write(io_apic, IOAPIC_REDIRECTION(pin) + 1, apic.bsp_id << 24);
+    ioapic_write(io_apic, IOAPIC_REDIRECTION(pin), low);
+    
+    spin_unlock_irqrestore(&io_apic->lock, eflags);
+}
+
+static void apic_parse_madt(Madt *madt, u32 *local_apic_physical) {
+    *local_apic_physical = madt->local_apic_address;
+    
+    u8 *at = reinterpret_cast<u8 *>(madt + 1);
+    u8 *end = reinterpret_cast<u8 *>(madt) + madt->header.length;
+    
+    while (at + sizeof(Madt_Entry) <= end) {
+        Madt_Entry *entry = reinterpret_cast<Madt_Entry *>(at);
+        if (entry->length < sizeof(Madt_Entry) || at + entry->length > end) break;
+        
+        if (entry->type == MADT_ENTRY_LOCAL_APIC) {
+            Madt_Local_Apic *local = reinterpret_cast<Madt_Local_Apic *>(entry);
+            bool usable = (local->flags & (MADT_LOCAL_APIC_ENABLED | MADT_LOCAL_APIC_ONLINE_CAPABLE)) != 0;
+            if (usable && apic.cpu_count < APIC_MAX_CPUS) apic.cpu_ids[apic.cpu_count++] = local->apic_id;
+        } else if (entry->type == MADT_ENTRY_IO_APIC) {
+            Madt_Io_Apic *io = reinterpret_cast<Madt_Io_Apic *>(entry);
+            if (apic.io_apic_count < APIC_MAX_IO_APICS) {
+                Io_Apic *io_apic = &apic.io_apics[apic.io_apic_count];
+                u32 virtual_addr = APIC_VIRTUAL_ADDRESS + (1 + apic.io_apic_count) * PAGE_SIZE;
+                
+                // IOAPICs are 1KiB aligned, not page aligned
+                map_range(io->address & ~(PAGE_SIZE-1), virtual_addr, 1, PAGE_READ_WRITE | PAGE_DO_NOT_CACHE | PAGE_USE_WRITE_THROUGH | PAGE_GLOBAL_BIT);
+                io_apic->registers = reinterpret_cast<volatile u32 *>(virtual_addr + (io->address & (PAGE_SIZE-1)));
+                io_apic->gsi_base = io->gsi_base;
+                io_apic->gsi_count = ((ioapic_read(io_apic, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+                apic.io_apic_count++;
+            }
+        } else if (entry->type == MADT_ENTRY_SOURCE_OVERRIDE) {
+            Madt_Source_Override *override = reinterpret_cast<Madt_Source_Override *>(entry);
+            if (override->bus == 0 && override->source < 16) {
+                apic.isa_gsi[override->source] = override->gsi;
+                apic.isa_flags[override->source] = override->flags;
+            }
+        } else if (entry->type == MADT_ENTRY_LOCAL_APIC_OVERRIDE) {
+            Madt_Local_Apic_Override *override = reinterpret_cast<Madt_Local_Apic_Override *>(entry);
+            if ((override->address >> 32) == 0) *local_apic_physical = static_cast<u32>(override->address);
+        }
+        
+        at += entry->length;
+    }
+}
+
+bool apic_init() {
+    if (!cpu_features.apic) return false;
+    
+    Madt *madt = reinterpret_cast<Madt *>(acpi_find_table("APIC"));
+    if (!madt) {
+        kprint("apic: no MADT\n");
+        return false;
+    }
+    
+    apic.io_apic_count = 0;
+    apic.cpu_count = 0;
+    for (u32 i = 0; i < 16; ++i) {
+        apic.isa_gsi[i] = i;
+        apic.isa_flags[i] = 0;
+    }
+    
+    u32 local_apic_physical = 0;
+    apic_parse_madt(madt, &local_apic_physical);
+    
+    if (!apic.io_apic_count) {
+        kprint("apic: the MADT lists no IOAPIC\n");
+        return false;
+    }
+    
+    map_range(local_apic_physical, APIC_VIRTUAL_ADDRESS, 1, PAGE_READ_WRITE | PAGE_DO_NOT_CACHE | PAGE_USE_WRITE_THROUGH | PAGE_GLOBAL_BIT);
+    apic.local_apic = reinterpret_cast<volatile u32 *>(APIC_VIRTUAL_ADDRESS);
+    
+    u64 base = _read_msr(MSR_IA32_APIC_BASE);
+    _write_msr(MSR_IA32_APIC_BASE, base | APIC_BASE_ENABLE);
+    
+    apic.bsp_id = lapic_id();
+    lapic_write(LAPIC_TASK_PRIORITY, 0);
+    lapic_write(LAPIC_SPURIOUS_VECTOR, LAPIC_SPURIOUS_ENABLE | APIC_SPURIOUS_VECTOR);
+    
+    for (u32 i = 0; i < apic.io_apic_count; ++i) {
+        Io_Apic *io_apic = &apic.io_apics[i];
+        for (u32 pin = 0; pin < io_apic->gsi_count; ++pin) {
+            ioapic_write(io_apic, IOAPIC_REDIRECTION(pin), IOAPIC_MASKED);
+        }
+    }
+    
+    kprint("apic: local APIC %u at %X, %u cpus, %u IOAPICs, pcat compat %u\n", apic.bsp_id, local_apic_physical,
+           apic.cpu_count, apic.io_apic_count, madt->flags & MADT_FLAG_PCAT_COMPAT);
+    return true;
+}
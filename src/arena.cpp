@@ -0,0 +1,78 @@
+#include "kernel.h"
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_BLOCK_HEADER_SIZE ((sizeof(Arena_Block) + (ARENA_ALIGNMENT-1)) & ~(ARENA_ALIGNMENT-1))
+
+static Arena_Block *arena_new_block(u32 size) {
+    Arena_Block *block = reinterpret_cast<Arena_Block *>(heap_alloc(ARENA_BLOCK_HEADER_SIZE + size));
+    kassert(block && "out of memory for an arena block");
+    
+    block->next = nullptr;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+static u8 *arena_block_data(Arena_Block *block) {
+    return reinterpret_cast<u8 *>(block) + ARENA_BLOCK_HEADER_SIZE;
+}
+
+void *arena_alloc(Arena *arena, u32 size) {
+    size = (size + (ARENA_ALIGNMENT-1)) & ~(ARENA_ALIGNMENT-1);
+    
+    Arena_Block *block = arena->current;
+    if (!block || block->size - block->used < size) {
+        Arena_Block *grown = arena_new_block(size > arena->block_size ? size : arena->block_size);
+        grown->next = block;
+        arena->current = grown;
+        block = grown;
+    }
+    
+    void *result = arena_block_data(block) + block->used;
+    block->used += size;
+    arena->last = result;
+    return result;
+}
+
+bool arena_resize(Arena *arena, void *mem, u32 size) {
+    if (!mem || mem != arena->last) return false;
+    
+    size = (size + (ARENA_ALIGNMENT-1)) & ~(ARENA_ALIGNMENT-1);
+    
+    Arena_Block *block = arena->current;
+    u32 offset = static_cast<u32>(reinterpret_cast<u8 *>(mem) - arena_block_data(block));
+    if (block->size - offset < size) return false;
+    
+    block->used = offset + size;
+    return true;
+}
+
+void arena_reset(Arena *arena) {
+    arena->last = nullptr;
+    
+    Arena_Block *block = arena->current;
+    if (!block) return;
+    
+    if (block->next) {
+        u32 total = 0;
+        for (Arena_Block *it = block; it; it = it->next) total += it->size;
+        
+        arena_free_all(arena);
+        arena->current = arena_new_block(total);
+    } else {
+        block->used = 0;
+    }
+}
+
+void arena_free_all(Arena *arena) {
+    Arena_Block *block = arena->current;
+    while (block) {
+        Arena_Block *next = block->next;
+        heap_free(block);
+        block = next;
+    }
+    
+    arena->current = nullptr;
+    arena->last = nullptr;
+}
@@ -73,6 +73,16 @@ flush_tlb:
 	mov cr3, eax
 	ret
 
+; with CR4.PGE on a cr3 reload keeps global entries, toggling PGE drops them too
+global flush_tlb_global
+flush_tlb_global:
+	mov eax, cr4
+	mov ecx, eax
+	and ecx, ~0x80
+	mov cr4, ecx
+	mov cr4, eax
+	ret
+
 global load_page_directory
 load_page_directory:
 	mov eax, [esp+4]
@@ -179,3 +189,153 @@ _write_eflags:
 	popfd
 	ret
 
+; void _cpuid(u32 leaf, u32 subleaf, u32 *regs), regs gets eax, ebx, ecx, edx
+global _cpuid
+_cpuid:
+	push ebx
+	push edi
+	mov eax, [esp+12]
+	mov ecx, [esp+16]
+	cpuid
+	mov edi, [esp+20]
+	mov [edi], eax
+	mov [edi+4], ebx
+	mov [edi+8], ecx
+	mov [edi+12], edx
+	pop edi
+	pop ebx
+	ret
+
+global _read_cr0
+_read_cr0:
+	mov eax, cr0
+	ret
+
+global _write_cr0
+_write_cr0:
+	mov eax, [esp+4]
+	mov cr0, eax
+	ret
+
+; the address that caused the last page fault
+global _read_cr2
+_read_cr2:
+	mov eax, cr2
+	ret
+
+global _read_cr4
+_read_cr4:
+	mov eax, cr4
+	ret
+
+global _write_cr4
+_write_cr4:
+	mov eax, [esp+4]
+	mov cr4, eax
+	ret
+
+; u64 _read_tsc(), the time stamp counter in edx:eax
+global _read_tsc
+_read_tsc:
+	rdtsc
+	ret
+
+; void _switch_stack(u32 *old_esp, u32 new_esp), returns on the other stack. Everything else a thread
+; needs to keep is either caller saved or saved by thread.cpp
+global _switch_stack
+_switch_stack:
+	mov eax, [esp+4]
+	mov ecx, [esp+8]
+	push ebp
+	push ebx
+	push esi
+	push edi
+	mov [eax], esp
+	mov esp, ecx
+	pop edi
+	pop esi
+	pop ebx
+	pop ebp
+	ret
+
+; u64 _read_msr(u32 msr)
+global _read_msr
+_read_msr:
+	mov ecx, [esp+4]
+	rdmsr
+	ret
+
+; void _write_msr(u32 msr, u64 value)
+global _write_msr
+_write_msr:
+	mov ecx, [esp+4]
+	mov eax, [esp+8]
+	mov edx, [esp+12]
+	wrmsr
+	ret
+
+
+; The other cpus start here, in real mode at AP_TRAMPOLINE_ADDRESS, where smp.cpp copies everything up to
+; ap_trampoline_end. They switch to protected mode on a GDT of their own, turn on paging with the cr3 and
+; cr4 smp.cpp left in the params and jump to the entry point on the stack it gave them. Addresses have to
+; be computed for where the copy runs, not where the linker put us.
+; @Volatile AP_TRAMPOLINE_ADDRESS in smp.h, and Ap_Trampoline_Params in smp.cpp
+AP_TRAMPOLINE_ADDRESS equ 0x8000
+%define AP_ADDRESS(label) (AP_TRAMPOLINE_ADDRESS + (label) - ap_trampoline_start)
+
+bits 16
+global ap_trampoline_start
+ap_trampoline_start:
+	cli
+	cld
+	xor ax, ax
+	mov ds, ax
+	o32 lgdt [AP_ADDRESS(ap_trampoline_gdtr)]
+	
+	; a cpu comes out of INIT with its caches disabled, CD and NW are cleared on the way
+	mov eax, cr0
+	and eax, ~0x60000000
+	or eax, 1
+	mov cr0, eax
+	jmp dword 0x08:AP_ADDRESS(ap_trampoline_32)
+
+bits 32
+ap_trampoline_32:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+	
+	; cr4 first, the kernel mappings use 4MiB pages
+	mov eax, [AP_ADDRESS(ap_trampoline_params) + 4]
+	mov cr4, eax
+	mov eax, [AP_ADDRESS(ap_trampoline_params)]
+	mov cr3, eax
+	mov eax, cr0
+	or eax, 0x80000000
+	mov cr0, eax
+	
+	mov esp, [AP_ADDRESS(ap_trampoline_params) + 8]
+	mov eax, [AP_ADDRESS(ap_trampoline_params) + 12]
+	jmp eax
+
+align 8
+ap_trampoline_gdt:
+	dq 0
+	dq 0x00CF9A000000FFFF ; flat code
+	dq 0x00CF92000000FFFF ; flat data
+ap_trampoline_gdtr:
+	dw 3 * 8 - 1
+	dd AP_ADDRESS(ap_trampoline_gdt)
+
+align 4
+global ap_trampoline_params
+ap_trampoline_params:
+	dd 0 ; cr3
+	dd 0 ; cr4
+	dd 0 ; stack
+	dd 0 ; entry
+global ap_trampoline_end
+ap_trampoline_end:
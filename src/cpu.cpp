@@ -0,0 +1,172 @@
+#include "kernel.h"
+#include "cpu.h"
+#include "smp.h"
+
+Cpu_Features cpu_features;
+
+// cpu_features.sse2 is only set once the bootstrap cpu enabled it
+static bool sse_supported;
+
+// PA0-PA3 are the power-on defaults so that the PWT/PCD bits keep their old meaning,
+// PA4 (PAT bit set, PWT and PCD clear) is the one PAGE_WRITE_COMBINING selects
+#define PAT_ENTRY(index, type) ((u64) (type) << ((index) * 8))
+#define PAT_VALUE (PAT_ENTRY(0, MEMORY_TYPE_WRITE_BACK) | PAT_ENTRY(1, MEMORY_TYPE_WRITE_THROUGH) | \
+                   PAT_ENTRY(2, MEMORY_TYPE_UNCACHED) | PAT_ENTRY(3, MEMORY_TYPE_UNCACHEABLE) | \
+                   PAT_ENTRY(4, MEMORY_TYPE_WRITE_COMBINING) | PAT_ENTRY(5, MEMORY_TYPE_WRITE_THROUGH) | \
+                   PAT_ENTRY(6, MEMORY_TYPE_UNCACHED) | PAT_ENTRY(7, MEMORY_TYPE_UNCACHEABLE))
+
+// the variable MTRRs cpu_add_write_combining_range() programmed, cpu_init_ap() gives every other cpu the same
+#define CPU_MAX_WRITE_COMBINING_MTRRS 8
+
+static struct {
+    u32 index;
+    u64 base;
+    u64 mask;
+} write_combining_mtrrs[CPU_MAX_WRITE_COMBINING_MTRRS];
+
+static u32 write_combining_mtrr_count;
+
+// the sequence from the SDM (11.11.7.2): no-fill cache mode, flush the caches and the TLB, turn the MTRRs
+// off while we change them, flush again and turn everything back on. The SDM wants all cpus to do this
+// together, which they do as long as only one is running: the bootstrap cpu before smp_start_aps(), then
+// each AP in cpu_init_ap() before anybody else can see it.
+static void write_variable_mtrr(u32 index, u64 base, u64 mask) {
+    u32 eflags = DISABLE_INTERRUPTS();
+    
+    u32 cr0 = _read_cr0();
+    _write_cr0((cr0 | CR0_CACHE_DISABLE) & ~CR0_NOT_WRITE_THROUGH);
+    asm volatile("wbinvd" ::: "memory");
+    
+    // turning off PGE drops the global entries as well, without it a cr3 reload does
+    u32 cr4 = _read_cr4();
+    if (cr4 & CR4_PGE) _write_cr4(cr4 & ~CR4_PGE);
+    else               tlb_flush_address_space();
+    
+    u64 def_type = _read_msr(MSR_IA32_MTRR_DEF_TYPE);
+    _write_msr(MSR_IA32_MTRR_DEF_TYPE, def_type & ~(u64) MTRR_DEF_TYPE_ENABLE);
+    
+    _write_msr(MSR_IA32_MTRR_PHYSBASE(index), base);
+    _write_msr(MSR_IA32_MTRR_PHYSMASK(index), mask);
+    
+    asm volatile("wbinvd" ::: "memory");
+    tlb_flush_address_space();
+    _write_msr(MSR_IA32_MTRR_DEF_TYPE, def_type);
+    
+    _write_cr0(cr0);
+    _write_cr4(cr4);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+bool cpu_add_write_combining_range(u32 physical, u32 size) {
+    if (!cpu_features.mtrr) return false;
+    
+    u64 capabilities = _read_msr(MSR_IA32_MTRRCAP);
+    if (!(capabilities & MTRRCAP_WRITE_COMBINING)) return false;
+    
+    if (size == 0 || (size & (size - 1)) || (physical & (size - 1))) return false;
+    
+    u64 address_mask = (1ull << cpu_features.physical_address_bits) - 1;
+    u64 base = (u64) physical | MEMORY_TYPE_WRITE_COMBINING;
+    u64 mask = (address_mask & ~((u64) size - 1)) | MTRR_PHYSMASK_VALID;
+    
+    u32 count = (u32) (capabilities & MTRRCAP_VARIABLE_COUNT_MASK);
+    for (u32 i = 0; i < count; ++i) {
+        if (_read_msr(MSR_IA32_MTRR_PHYSMASK(i)) & MTRR_PHYSMASK_VALID) {
+            if (_read_msr(MSR_IA32_MTRR_PHYSBASE(i)) == base) return true;
+            continue;
+        }
+        
+        // once the other cpus are up they would keep seeing the range with its old memory type, the MTRRs
+        // have to be the same everywhere. The caller maps it uncached instead.
+        if (cpu_count > 1) return false;
+        if (write_combining_mtrr_count == CPU_MAX_WRITE_COMBINING_MTRRS) return false;
+        
+        write_variable_mtrr(i, base, mask);
+        
+        write_combining_mtrrs[write_combining_mtrr_count].index = i;
+        write_combining_mtrrs[write_combining_mtrr_count].base = base;
+        write_combining_mtrrs[write_combining_mtrr_count].mask = mask;
+        write_combining_mtrr_count++;
+        return true;
+    }
+    
+    return false;
+}
+
+// the part every cpu has to do for itself, cpu_features has to be filled in already
+static void cpu_enable_features() {
+    if (cpu_features.pse) {
+        _write_cr4(_read_cr4() | CR4_PSE);
+    }
+    
+    // kernel mappings are marked global from the start, this makes cr3 reloads leave them in the TLB
+    if (cpu_features.pge) {
+        _write_cr4(_read_cr4() | CR4_PGE);
+    }
+    
+    // nothing is mapped through PA4 yet, so there are no stale tlb entries to worry about
+    if (cpu_features.pat) {
+        asm volatile("wbinvd" ::: "memory");
+        _write_msr(MSR_IA32_PAT, PAT_VALUE);
+    }
+    
+    // memcpy and friends use xmm registers once sse2 is set, the x87 FPU stays as it is
+    if (sse_supported) {
+        _write_cr0((_read_cr0() & ~CR0_EMULATION) | CR0_MONITOR_COPROCESSOR);
+        _write_cr4(_read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+        cpu_features.sse2 = true;
+    }
+}
+
+void cpu_init() {
+    u32 regs[4];
+    
+    _cpuid(CPUID_LEAF_VENDOR, 0, regs);
+    cpu_features.max_leaf = regs[0];
+    
+    // the vendor string is in ebx, edx, ecx, in that order
+    memcpy(&cpu_features.vendor[0], &regs[1], 4);
+    memcpy(&cpu_features.vendor[4], &regs[3], 4);
+    memcpy(&cpu_features.vendor[8], &regs[2], 4);
+    cpu_features.vendor[12] = 0;
+    
+    if (cpu_features.max_leaf >= CPUID_LEAF_FEATURES) {
+        _cpuid(CPUID_LEAF_FEATURES, 0, regs);
+        cpu_features.pse = (regs[3] & CPUID_FEATURES_EDX_PSE) != 0;
+        cpu_features.tsc = (regs[3] & CPUID_FEATURES_EDX_TSC) != 0;
+        cpu_features.apic = (regs[3] & CPUID_FEATURES_EDX_APIC) != 0;
+        cpu_features.pge = (regs[3] & CPUID_FEATURES_EDX_PGE) != 0;
+        cpu_features.pat = (regs[3] & CPUID_FEATURES_EDX_PAT) != 0;
+        cpu_features.mtrr = (regs[3] & CPUID_FEATURES_EDX_MTRR) != 0;
+        
+        sse_supported = (regs[3] & CPUID_FEATURES_EDX_FXSR) && (regs[3] & CPUID_FEATURES_EDX_SSE) && (regs[3] & CPUID_FEATURES_EDX_SSE2);
+    }
+    
+    cpu_features.physical_address_bits = 36;
+    _cpuid(CPUID_LEAF_EXTENDED, 0, regs);
+    u32 max_extended_leaf = regs[0];
+    if (max_extended_leaf >= CPUID_LEAF_POWER_MANAGEMENT) {
+        _cpuid(CPUID_LEAF_POWER_MANAGEMENT, 0, regs);
+        cpu_features.invariant_tsc = (regs[3] & CPUID_POWER_MANAGEMENT_EDX_INVARIANT_TSC) != 0;
+    }
+    
+    if (max_extended_leaf >= CPUID_LEAF_ADDRESS_SIZES) {
+        _cpuid(CPUID_LEAF_ADDRESS_SIZES, 0, regs);
+        cpu_features.physical_address_bits = regs[0] & 0xFF;
+    }
+    
+    kprint("cpu: %s, pse %u, apic %u, pge %u, pat %u, mtrr %u, sse2 %u, %u physical address bits\n", cpu_features.vendor,
+           cpu_features.pse, cpu_features.apic, cpu_features.pge, cpu_features.pat, cpu_features.mtrr, sse_supported, cpu_features.physical_address_bits);
+    
+    cpu_enable_features();
+}
+
+void cpu_init_ap() {
+    // whatever the bootstrap cpu left in its x87 registers doesn't matter here, but INIT doesn't reset them
+    asm volatile("fninit");
+    cpu_enable_features();
+    
+    for (u32 i = 0; i < write_combining_mtrr_count; ++i) {
+        write_variable_mtrr(write_combining_mtrrs[i].index, write_combining_mtrrs[i].base, write_combining_mtrrs[i].mask);
+    }
+}
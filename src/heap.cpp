@@ -1,119 +1,428 @@
 #include "kernel.h"
 #include "heap.h"
+#include "spinlock.h"
 
+// The heap is a contiguous range of virtual memory starting at HEAP_VIRTUAL_BASE_ADDRESS that is carved
+// into spans of whole pages. Every span begins with a Heap_Span header. Small allocations are served from
+// single-page slabs that each hold objects of one size class, anything bigger than the largest size class
+// gets a span of its own. Every pointer we hand out lies within the first page of its span, so the header
+// for any allocation is found by rounding the pointer down to a page boundary.
+//
+// Free spans are kept in bins by page count and are coalesced with their neighbours, using the page counts
+// stored in the headers as boundary tags.
+//
+// Carving a span only reserves address space. Pages are backed the first time they are touched, by
+// heap_handle_page_fault(), so a large allocation that is mostly unused costs little more than its header.
+//
+// Everything but the page fault path is under heap_info.lock. Faults are taken while the lock is held,
+// by whoever writes a span header first, so that path doesn't take it. It takes paging_lock under ours with
+// interrupts off, which is fine as long as backing a page never shoots down: map_page_if_unmapped() only
+// fills in entries that weren't present and zero_physical_page() only invalidates locally. tlb_shootdown()
+// asserts that it holds no lock but paging_lock, and the cpus spinning on ours answer one anyway.
+
+struct Heap_Span {
+    u32 magic;
+    u32 num_pages;
+    u32 prev_num_pages; // size of the span directly below this one, 0 if this is the first span
+    u16 size_class;     // slabs only
+    u16 num_free;       // slabs only
+    void *free_list;    // slabs only
+    
+    // links for the partial slab list of our size class, or for our free span bin
+    Heap_Span *next;
+    Heap_Span *prev;
+};
+
+#define HEAP_SPAN_HEADER_SIZE ((sizeof(Heap_Span) + 15) & ~15)
+
+#define HEAP_SPAN_MAGIC_FREE  0x45455246 // "FREE"
+#define HEAP_SPAN_MAGIC_SLAB  0x42414C53 // "SLAB"
+#define HEAP_SPAN_MAGIC_LARGE 0x4752414C // "LARG"
+
+// bins 1..HEAP_SPAN_BINS-1 hold free spans of exactly that many pages, bin 0 holds everything larger
+#define HEAP_SPAN_BINS 32
+
+// @Volatile all of these must be multiples of 16 and no larger than HEAP_MAX_SLAB_SIZE
+static const u16 heap_size_classes[] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 1008, 2032 };
+
+#define HEAP_NUM_SIZE_CLASSES (sizeof(heap_size_classes) / sizeof(heap_size_classes[0]))
+#define HEAP_MAX_SLAB_SIZE    2032
 
 struct {
-    // the default amount of mappable memory due to our heap_page_table in the kernel
-    u32 mappable_addr_space = 1024 * 4096;
-    u32 mapped_memory = 0;
-    u32 watermark = 0;
+    Spin_Lock lock;
+    
+    u32 mapped_memory = 0; // pages that have been touched, and so are backed, only changed atomically
+    u32 watermark = 0;     // everything below this offset belongs to a span, and is backed on first touch
+    
+    Heap_Span *last_span = nullptr; // the span that ends at the watermark
+    Heap_Span *partial_slabs[HEAP_NUM_SIZE_CLASSES];
+    Heap_Span *free_spans[HEAP_SPAN_BINS];
+    u8 size_class_lookup[(HEAP_MAX_SLAB_SIZE / 16) + 1];
+    
+    Heap_Stats stats;
 } heap_info;
 
-void *heap_alloc_no_reserve(u32 size);
+void init_heap() {
+    heap_info.mapped_memory = 0;
+    heap_info.watermark = 0;
+    heap_info.last_span = nullptr;
+    
+    zero_memory(&heap_info.partial_slabs, sizeof(heap_info.partial_slabs));
+    zero_memory(&heap_info.free_spans, sizeof(heap_info.free_spans));
+    zero_memory(&heap_info.stats, sizeof(heap_info.stats));
+    
+    u32 size_class = 0;
+    for (u32 i = 0; i < sizeof(heap_info.size_class_lookup); ++i) {
+        while (heap_size_classes[size_class] < i * 16) size_class++;
+        heap_info.size_class_lookup[i] = static_cast<u8>(size_class);
+    }
+}
 
-void heap_ensure_we_can_map_size(u32 size) {
-    u32 memory_left = heap_info.mappable_addr_space - heap_info.mapped_memory;
-    while ((memory_left - PAGE_SIZE) < size ) { // arbitrary
-        kassert(memory_left >= PAGE_SIZE); // we need at least a page to setup a page table
-        
-        // @FIXME we cant have this type of recursion here, I think
-        u32 *table = reinterpret_cast<u32 *>(heap_alloc_no_reserve(PAGE_SIZE));
-        for (int i = 0; i < 1024; ++i) {
-            table[i] = PAGE_READ_WRITE;
-        }
-        
-        map_page_table(table, HEAP_VIRTUAL_BASE_ADDRESS + heap_info.mappable_addr_space);
-        heap_info.mappable_addr_space += 1024 * 4096;
+// pages below the watermark that were never touched are not present, the first access to one lands here
+bool heap_handle_page_fault(u32 address) {
+    if (address < HEAP_VIRTUAL_BASE_ADDRESS || address >= HEAP_VIRTUAL_BASE_ADDRESS + heap_info.watermark) return false;
+    
+    u32 page_virtual = address & ~(PAGE_SIZE-1);
+    u32 page = alloc_zeroed_page();
+    kassert(page && "out of physical memory");
+    
+    // another cpu may have faulted on the same page and beaten us to it
+    if (map_page_if_unmapped(page, page_virtual, PAGE_READ_WRITE | PAGE_GLOBAL_BIT)) {
+        __atomic_fetch_add(&heap_info.mapped_memory, PAGE_SIZE, __ATOMIC_RELAXED);
+    } else {
+        free_page(page);
     }
+    
+    return true;
 }
 
-u32 heap_mappable_space_left() {
-    return (heap_info.mappable_addr_space - heap_info.mapped_memory) - PAGE_SIZE;
+void *heap_alloc(u32 size) {
+    return heap_allocator(ALLOCATOR_MODE_ALLOC, nullptr, size);
 }
 
-void init_heap() {
-    heap_info.mappable_addr_space = 1024 * 4096;
-    heap_info.mapped_memory = 0;
-    heap_info.watermark = 0;
+void heap_free(void *mem) {
+    heap_allocator(ALLOCATOR_MODE_FREE, mem, 0);
 }
 
-void *heap_map(u32 size) {
-    // kprint("Size: %d\n", size);
-    kassert((size & (PAGE_SIZE-1)) == 0);
-    kassert((heap_info.mappable_addr_space - heap_info.mapped_memory) >= size);
+Heap_Stats heap_get_stats() {
+    u32 eflags = spin_lock_irqsave(&heap_info.lock);
+    Heap_Stats stats = heap_info.stats;
+    stats.mapped_bytes = heap_info.mapped_memory;
+    stats.span_bytes = heap_info.watermark;
+    stats.lock = heap_info.lock.stats;
+    spin_unlock_irqrestore(&heap_info.lock, eflags);
+    return stats;
+}
+
+static Heap_Span *heap_span_of(void *mem) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(mem);
+    kassert(addr >= HEAP_VIRTUAL_BASE_ADDRESS && addr < HEAP_VIRTUAL_BASE_ADDRESS + heap_info.watermark);
+    
+    return reinterpret_cast<Heap_Span *>(addr & ~static_cast<uintptr_t>(PAGE_SIZE-1));
+}
+
+static u32 heap_span_offset(Heap_Span *span) {
+    return static_cast<u32>(reinterpret_cast<uintptr_t>(span) - HEAP_VIRTUAL_BASE_ADDRESS);
+}
+
+// returns the span directly above this one, or null if this span ends at the watermark
+static Heap_Span *heap_span_after(Heap_Span *span) {
+    u32 end = heap_span_offset(span) + span->num_pages * PAGE_SIZE;
+    if (end == heap_info.watermark) return nullptr;
+    
+    return reinterpret_cast<Heap_Span *>(reinterpret_cast<u8 *>(span) + span->num_pages * PAGE_SIZE);
+}
+
+static Heap_Span *heap_span_before(Heap_Span *span) {
+    if (span->prev_num_pages == 0) return nullptr;
+    
+    return reinterpret_cast<Heap_Span *>(reinterpret_cast<u8 *>(span) - span->prev_num_pages * PAGE_SIZE);
+}
+
+static void heap_set_span_size(Heap_Span *span, u32 num_pages) {
+    span->num_pages = num_pages;
+    
+    Heap_Span *after = heap_span_after(span);
+    if (after) after->prev_num_pages = num_pages;
+    else heap_info.last_span = span;
+}
+
+static void heap_list_push(Heap_Span **head, Heap_Span *span) {
+    span->prev = nullptr;
+    span->next = *head;
+    if (*head) (*head)->prev = span;
+    *head = span;
+}
+
+static void heap_list_remove(Heap_Span **head, Heap_Span *span) {
+    if (span->prev) span->prev->next = span->next;
+    else *head = span->next;
+    
+    if (span->next) span->next->prev = span->prev;
+    
+    span->next = nullptr;
+    span->prev = nullptr;
+}
+
+static Heap_Span **heap_free_span_bin(u32 num_pages) {
+    if (num_pages < HEAP_SPAN_BINS) return &heap_info.free_spans[num_pages];
+    return &heap_info.free_spans[0];
+}
+
+static void heap_push_free_span(Heap_Span *span) {
+    span->magic = HEAP_SPAN_MAGIC_FREE;
+    heap_list_push(heap_free_span_bin(span->num_pages), span);
+    heap_info.stats.free_span_bytes += span->num_pages * PAGE_SIZE;
+}
+
+static void heap_unlink_free_span(Heap_Span *span) {
+    kassert(span->magic == HEAP_SPAN_MAGIC_FREE);
+    heap_list_remove(heap_free_span_bin(span->num_pages), span);
+    heap_info.stats.free_span_bytes -= span->num_pages * PAGE_SIZE;
+}
+
+// carves a brand new span out of the address space at the watermark. Nothing is mapped here, the
+// watermark has to cover the span before we write its header so that the fault handler backs that page.
+static Heap_Span *heap_carve_span(u32 num_pages) {
+    u32 size = num_pages * PAGE_SIZE;
+    kassert(heap_info.watermark + size <= HEAP_MAX_SIZE && "out of heap address space");
+    
+    Heap_Span *span = reinterpret_cast<Heap_Span *>(HEAP_VIRTUAL_BASE_ADDRESS + heap_info.watermark);
+    Heap_Span *last_span = heap_info.last_span;
+    heap_info.watermark += size;
+    heap_info.last_span = span;
     
-    u32 page_start = HEAP_VIRTUAL_BASE_ADDRESS + heap_info.mapped_memory;
-    for (u32 i = 0; i <= size; i += PAGE_SIZE) {
-        u32 page = next_free_page();
-        // @TODO check if the page is even valid for use
-        // then return null if not
+    span->prev_num_pages = last_span ? last_span->num_pages : 0;
+    span->num_pages = num_pages;
+    span->next = nullptr;
+    span->prev = nullptr;
+    return span;
+}
+
+static Heap_Span *heap_alloc_span(u32 num_pages) {
+    Heap_Span *span = nullptr;
+    
+    // exact or next-larger bins first, these are O(1) to pop
+    for (u32 bin = num_pages; bin < HEAP_SPAN_BINS && !span; ++bin) {
+        span = heap_info.free_spans[bin];
+    }
+    
+    if (!span) {
+        for (Heap_Span *it = heap_info.free_spans[0]; it; it = it->next) {
+            if (it->num_pages >= num_pages) {
+                span = it;
+                break;
+            }
+        }
+    }
+    
+    if (!span) return heap_carve_span(num_pages);
+    
+    heap_unlink_free_span(span);
+    
+    if (span->num_pages > num_pages) {
+        u32 remaining_pages = span->num_pages - num_pages;
+        Heap_Span *remainder = reinterpret_cast<Heap_Span *>(reinterpret_cast<u8 *>(span) + num_pages * PAGE_SIZE);
         
-        // kprint("GOT PAGE: %X\n", page);
-        map_page(page, HEAP_VIRTUAL_BASE_ADDRESS + heap_info.mapped_memory, PAGE_READ_WRITE);
-        heap_info.mapped_memory += PAGE_SIZE;
+        span->num_pages = num_pages;
+        remainder->prev_num_pages = num_pages;
+        heap_set_span_size(remainder, remaining_pages);
+        heap_push_free_span(remainder);
     }
     
-    return reinterpret_cast<void *>(page_start);
+    return span;
 }
 
-void *heap_alloc_no_reserve(u32 size) {
-    return heap_map(size);
+static void heap_free_span(Heap_Span *span) {
+    Heap_Span *after = heap_span_after(span);
+    if (after && after->magic == HEAP_SPAN_MAGIC_FREE) {
+        heap_unlink_free_span(after);
+        heap_set_span_size(span, span->num_pages + after->num_pages);
+    }
+    
+    Heap_Span *before = heap_span_before(span);
+    if (before && before->magic == HEAP_SPAN_MAGIC_FREE) {
+        heap_unlink_free_span(before);
+        heap_set_span_size(before, before->num_pages + span->num_pages);
+        span = before;
+    }
+    
+    heap_push_free_span(span);
 }
 
-void *heap_reserve(u32 size) {
-    heap_ensure_we_can_map_size(size);
-    return heap_map(size);
+static u32 heap_slab_capacity(u32 size_class) {
+    return (PAGE_SIZE - HEAP_SPAN_HEADER_SIZE) / heap_size_classes[size_class];
 }
 
-void *heap_alloc(u32 size) {
-    return heap_allocator(ALLOCATOR_MODE_ALLOC, nullptr, size);
+static Heap_Span *heap_new_slab(u32 size_class) {
+    Heap_Span *slab = heap_alloc_span(1);
+    slab->magic = HEAP_SPAN_MAGIC_SLAB;
+    slab->size_class = static_cast<u16>(size_class);
+    
+    u32 object_size = heap_size_classes[size_class];
+    u32 capacity = heap_slab_capacity(size_class);
+    u8 *objects = reinterpret_cast<u8 *>(slab) + HEAP_SPAN_HEADER_SIZE;
+    
+    // thread the free list through the objects, lowest address first
+    void *list = nullptr;
+    for (u32 i = capacity; i > 0; --i) {
+        void **object = reinterpret_cast<void **>(objects + (i-1) * object_size);
+        *object = list;
+        list = object;
+    }
+    
+    slab->free_list = list;
+    slab->num_free = static_cast<u16>(capacity);
+    
+    heap_list_push(&heap_info.partial_slabs[size_class], slab);
+    heap_info.stats.slab_count++;
+    return slab;
 }
 
-void heap_free(void *mem) {
-    heap_allocator(ALLOCATOR_MODE_FREE, mem, 0);
+static void *heap_slab_alloc(u32 size) {
+    u32 size_class = heap_info.size_class_lookup[(size + 15) / 16];
+    
+    Heap_Span *slab = heap_info.partial_slabs[size_class];
+    if (!slab) slab = heap_new_slab(size_class);
+    
+    void **object = reinterpret_cast<void **>(slab->free_list);
+    slab->free_list = *object;
+    slab->num_free--;
+    
+    if (slab->num_free == 0) heap_list_remove(&heap_info.partial_slabs[size_class], slab);
+    
+    heap_info.stats.allocated_bytes += heap_size_classes[size_class];
+    return object;
 }
 
-void *_heap_alloc(u32 size) {
-    u32 allocation_size = size;
-    if (size & (PAGE_SIZE-1)) {
-        size &= ~(PAGE_SIZE-1);
-        size += PAGE_SIZE;
-    }
-    if (allocation_size & 7) {
-        allocation_size &= ~7;
-        allocation_size += 8;
+static void heap_slab_free(Heap_Span *slab, void *mem) {
+    u32 size_class = slab->size_class;
+    u32 object_size = heap_size_classes[size_class];
+    u32 capacity = heap_slab_capacity(size_class);
+    
+    u32 offset = static_cast<u32>(reinterpret_cast<u8 *>(mem) - reinterpret_cast<u8 *>(slab));
+    kassert(offset >= HEAP_SPAN_HEADER_SIZE && ((offset - HEAP_SPAN_HEADER_SIZE) % object_size) == 0);
+    
+    void **object = reinterpret_cast<void **>(mem);
+    *object = slab->free_list;
+    slab->free_list = object;
+    slab->num_free++;
+    
+    heap_info.stats.allocated_bytes -= object_size;
+    
+    Heap_Span **partial = &heap_info.partial_slabs[size_class];
+    if (slab->num_free == 1) {
+        heap_list_push(partial, slab);
+    } else if (slab->num_free == capacity) {
+        // keep a single empty slab around per size class so that alloc/free pairs don't thrash the span allocator
+        if (*partial == slab && !slab->next) return;
+        
+        heap_list_remove(partial, slab);
+        heap_free_span(slab);
+        heap_info.stats.slab_count--;
     }
-    if (heap_info.watermark + allocation_size >= heap_info.mapped_memory) 
-        heap_reserve(size);
+}
+
+void *_heap_alloc(u32 size) {
+    if (size <= HEAP_MAX_SLAB_SIZE) return heap_slab_alloc(size);
     
-    void *out = reinterpret_cast<void *>(HEAP_VIRTUAL_BASE_ADDRESS + heap_info.watermark);
-    heap_info.watermark += allocation_size;
-    kassert(heap_info.watermark < heap_info.mapped_memory);
-    // kprint("heap: Allocated block at %p of size %d\n", out, allocation_size);
+    u32 num_pages = (size + HEAP_SPAN_HEADER_SIZE + (PAGE_SIZE-1)) / PAGE_SIZE;
+    Heap_Span *span = heap_alloc_span(num_pages);
+    span->magic = HEAP_SPAN_MAGIC_LARGE;
+    
+    heap_info.stats.large_span_count++;
+    heap_info.stats.allocated_bytes += num_pages * PAGE_SIZE;
+    
+    void *out = reinterpret_cast<u8 *>(span) + HEAP_SPAN_HEADER_SIZE;
+    // kprint("heap: Allocated block at %p of size %d\n", out, size);
     return out;
 }
 
 void _heap_free(void *mem) {
+    Heap_Span *span = heap_span_of(mem);
     
+    if (span->magic == HEAP_SPAN_MAGIC_SLAB) {
+        heap_slab_free(span, mem);
+    } else {
+        kassert(span->magic == HEAP_SPAN_MAGIC_LARGE && "heap_free on a pointer that isnt allocated");
+        kassert(mem == reinterpret_cast<u8 *>(span) + HEAP_SPAN_HEADER_SIZE);
+        
+        heap_info.stats.large_span_count--;
+        heap_info.stats.allocated_bytes -= span->num_pages * PAGE_SIZE;
+        heap_free_span(span);
+    }
+}
+
+// grows or shrinks an allocation without moving it, returns false if it would have to move. A slab object
+// fits anything up to its size class. A large span grows by bumping the watermark when it is the last span,
+// or by taking pages from a free span directly above it.
+bool _heap_resize(void *mem, u32 size) {
+    Heap_Span *span = heap_span_of(mem);
+    
+    if (span->magic == HEAP_SPAN_MAGIC_SLAB) {
+        return size <= heap_size_classes[span->size_class];
+    }
+    
+    kassert(span->magic == HEAP_SPAN_MAGIC_LARGE && "heap_resize on a pointer that isnt allocated");
+    kassert(mem == reinterpret_cast<u8 *>(span) + HEAP_SPAN_HEADER_SIZE);
+    
+    // @Incomplete shrinking never gives pages back
+    u32 num_pages = (size + HEAP_SPAN_HEADER_SIZE + (PAGE_SIZE-1)) / PAGE_SIZE;
+    if (num_pages <= span->num_pages) return true;
+    
+    u32 extra_pages = num_pages - span->num_pages;
+    Heap_Span *after = heap_span_after(span);
+    
+    if (!after) {
+        if (heap_info.watermark + extra_pages * PAGE_SIZE > HEAP_MAX_SIZE) return false;
+        
+        heap_info.watermark += extra_pages * PAGE_SIZE;
+        span->num_pages = num_pages;
+    } else {
+        if (after->magic != HEAP_SPAN_MAGIC_FREE || after->num_pages < extra_pages) return false;
+        
+        heap_unlink_free_span(after);
+        
+        u32 remaining_pages = after->num_pages - extra_pages;
+        if (remaining_pages) {
+            Heap_Span *remainder = reinterpret_cast<Heap_Span *>(reinterpret_cast<u8 *>(span) + num_pages * PAGE_SIZE);
+            
+            span->num_pages = num_pages;
+            remainder->prev_num_pages = num_pages;
+            heap_set_span_size(remainder, remaining_pages);
+            heap_push_free_span(remainder);
+        } else {
+            heap_set_span_size(span, num_pages);
+        }
+    }
+    
+    heap_info.stats.allocated_bytes += extra_pages * PAGE_SIZE;
+    return true;
 }
 
 void *heap_allocator(ALLOCATOR_MODE mode, void *existing, s64 size) {
-    u32 eflags = DISABLE_INTERRUPTS();
+    u32 eflags = spin_lock_irqsave(&heap_info.lock);
     if (mode == ALLOCATOR_MODE_ALLOC) {
         kassert(existing == nullptr);
         auto result = _heap_alloc(size);
-        RESTORE_INTERRUPTS(eflags);
+        spin_unlock_irqrestore(&heap_info.lock, eflags);
         return result;
     } else if (mode == ALLOCATOR_MODE_FREE) {
         kassert(size == 0);
         kassert(existing);
         
         _heap_free(existing);
-        RESTORE_INTERRUPTS(eflags);
+        spin_unlock_irqrestore(&heap_info.lock, eflags);
         return nullptr;
+    } else if (mode == ALLOCATOR_MODE_RESIZE) {
+        kassert(existing);
+        
+        bool resized = _heap_resize(existing, size);
+        spin_unlock_irqrestore(&heap_info.lock, eflags);
+        return resized ? existing : nullptr;
     }
     
-    RESTORE_INTERRUPTS(eflags);
+    spin_unlock_irqrestore(&heap_info.lock, eflags);
     kassert(false && "mode is an invalid value");
     return nullptr;
-}
\ No newline at end of file
+}
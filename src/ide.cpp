@@ -2,24 +2,10 @@
 #include "kernel.h"
 #include "pci.h"
 #include "driver_interface.h"
-
-struct Spinlock {
-    s32 value = 0;
-};
-
-void spinlock_wait(Spinlock *lock) {
-    lock->value--;
-    while (lock->value != 0) asm("hlt");
-}
-
-void spinlock_release(Spinlock *lock) {
-	// hmm... we cant acutally wait here because if
-	// we call this from an interrupt before spinlock_wait is called
-	// then we loop forever
-    // while (lock->value == 0) asm("hlt");
-    
-    lock->value++;
-}
+#include "interrupts.h"
+#include "heap.h"
+#include "timer.h"
+#include "wait_queue.h"
 
 #define PCI_IDE_COMPAT_PRIMARY_COMMAND_BLOCK_START 0x01F0
 #define PCI_IDE_COMPAT_PRIMARY_CONTROL_BLOCK_START 0x03F4
@@ -61,6 +47,8 @@ void spinlock_release(Spinlock *lock) {
 #define PCI_IDE_COMMAND_IDENTIFY 0xEC
 #define PCI_IDE_COMMAND_READ_SECTORS 0x20
 #define PCI_IDE_COMMAND_WRITE_SECTORS 0x30
+#define PCI_IDE_COMMAND_READ_DMA 0xC8
+#define PCI_IDE_COMMAND_WRITE_DMA 0xCA
 
 #define PCI_IDE_DRIVE_MASTER 0
 #define PCI_IDE_DRIVE_SLAVE  1
@@ -68,6 +56,44 @@ void spinlock_release(Spinlock *lock) {
 #define PCI_IDE_DRIVE_TYPE_ATA   0
 #define PCI_IDE_DRIVE_TYPE_ATAPI 1
 
+#define IDE_SECTOR_SIZE 512
+
+#define PCI_IDE_IDENTIFY_CAPABILITIES_WORD 49
+#define PCI_IDE_IDENTIFY_CAPABILITIES_DMA_BIT (1 << 8)
+
+// Bus master DMA: BAR4 holds 8 bytes of bus master registers per channel. The controller reads a table of
+// physical region descriptors (PRDT), each of which may not cross a 64KiB boundary, and moves the data
+// itself while the drive runs a READ DMA or WRITE DMA command. The drive raises its irq once when it is done.
+#define PCI_IDE_BAR_IO_SPACE_BIT (1 << 0)
+#define PCI_IDE_BMDMA_SECONDARY_OFFSET 8
+
+#define PCI_IDE_BMDMA_COMMAND_REGISTER 0
+#define PCI_IDE_BMDMA_STATUS_REGISTER  2
+#define PCI_IDE_BMDMA_PRDT_REGISTER    4
+
+#define PCI_IDE_BMDMA_COMMAND_START_BIT (1 << 0)
+#define PCI_IDE_BMDMA_COMMAND_READ_BIT  (1 << 3) // the controller writes to memory
+
+#define PCI_IDE_BMDMA_STATUS_ACTIVE_BIT (1 << 0)
+#define PCI_IDE_BMDMA_STATUS_ERROR_BIT  (1 << 1) // this and the irq bit are cleared by writing a one
+#define PCI_IDE_BMDMA_STATUS_IRQ_BIT    (1 << 2)
+
+#define PCI_IDE_PRD_END_OF_TABLE 0x8000
+
+// one naturally aligned 64KiB block, so its single PRD can't cross a 64KiB boundary. A byte count of 0 is 64KiB.
+#define IDE_DMA_BUFFER_ORDER 4
+#define IDE_DMA_BUFFER_SIZE  (PAGE_SIZE << IDE_DMA_BUFFER_ORDER)
+#define IDE_DMA_MAX_SECTORS  (IDE_DMA_BUFFER_SIZE / IDE_SECTOR_SIZE)
+
+struct PACKED Ide_Prd {
+    u32 physical;
+    u16 byte_count;
+    u16 flags;
+};
+
+// after this long without the irq we give up on it and poll the status register for the rest of the time
+#define IDE_IRQ_TIMEOUT_NS 500000000ULL
+
 struct IDE_Driver {
     u16 command_block;
     u16 control_block;
@@ -76,9 +102,30 @@ struct IDE_Driver {
     
     struct {
         u8 type;
+        bool present; // answered IDENTIFY
+        bool dma;     // says it can do DMA
     } drive_info[2];
     
-    Spinlock irq_wait_lock;
+    // covers the registers and selected_drive, a command and its data transfer have to be done before the next
+    // one is sent. We sleep while holding it.
+    Mutex lock;
+    
+    // The drive raises its irq once a command is done and, for PIO transfers, for every sector that is
+    // ready to be read or has been written. ide_irq_handler() reads the status register, which acknowledges
+    // the irq, and hands the status over through irq_done.
+    s32 irq;
+    bool use_irq;
+    volatile u8 irq_status;
+    Completion irq_done;
+    
+    // 0 without bus master registers. The drive reads from and writes to dma_buffer, which we copy the data
+    // through, rather than the memory of the caller, which may not be physically contiguous.
+    u16 bus_master_block;
+    bool use_dma; // cleared for good once a DMA transfer failed
+    Ide_Prd *prdt;
+    u32 prdt_physical;
+    u8 *dma_buffer;
+    u32 dma_buffer_physical;
     
     void flush_cache() {
         _port_io_write_u8(command_block + PCI_IDE_COMMAND_WRITE_REGISTER, 0xE7);
@@ -87,10 +134,10 @@ struct IDE_Driver {
     void send_cmd_reset() {
         // @Cleanup document these bits using #defines
         io_write_u8(control_block + PCI_IDE_DEVICE_CONTROL_WRITE_REGISTER, (1 << 2));
-        //udelay(5);
+        udelay(5);
         
         io_write_u8(control_block + PCI_IDE_DEVICE_CONTROL_WRITE_REGISTER, (1 << 1));
-        //mdelay(5);
+        mdelay(5);
     }
     
     u8 read_ctrl_u8(s8 reg) {
@@ -129,6 +176,18 @@ struct IDE_Driver {
         return status;
     }
     
+    // returns the status once the drive raised its irq, or once it is no longer busy if we are polling
+    u8 wait_for_irq() {
+        if (use_irq) {
+            if (completion_wait(&irq_done, clock_monotonic_ns() + IDE_IRQ_TIMEOUT_NS)) return irq_status;
+            
+            kprint("IDE: no irq %d from the drive at IO(%X), polling from now on\n", irq, command_block);
+            use_irq = false;
+        }
+        
+        return wait_for_flags_clear(PCI_IDE_STATUS_BSY_BIT);
+    }
+    
     u8 select_drive(u8 drive) {
         kassert( (drive == PCI_IDE_DRIVE_MASTER) || (drive == PCI_IDE_DRIVE_SLAVE) );
         
@@ -150,7 +209,7 @@ struct IDE_Driver {
     }
     
     
-    s64 read_sectors_lba28(void *data, u8 sector_count, u32 lba) {
+    void write_lba28_registers(u8 sector_count, u32 lba) {
         u8 high4 = (lba >> 24) & 0xF;
         if (selected_drive == PCI_IDE_DRIVE_MASTER)     write_cmd_u8(PCI_IDE_DRIVE_HEAD_REGISTER, 0xE0 | high4);
         else if (selected_drive == PCI_IDE_DRIVE_SLAVE) write_cmd_u8(PCI_IDE_DRIVE_HEAD_REGISTER, 0xF0 | high4);
@@ -163,37 +222,155 @@ struct IDE_Driver {
         write_cmd_u8(PCI_IDE_LBALO_REGISTER, lo);
         write_cmd_u8(PCI_IDE_LBAMID_REGISTER, mid);
         write_cmd_u8(PCI_IDE_LBAHI_REGISTER, hi);
+    }
+    
+    s64 pio_read_sectors_lba28(void *data, u8 sector_count, u32 lba) {
+        write_lba28_registers(sector_count, lba);
         
+        completion_reset(&irq_done);
         write_cmd_u8(PCI_IDE_COMMAND_WRITE_REGISTER, PCI_IDE_COMMAND_READ_SECTORS);
         
-        wait_for_flags_clear(PCI_IDE_STATUS_BSY_BIT);
-        u8 status = wait_for_any_flags_set(PCI_IDE_STATUS_DRQ_BIT | PCI_IDE_STATUS_ERR_BIT);
+        // one irq per sector, each time the next one is ready to be read
+        u8 *dest = reinterpret_cast<u8 *>(data);
+        for (u32 i = 0; i < sector_count; ++i) {
+            wait_for_irq();
+            u8 status = wait_for_any_flags_set(PCI_IDE_STATUS_DRQ_BIT | PCI_IDE_STATUS_ERR_BIT);
+            if (status & PCI_IDE_STATUS_ERR_BIT) return -1;
+            
+            _raw_read(dest + i * IDE_SECTOR_SIZE, IDE_SECTOR_SIZE, nullptr);
+        }
+        
+        return 0;
+    }
+    
+    s64 pio_write_sectors_lba28(void *data, u8 sector_count, u32 lba) {
+        write_lba28_registers(sector_count, lba);
+        
+        completion_reset(&irq_done);
+        write_cmd_u8(PCI_IDE_COMMAND_WRITE_REGISTER, PCI_IDE_COMMAND_WRITE_SECTORS);
+        
+        // there is no irq for the first sector, the drive raises one after each sector we wrote
+        u8 *src = reinterpret_cast<u8 *>(data);
+        for (u32 i = 0; i < sector_count; ++i) {
+            wait_for_flags_clear(PCI_IDE_STATUS_BSY_BIT);
+            u8 status = wait_for_any_flags_set(PCI_IDE_STATUS_DRQ_BIT | PCI_IDE_STATUS_ERR_BIT);
+            if (status & PCI_IDE_STATUS_ERR_BIT) return -1;
+            
+            _raw_write(src + i * IDE_SECTOR_SIZE, IDE_SECTOR_SIZE, nullptr);
+            status = wait_for_irq();
+            if (status & PCI_IDE_STATUS_ERR_BIT) return -1;
+        }
+        
+        // the flush raises an irq of its own once it is done
+        flush_cache();
+        u8 status = wait_for_irq();
         if (status & PCI_IDE_STATUS_ERR_BIT) return -1;
         
-        return _raw_read(data, sector_count * 256 * sizeof(u16), nullptr);
+        return 0;
     }
     
-    s64 write_sectors_lba28(void *data, u8 sector_count, u32 lba) {
-        u8 high4 = (lba >> 24) & 0xF;
-        if (selected_drive == PCI_IDE_DRIVE_MASTER)     write_cmd_u8(PCI_IDE_DRIVE_HEAD_REGISTER, 0xE0 | high4);
-        else if (selected_drive == PCI_IDE_DRIVE_SLAVE) write_cmd_u8(PCI_IDE_DRIVE_HEAD_REGISTER, 0xF0 | high4);
+    bool dma_usable() {
+        return use_dma && selected_drive <= PCI_IDE_DRIVE_SLAVE && drive_info[selected_drive].dma;
+    }
+    
+    // at most IDE_DMA_MAX_SECTORS, through dma_buffer
+    s64 dma_transfer(void *data, u32 sector_count, u32 lba, bool write) {
+        kassert(sector_count && sector_count <= IDE_DMA_MAX_SECTORS);
+        u32 bytes = sector_count * IDE_SECTOR_SIZE;
+        if (write) memcpy(dma_buffer, data, bytes);
         
-        u8 hi = (lba >> 16) & 0xFF;
-        u8 mid = (lba >> 8) & 0xFF;
-        u8 lo = (lba >> 0) & 0xFF;
+        prdt[0].physical = dma_buffer_physical;
+        prdt[0].byte_count = static_cast<u16>(bytes);
+        prdt[0].flags = PCI_IDE_PRD_END_OF_TABLE;
         
-        write_cmd_u8(PCI_IDE_SECTOR_COUNT_REGISTER, sector_count);
-        write_cmd_u8(PCI_IDE_LBALO_REGISTER, lo);
-        write_cmd_u8(PCI_IDE_LBAMID_REGISTER, mid);
-        write_cmd_u8(PCI_IDE_LBAHI_REGISTER, hi);
+        // the direction is set while the engine is stopped
+        u8 direction = write ? 0 : PCI_IDE_BMDMA_COMMAND_READ_BIT;
+        _port_io_write_u32(bus_master_block + PCI_IDE_BMDMA_PRDT_REGISTER, prdt_physical);
+        _port_io_write_u8(bus_master_block + PCI_IDE_BMDMA_COMMAND_REGISTER, direction);
+        u8 bm_status = _port_io_read_u8(bus_master_block + PCI_IDE_BMDMA_STATUS_REGISTER);
+        _port_io_write_u8(bus_master_block + PCI_IDE_BMDMA_STATUS_REGISTER, bm_status | PCI_IDE_BMDMA_STATUS_ERROR_BIT | PCI_IDE_BMDMA_STATUS_IRQ_BIT);
         
-        write_cmd_u8(PCI_IDE_COMMAND_WRITE_REGISTER, PCI_IDE_COMMAND_WRITE_SECTORS);
+        write_lba28_registers(static_cast<u8>(sector_count), lba);
+        completion_reset(&irq_done);
+        write_cmd_u8(PCI_IDE_COMMAND_WRITE_REGISTER, write ? PCI_IDE_COMMAND_WRITE_DMA : PCI_IDE_COMMAND_READ_DMA);
+        _port_io_write_u8(bus_master_block + PCI_IDE_BMDMA_COMMAND_REGISTER, direction | PCI_IDE_BMDMA_COMMAND_START_BIT);
         
+        u8 status = wait_for_irq();
+        
+        bm_status = _port_io_read_u8(bus_master_block + PCI_IDE_BMDMA_STATUS_REGISTER);
+        _port_io_write_u8(bus_master_block + PCI_IDE_BMDMA_COMMAND_REGISTER, direction);
+        _port_io_write_u8(bus_master_block + PCI_IDE_BMDMA_STATUS_REGISTER, bm_status | PCI_IDE_BMDMA_STATUS_ERROR_BIT | PCI_IDE_BMDMA_STATUS_IRQ_BIT);
+        
+        if (status & (PCI_IDE_STATUS_ERR_BIT | PCI_IDE_STATUS_DF_BIT)) return -1;
+        if (bm_status & (PCI_IDE_BMDMA_STATUS_ERROR_BIT | PCI_IDE_BMDMA_STATUS_ACTIVE_BIT)) return -1;
+        
+        if (!write) memcpy(data, dma_buffer, bytes);
+        return 0;
+    }
+    
+    // after a failed DMA transfer the drive may still be busy with the command or waiting for data that
+    // never comes. Stops the engine, resets both drives of the channel and selects the one we had again.
+    void reset_channel() {
+        _port_io_write_u8(bus_master_block + PCI_IDE_BMDMA_COMMAND_REGISTER, 0);
+        u8 bm_status = _port_io_read_u8(bus_master_block + PCI_IDE_BMDMA_STATUS_REGISTER);
+        _port_io_write_u8(bus_master_block + PCI_IDE_BMDMA_STATUS_REGISTER, bm_status | PCI_IDE_BMDMA_STATUS_ERROR_BIT | PCI_IDE_BMDMA_STATUS_IRQ_BIT);
+        
+        // send_cmd_reset() leaves nIEN set, the drive may raise its irq again after that
+        u8 drive = selected_drive;
+        send_cmd_reset();
+        write_ctrl_u8(PCI_IDE_DEVICE_CONTROL_WRITE_REGISTER, 0);
         wait_for_flags_clear(PCI_IDE_STATUS_BSY_BIT);
-        u8 status = wait_for_any_flags_set(PCI_IDE_STATUS_DRQ_BIT | PCI_IDE_STATUS_ERR_BIT);
-        if (status & PCI_IDE_STATUS_ERR_BIT) return -1;
         
-        return _raw_write(data, sector_count * 256 * sizeof(u16), nullptr);
+        // the reset selects the master, whatever selected_drive says
+        selected_drive = 0xFF;
+        select_drive(drive);
+        wait_for_flags_clear(PCI_IDE_STATUS_BSY_BIT);
+    }
+    
+    // on failure *sectors_done tells how many sectors from the start made it, whole chunks that completed.
+    // The channel has been reset by then, so the rest can be done with PIO.
+    s64 dma_sectors_lba28(void *data, u32 sector_count, u32 lba, bool write, u32 *sectors_done) {
+        u8 *bytes = reinterpret_cast<u8 *>(data);
+        u32 done = 0;
+        while (done < sector_count) {
+            u32 count = (sector_count - done < IDE_DMA_MAX_SECTORS) ? sector_count - done : IDE_DMA_MAX_SECTORS;
+            if (dma_transfer(bytes + done * IDE_SECTOR_SIZE, count, lba + done, write) != 0) {
+                kprint("IDE: DMA at IO(%X) failed, using PIO from now on\n", bus_master_block);
+                use_dma = false;
+                reset_channel();
+                
+                *sectors_done = done;
+                return -1;
+            }
+            
+            done += count;
+        }
+        
+        *sectors_done = done;
+        return 0;
+    }
+    
+    // through DMA if both the controller and the drive can, PIO otherwise. If DMA fails part way, PIO
+    // does the sectors it didn't get to.
+    s64 read_sectors_lba28(void *data, u8 sector_count, u32 lba) {
+        u32 done = 0;
+        if (dma_usable() && dma_sectors_lba28(data, sector_count, lba, false, &done) == 0) return 0;
+        
+        u8 *rest = reinterpret_cast<u8 *>(data) + done * IDE_SECTOR_SIZE;
+        return pio_read_sectors_lba28(rest, static_cast<u8>(sector_count - done), lba + done);
+    }
+    
+    s64 write_sectors_lba28(void *data, u8 sector_count, u32 lba) {
+        u32 done = 0;
+        if (dma_usable() && dma_sectors_lba28(data, sector_count, lba, true, &done) == 0) {
+            // pio_write_sectors_lba28() does the same
+            flush_cache();
+            u8 status = wait_for_irq();
+            return (status & PCI_IDE_STATUS_ERR_BIT) ? -1 : 0;
+        }
+        
+        u8 *rest = reinterpret_cast<u8 *>(data) + done * IDE_SECTOR_SIZE;
+        return pio_write_sectors_lba28(rest, static_cast<u8>(sector_count - done), lba + done);
     }
     
     // internal use
@@ -222,8 +399,6 @@ struct IDE_Driver {
             data16++;
         }
         
-        flush_cache();
-        
         if (bytes_written) *bytes_written = count;
         
         // @TODO errors
@@ -233,12 +408,18 @@ struct IDE_Driver {
 } ide_drivers[2];
 
 irq_result_type ide_irq_handler(s32 irq, void *dev) {
+    UNUSED(irq);
     IDE_Driver *ide = reinterpret_cast<IDE_Driver *>(dev);
-    UNUSED(ide);
-    // spinlock_release(ide->irq_wait_lock);
     
-    // @TODO we have to read the regular status register here in order to tell the drive we intercepted the IRQ
+    // reading the regular status register tells the drive we got the irq
     // @TODO determine that the IRQ actually came from the IDE drive
+    ide->irq_status = ide->read_cmd_u8(PCI_IDE_STATUS_READ_REGISTER);
+    if (ide->bus_master_block) {
+        u8 bm_status = _port_io_read_u8(ide->bus_master_block + PCI_IDE_BMDMA_STATUS_REGISTER);
+        _port_io_write_u8(ide->bus_master_block + PCI_IDE_BMDMA_STATUS_REGISTER, bm_status | PCI_IDE_BMDMA_STATUS_IRQ_BIT);
+    }
+    
+    complete(&ide->irq_done);
     return IRQ_RESULT_HANDLED;
 }
 
@@ -257,17 +438,18 @@ s8 ide_send_cmd_identify(IDE_Driver *ide, u16 *buffer) {
     ide->write_cmd_u8(PCI_IDE_LBALO_REGISTER, 0);
     ide->write_cmd_u8(PCI_IDE_LBAMID_REGISTER, 0);
     ide->write_cmd_u8(PCI_IDE_LBAHI_REGISTER, 0);
+    completion_reset(&ide->irq_done);
     ide->write_cmd_u8(PCI_IDE_COMMAND_WRITE_REGISTER, PCI_IDE_COMMAND_IDENTIFY);
     
-    // spinlock_wait(ide_primary_driver.irq_wait_lock);
-    
-    u8 status = ide->read_cmd_u8(PCI_IDE_STATUS_READ_REGISTER);
+    // no irq is coming from a drive that isn't there
+    u8 status = ide->read_ctrl_u8(PCI_IDE_ALT_STATUS_READ_REGISTER);
     if (status == 0) {
         kprint("IDE drive isnt attached.\n");
         return -1;
     }
     
-    status = ide->wait_for_flags_clear(PCI_IDE_STATUS_BSY_BIT);
+    // ATAPI drives abort the command, with an irq as well
+    status = ide->wait_for_irq();
     
     u8 sector_count = ide->read_cmd_u8(PCI_IDE_SECTOR_COUNT_REGISTER);
     u8 lbalo  = ide->read_cmd_u8(PCI_IDE_LBALO_REGISTER);
@@ -297,17 +479,50 @@ s8 ide_send_cmd_identify(IDE_Driver *ide, u16 *buffer) {
     
     status = ide_get_status_400ns(ide);
     
-    ide->read_sectors_lba28(buffer, 1, 0);
+    ide->_raw_read(buffer, IDE_SECTOR_SIZE, nullptr);
+    ide->drive_info[ide->selected_drive].present = true;
+    ide->drive_info[ide->selected_drive].dma = (buffer[PCI_IDE_IDENTIFY_CAPABILITIES_WORD] & PCI_IDE_IDENTIFY_CAPABILITIES_DMA_BIT) != 0;
     return 0;
 }
 
-void setup_ide_driver(Pci_Device_Config *header, IDE_Driver *ide, u16 command_block, u16 control_block) {
+// @Incomplete we keep whatever DMA mode the firmware left the drive in, rather than picking one with SET FEATURES
+static void setup_ide_dma(Pci_Device_Config *header, IDE_Driver *ide, u16 bus_master_offset) {
+    u32 bar4 = header->type_00.bar4;
+    if (!(bar4 & PCI_IDE_BAR_IO_SPACE_BIT) || !(bar4 & 0xFFFC)) {
+        kprint("IDE: no bus master registers, PIO only\n");
+        return;
+    }
+    
+    // the PRDT only has to be 4 byte aligned and not cross a 64KiB boundary, a page of its own does both
+    u32 prdt_physical = next_free_page();
+    u32 buffer_physical = alloc_pages(IDE_DMA_BUFFER_ORDER);
+    void *prdt = prdt_physical ? physical_to_virtual(prdt_physical) : nullptr;
+    void *buffer = buffer_physical ? physical_to_virtual(buffer_physical) : nullptr;
+    if (!prdt || !buffer) {
+        if (prdt_physical) free_page(prdt_physical);
+        if (buffer_physical) free_pages(buffer_physical, IDE_DMA_BUFFER_ORDER);
+        kprint("IDE: no memory in the direct map for DMA, PIO only\n");
+        return;
+    }
+    
+    ide->bus_master_block = static_cast<u16>((bar4 & 0xFFFC) + bus_master_offset);
+    ide->prdt = reinterpret_cast<Ide_Prd *>(prdt);
+    ide->prdt_physical = prdt_physical;
+    ide->dma_buffer = reinterpret_cast<u8 *>(buffer);
+    ide->dma_buffer_physical = buffer_physical;
+    ide->use_dma = true;
+}
+
+void setup_ide_driver(Pci_Device_Config *header, IDE_Driver *ide, u16 command_block, u16 control_block, s32 compat_irq, u16 bus_master_offset) {
     u8 prog_if = header->prog_if;
     
     ide->is_compat_mode = ((prog_if & PCI_IDE_PROG_IF_PRIMARY_MODE_BIT) == 0);
     if (ide->is_compat_mode) {
         ide->command_block = command_block;
         ide->control_block = control_block;
+        ide->irq = compat_irq;
+    } else {
+        ide->irq = header->type_00.interrupt_line;
     }
     ide->selected_drive = 0xFF;
     
@@ -320,20 +535,18 @@ void setup_ide_driver(Pci_Device_Config *header, IDE_Driver *ide, u16 command_bl
     }
     
     kassert(ide->selected_drive == 0xFF);
+    setup_ide_dma(header, ide, bus_master_offset);
+    mutex_lock(&ide->lock);
     
-    // install irq handler
-    // @FixMe do this for both controller drivers
-    // if we have two controllers
-    // register_irq_handler(14, "IDE Controller", ide_irq_handler, ide_primary_driver);
+    // before the reset, which clears nIEN in the device control register and so lets the drive raise it
+    ide->use_irq = true;
+    register_irq_handler(ide->irq, "IDE Controller", ide_irq_handler, ide);
+    irq_unmask(ide->irq);
     
     ide->write_cmd_u8(PCI_IDE_DRIVE_HEAD_REGISTER, 0);
     ide->write_ctrl_u8(PCI_IDE_DEVICE_CONTROL_WRITE_REGISTER, 1 << 2);
     ide->write_ctrl_u8(PCI_IDE_DEVICE_CONTROL_WRITE_REGISTER, 0);
     
-    // void clear_irq_mask(u8 irq_line);
-    // clear_irq_mask(2);
-    // clear_irq_mask(14);
-    
     u16 buffer[1024];
     zero_memory(&buffer, 512);
     
@@ -376,6 +589,8 @@ void setup_ide_driver(Pci_Device_Config *header, IDE_Driver *ide, u16 command_bl
     
     // ide_device_write_sectors_lba28(ide_primary_driver, &buffer, 1, 0);
     // zero_memory(&buffer, sizeof(buffer));
+    
+    mutex_unlock(&ide->lock);
 }
 
 void create_ide_driver(Pci_Device_Config *header) {
@@ -388,6 +603,49 @@ void create_ide_driver(Pci_Device_Config *header) {
     kprint("BAR4: %X\n", header->type_00.bar4);
     kprint("BAR5: %X\n", header->type_00.bar5);
     kprint("ProgIF: %X\n", header->prog_if);
-    setup_ide_driver(header, &ide_drivers[0], PCI_IDE_COMPAT_PRIMARY_COMMAND_BLOCK_START, PCI_IDE_COMPAT_PRIMARY_CONTROL_BLOCK_START);
-    setup_ide_driver(header, &ide_drivers[1], PCI_IDE_COMPAT_SECONDARY_COMMAND_BLOCK_START, PCI_IDE_COMPAT_SECONDARY_CONTROL_BLOCK_START);
+    
+    // bus mastering has to be on for DMA
+    pci_enable_memory(header);
+    
+    setup_ide_driver(header, &ide_drivers[0], PCI_IDE_COMPAT_PRIMARY_COMMAND_BLOCK_START, PCI_IDE_COMPAT_PRIMARY_CONTROL_BLOCK_START, PCI_IDE_COMPAT_PIMARY_IRQ, 0);
+    setup_ide_driver(header, &ide_drivers[1], PCI_IDE_COMPAT_SECONDARY_COMMAND_BLOCK_START, PCI_IDE_COMPAT_SECONDARY_CONTROL_BLOCK_START, PCI_IDE_COMPAT_SECONDARY_IRQ, PCI_IDE_BMDMA_SECONDARY_OFFSET);
+}
+
+// Reads sector_count sectors from the start of the first ATA drive, through DMA or PIO, for the disk_bench
+// command. Returns false if there is no such drive, it can't do DMA when asked for it or the read failed.
+bool ide_bench_read(bool dma, u32 sector_count, u64 *elapsed_ns) {
+    IDE_Driver *ide = nullptr;
+    u8 drive = 0;
+    for (u32 i = 0; i < 2 && !ide; ++i) {
+        for (u8 d = PCI_IDE_DRIVE_MASTER; d <= PCI_IDE_DRIVE_SLAVE; ++d) {
+            if (ide_drivers[i].drive_info[d].present && ide_drivers[i].drive_info[d].type == PCI_IDE_DRIVE_TYPE_ATA) {
+                ide = &ide_drivers[i];
+                drive = d;
+                break;
+            }
+        }
+    }
+    
+    if (!ide) return false;
+    
+    u8 *buffer = reinterpret_cast<u8 *>(heap_alloc(IDE_DMA_BUFFER_SIZE));
+    mutex_lock(&ide->lock);
+    ide->select_drive(drive);
+    
+    bool ok = !dma || ide->dma_usable();
+    u64 start_ns = clock_monotonic_ns();
+    for (u32 lba = 0; ok && lba < sector_count; lba += IDE_DMA_MAX_SECTORS) {
+        u32 count = (sector_count - lba < IDE_DMA_MAX_SECTORS) ? sector_count - lba : IDE_DMA_MAX_SECTORS;
+        if (dma) {
+            u32 done;
+            ok = (ide->dma_sectors_lba28(buffer, count, lba, false, &done) == 0);
+        } else {
+            ok = (ide->pio_read_sectors_lba28(buffer, static_cast<u8>(count), lba) == 0);
+        }
+    }
+    *elapsed_ns = clock_monotonic_ns() - start_ns;
+    
+    mutex_unlock(&ide->lock);
+    heap_free(buffer);
+    return ok;
 }
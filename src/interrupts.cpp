@@ -1,6 +1,13 @@
 
 #include "kernel.h"
 #include "interrupts.h"
+#include "heap.h"
+#include "ring_buffer.h"
+#include "spinlock.h"
+#include "acpi.h"
+#include "apic.h"
+#include "timer.h"
+#include "thread.h"
 
 struct Idt_Descriptor {
     u16 offset_1;
@@ -26,43 +33,226 @@ void set_idt_entry(Idt_Descriptor *idt, u32 offset, u8 type_attr, u8 privelege)
 struct IRQ_Receiver {
     void *dev;
     irq_handler_type handler;
+    Irq_Handler_Stats stats;
 };
 
-Array<IRQ_Receiver> irq_Receiver_table[0x10];
+// a fixed table rather than an Array, handlers are registered before the heap is up and the table is
+// walked from interrupt context
+struct IRQ_Line {
+    IRQ_Receiver receivers[IRQ_MAX_HANDLERS];
+    u32 receiver_count;
+    
+    Irq_Stats stats; // everything but the handler entries, irq_get_stats() fills those in
+    bool unmasked;
+};
+
+IRQ_Line irq_lines[IRQ_COUNT];
+
+// the handlers only read the receivers. Their stats are written under the read lock as well, which is fine
+// as long as every irq is delivered to the bootstrap cpu
+RW_Lock irq_lines_lock;
 
 void register_irq_handler(s32 irq, String device_name, irq_handler_type handler,  void *dev) {
-    kassert(irq >= 0 && irq < 0x10);
+    kassert(irq >= 0 && irq < IRQ_COUNT);
+    
+    u32 eflags = rw_write_lock_irqsave(&irq_lines_lock);
+    IRQ_Line *line = &irq_lines[irq];
     
-    For (irq_Receiver_table[irq]) {
-        if (it.dev == dev) return; // @TODO return an error code ?
+    for (u32 i = 0; i < line->receiver_count; ++i) {
+        if (line->receivers[i].dev == dev) {
+            rw_write_unlock_irqrestore(&irq_lines_lock, eflags);
+            return; // @TODO return an error code ?
+        }
     }
     
-    IRQ_Receiver recv;
-    recv.handler = handler;
-    recv.dev = dev;
+    kassert(line->receiver_count < IRQ_MAX_HANDLERS && "too many handlers on one irq line");
+    
+    IRQ_Receiver *recv = &line->receivers[line->receiver_count];
+    zero_memory(recv, sizeof(IRQ_Receiver));
+    recv->handler = handler;
+    recv->dev = dev;
+    recv->stats.device_name = device_name;
     
-    irq_Receiver_table[irq].add(recv);
+    line->receiver_count++;
+    rw_write_unlock_irqrestore(&irq_lines_lock, eflags);
 }
 
 void detach_irq_handler(s32 irq, void *dev) {
     
 }
 
-static void run_interrupt_handlers(s32 irq) {
+bool irq_use_apic = false;
+
+void irq_mask(s32 irq) {
+    kassert(irq >= 0 && irq < IRQ_COUNT);
+    irq_lines[irq].unmasked = false;
+    
+    if (irq_use_apic) {
+        ioapic_set_masked(irq, true);
+    } else if (irq < 16) {
+        set_irq_mask(static_cast<u8>(irq));
+    }
+}
+
+void irq_unmask(s32 irq) {
+    kassert(irq >= 0 && irq < IRQ_COUNT);
+    irq_lines[irq].unmasked = true;
+    
+    if (irq_use_apic) {
+        ioapic_set_masked(irq, false);
+    } else {
+        // the 8259s only have 16 inputs, this one has to wait for the APIC
+        if (irq < 16) clear_irq_mask(static_cast<u8>(irq));
+    }
+}
+
+void irq_eoi(s32 irq) {
+    // the local APIC tracks which vector is in service itself, an EOI is a single store
+    if (irq_use_apic) {
+        lapic_eoi();
+    } else {
+        pic_set_eoi(static_cast<u8>(IRQ_VECTOR_BASE + irq));
+    }
+}
+
+bool switch_irqs_to_apic() {
+    if (!acpi_init() || !apic_init()) {
+        kprint("irq: staying with the 8259 PIC\n");
+        return false;
+    }
+    
     u32 eflags = DISABLE_INTERRUPTS();
-    kassert(irq >= 0 && irq <= 0x10);
+    pic_disable();
+    irq_use_apic = true;
+    
+    for (s32 irq = 0; irq < IRQ_COUNT; ++irq) {
+        if (irq_lines[irq].unmasked) ioapic_set_masked(irq, false);
+    }
+    
+    RESTORE_INTERRUPTS(eflags);
+    return true;
+}
+
+static void add_cycles(u32 *count, u64 *cycles, u64 *max_cycles, u64 elapsed) {
+    *count += 1;
+    *cycles += elapsed;
+    if (elapsed > *max_cycles) *max_cycles = elapsed;
+}
+
+Irq_Stats irq_get_stats(s32 irq) {
+    kassert(irq >= 0 && irq < IRQ_COUNT);
+    
+    u32 eflags = rw_read_lock_irqsave(&irq_lines_lock);
+    IRQ_Line *line = &irq_lines[irq];
+    
+    Irq_Stats stats = line->stats;
+    stats.handler_count = line->receiver_count;
+    for (u32 i = 0; i < line->receiver_count; ++i) {
+        stats.handlers[i] = line->receivers[i].stats;
+    }
+    rw_read_unlock_irqrestore(&irq_lines_lock, eflags);
+    
+    stats.deferred_work_dropped = deferred_work_dropped(irq);
+    return stats;
+}
+
+struct Deferred_Work {
+    deferred_work_type work;
+    void *dev;
+    u32 arg;
+};
+
+// the irq handler is the only producer of its queue, run_deferred_work() the only consumer
+Ring_Buffer<Deferred_Work, DEFERRED_WORK_QUEUE_SIZE> deferred_work_queues[IRQ_COUNT];
+Thread *deferred_work_thread;
+
+bool schedule_deferred_work(s32 irq, deferred_work_type work, void *dev, u32 arg) {
+    kassert(irq >= 0 && irq < IRQ_COUNT);
     
-    Array<IRQ_Receiver> *handlers = &irq_Receiver_table[irq];
+    Deferred_Work item;
+    item.work = work;
+    item.dev = dev;
+    item.arg = arg;
+    if (!deferred_work_queues[irq].push(item)) return false;
     
-    For (*handlers) {
-        irq_result_type result = it.handler(irq, it.dev);
-        if (result == IRQ_RESULT_HANDLED) break;
-        if (result == IRQ_RESULT_CONTINUE) continue;
+    thread_wake(deferred_work_thread);
+    return true;
+}
+
+void run_deferred_work() {
+    bool ran_any = true;
+    while (ran_any) {
+        ran_any = false;
+        
+        // one item per irq per round, so a busy line can't starve the others
+        for (s32 irq = 0; irq < IRQ_COUNT; ++irq) {
+            Deferred_Work item;
+            if (!deferred_work_queues[irq].pop(&item)) continue;
+            
+            item.work(item.dev, item.arg);
+            ran_any = true;
+        }
+    }
+}
+
+static void deferred_work_thread_main(void *arg) {
+    UNUSED(arg);
+    
+    while (true) {
+        run_deferred_work();
+        
+        // blocked before we look, so that work scheduled from another cpu in between wakes us up again
+        u32 eflags = DISABLE_INTERRUPTS();
+        thread_prepare_block();
+        if (deferred_work_pending()) thread_wake(thread_current());
+        thread_block();
+        RESTORE_INTERRUPTS(eflags);
+    }
+}
+
+void start_deferred_work_thread() {
+    deferred_work_thread = thread_create("deferred work", deferred_work_thread_main, nullptr);
+}
+
+bool deferred_work_pending() {
+    for (s32 irq = 0; irq < IRQ_COUNT; ++irq) {
+        if (deferred_work_queues[irq].count()) return true;
+    }
+    
+    return false;
+}
+
+u32 deferred_work_dropped(s32 irq) {
+    kassert(irq >= 0 && irq < IRQ_COUNT);
+    return deferred_work_queues[irq].dropped;
+}
+
+static void run_interrupt_handlers(s32 irq) {
+    kassert(irq >= 0 && irq < IRQ_COUNT);
+    u32 eflags = rw_read_lock_irqsave(&irq_lines_lock);
+    
+    IRQ_Line *line = &irq_lines[irq];
+    bool handled = false;
+    
+    u64 start = _read_tsc();
+    u64 handler_start = start;
+    for (u32 i = 0; i < line->receiver_count && !handled; ++i) {
+        IRQ_Receiver *it = &line->receivers[i];
+        irq_result_type result = it->handler(irq, it->dev);
+        
+        u64 handler_end = _read_tsc();
+        add_cycles(&it->stats.count, &it->stats.cycles, &it->stats.max_cycles, handler_end - handler_start);
+        handler_start = handler_end;
+        
+        if (result == IRQ_RESULT_HANDLED) handled = true;
         
         // @TODO what should we do if the driver returns other codes?
     }
     
-    RESTORE_INTERRUPTS(eflags);
+    add_cycles(&line->stats.count, &line->stats.cycles, &line->stats.max_cycles, handler_start - start);
+    if (!handled) line->stats.unhandled++;
+    
+    rw_read_unlock_irqrestore(&irq_lines_lock, eflags);
 }
 
 __attribute__((interrupt))
@@ -152,7 +342,11 @@ void __irq_0x0D_handler(void *arg, u32 error_code) {
 __attribute__((interrupt))
 void __irq_0x0E_handler(void *arg, u32 error_code) {
     UNUSED(arg);
-    kerror("PAGE FAULT: %u", error_code);
+    u32 address = _read_cr2();
+    
+    if (!(error_code & PAGE_FAULT_PROTECTION_VIOLATION) && heap_handle_page_fault(address)) return;
+    
+    kerror("PAGE FAULT: %X, error code %u", address, error_code);
 }
 
 __attribute__((interrupt))
@@ -260,7 +454,8 @@ __attribute__((interrupt))
 void __irq_0x20_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(0);
-    pic_set_eoi(0x20);
+    irq_eoi(0);
+    thread_preempt();
 }
 
 #include "keyboard.h"
@@ -403,7 +598,7 @@ u32 scancode_set2_table[] = {
 u8 _shift_pressed = 0;
 u8 _ctrl_pressed = 0;
 
-Array<Input> keyboard_event_queue;
+Ring_Buffer<Input, KEYBOARD_EVENT_QUEUE_SIZE> keyboard_event_queue;
 
 u8 get_ascii_representable_character(u32 keycode, bool shift_pressed) {
     if (keycode >= 0x20 && keycode < 0x7F) {
@@ -435,138 +630,172 @@ u8 get_ascii_representable_character(u32 keycode, bool shift_pressed) {
     return ASCII_EXTENDED_BLOCK;
 }
 
-__attribute__((interrupt))
-void __irq_0x21_handler(void *arg) {
-    UNUSED(arg);
-    run_interrupt_handlers(1);
+// the bottom half of the keyboard interrupt, arg is the scancode with the action in the second byte
+static void keyboard_deferred_work(void *dev, u32 arg) {
+    UNUSED(dev);
+    u8 scancode = static_cast<u8>(arg);
+    u8 action = static_cast<u8>(arg >> 8);
     
-    if (_port_io_read_u8(PS2_STATUS) & PS2_STATUS_OUTPUT_BUFFER_BIT) {
-        u8 scancode = _port_io_read_u8(PS2_DATA); _io_wait();
-        
-        u8 action = KEY_PRESS;
-        if (scancode == 0xF0) {
-            action = KEY_RELEASE;
-            // @TODO maybe wait here?
-            scancode = _port_io_read_u8(PS2_DATA); _io_wait();
-        } else if (scancode == 0xE0) {
-            kassert(false);
-        }
+    if (scancode >= 0x84) {
+        // kprint("SCANCODE: %X\n", scancode);
+        return;
+    }
+    
+    u32 keycode = scancode_set2_table[scancode];
+    if (keycode == KEYCODE_LEFT_CONTROL || keycode == KEYCODE_RIGHT_CONTROL) {
+        _ctrl_pressed = action;
+    } else if (keycode == KEYCODE_LEFT_SHIFT || keycode == KEYCODE_RIGHT_SHIFT) {
+        _shift_pressed = action;
+    } else {
+        u8 ascii = get_ascii_representable_character(keycode, _shift_pressed == KEY_PRESS);
+        // kprint("KEYBOARD: action: %d, char: %c\n", action, ascii);
         
-        u8 temp = _port_io_read_u8(0x61);
-        _port_io_write_u8(0x61, temp | 0x80); _io_wait();
-        _port_io_write_u8(0x61, temp); _io_wait();
+        Input i;
+        i.shift_pressed = _shift_pressed;
+        i.ctrl_pressed = _ctrl_pressed;
+        i.action = action;
+        i.keycode = keycode;
+        i.utf8_code[0] = ascii; // @Hack @FixMe
         
-        if (scancode >= 0x84) {
-            // kprint("SCANCODE: %X\n", scancode);
-        } else {
-            u32 keycode = scancode_set2_table[scancode];
-            if (keycode == KEYCODE_LEFT_CONTROL || keycode == KEYCODE_RIGHT_CONTROL) {
-                _ctrl_pressed = action;
-            } else if (keycode == KEYCODE_LEFT_SHIFT || keycode == KEYCODE_RIGHT_SHIFT) {
-                _shift_pressed = action;
-            } else {
-                u8 ascii = get_ascii_representable_character(keycode, _shift_pressed == KEY_PRESS);
-                // kprint("KEYBOARD: action: %d, char: %c\n", action, ascii);
-                // if (buffer_count < 255) buffer[buffer_count++] = ascii;
-                {
-                    Input i;
-                    i.shift_pressed = _shift_pressed;
-                    i.ctrl_pressed = _ctrl_pressed;
-                    i.action = action;
-                    i.keycode = keycode;
-                    i.utf8_code[0] = ascii; // @Hack @FixMe
-                    
-                    keyboard_event_queue.add(i);
-                }
-            }
-        }
+        // if the GUI loop falls this far behind the key is lost, push() counts it
+        keyboard_event_queue.push(i);
     }
+}
+
+irq_result_type keyboard_irq_handler(s32 irq, void *dev) {
+    UNUSED(dev);
+    
+    if (!(_port_io_read_u8(PS2_STATUS) & PS2_STATUS_OUTPUT_BUFFER_BIT)) return IRQ_RESULT_CONTINUE;
     
-    pic_set_eoi(0x21);
+    u8 scancode = _port_io_read_u8(PS2_DATA); _io_wait();
+    
+    u8 action = KEY_PRESS;
+    if (scancode == 0xF0) {
+        action = KEY_RELEASE;
+        // @TODO maybe wait here?
+        scancode = _port_io_read_u8(PS2_DATA); _io_wait();
+    } else if (scancode == 0xE0) {
+        kassert(false);
+    }
+    
+    u8 temp = _port_io_read_u8(0x61);
+    _port_io_write_u8(0x61, temp | 0x80); _io_wait();
+    _port_io_write_u8(0x61, temp); _io_wait();
+    
+    schedule_deferred_work(irq, keyboard_deferred_work, nullptr, scancode | (action << 8));
+    return IRQ_RESULT_HANDLED;
+}
+
+__attribute__((interrupt))
+void __irq_0x21_handler(void *arg) {
+    UNUSED(arg);
+    run_interrupt_handlers(1);
+    irq_eoi(1);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x22_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(2);
-    pic_set_eoi(0x22);
+    irq_eoi(2);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x23_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(3);
-    pic_set_eoi(0x23);
+    irq_eoi(3);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x24_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(4);
-    pic_set_eoi(0x24);
+    irq_eoi(4);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x25_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(5);
-    pic_set_eoi(0x25);
+    irq_eoi(5);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x26_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(6);
-    pic_set_eoi(0x26);
+    irq_eoi(6);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x27_handler(void *arg) {
     UNUSED(arg);
+    
+    // the master PIC signals irq 7 when a request goes away before it is acknowledged. Then the irq isn't
+    // in service, and there is nothing to run and no EOI to send. With the APIC this is a real irq 7.
+    if (!irq_use_apic && !(pic_get_isr() & (1 << 7))) {
+        irq_lines[7].stats.spurious++;
+        return;
+    }
+    
     run_interrupt_handlers(7);
-    pic_set_eoi(0x27);
+    irq_eoi(7);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x28_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(8);
-    pic_set_eoi(0x28);
+    irq_eoi(8);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x29_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(9);
-    pic_set_eoi(0x29);
+    irq_eoi(9);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x2A_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(10);
-    pic_set_eoi(0x2A);
+    irq_eoi(10);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x2B_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(11);
-    pic_set_eoi(0x2B);
+    irq_eoi(11);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x2C_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(12);
-    pic_set_eoi(0x2C);
+    irq_eoi(12);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x2D_handler(void *arg) {
     UNUSED(arg);
     run_interrupt_handlers(13);
-    pic_set_eoi(0x2D);
+    irq_eoi(13);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
@@ -574,301 +803,408 @@ void __irq_0x2E_handler(void *arg) {
     UNUSED(arg);
     // kprint("IDE IRQ 14\n");
     run_interrupt_handlers(14);
-    pic_set_eoi(0x2E);
+    irq_eoi(14);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x2F_handler(void *arg) {
     UNUSED(arg);
+    
+    // same as irq 7 for the slave, but the master did see a real request on the cascade and needs its EOI
+    if (!irq_use_apic && !(pic_get_isr() & (1 << 15))) {
+        irq_lines[15].stats.spurious++;
+        pic_set_eoi(0x20);
+        return;
+    }
+    
     run_interrupt_handlers(15);
-    pic_set_eoi(0x2F);
+    irq_eoi(15);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x30_handler(void *arg) {
     UNUSED(arg);
+    run_interrupt_handlers(16);
+    irq_eoi(16);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x31_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(17);
+    irq_eoi(17);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x32_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(18);
+    irq_eoi(18);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x33_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(19);
+    irq_eoi(19);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x34_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(20);
+    irq_eoi(20);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x35_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(21);
+    irq_eoi(21);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x36_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(22);
+    irq_eoi(22);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x37_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(23);
+    irq_eoi(23);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x38_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(24);
+    irq_eoi(24);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x39_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(25);
+    irq_eoi(25);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x3A_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(26);
+    irq_eoi(26);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x3B_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(27);
+    irq_eoi(27);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x3C_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(28);
+    irq_eoi(28);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x3D_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(29);
+    irq_eoi(29);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x3E_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(30);
+    irq_eoi(30);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x3F_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(31);
+    irq_eoi(31);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x40_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(32);
+    irq_eoi(32);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x41_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(33);
+    irq_eoi(33);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x42_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(34);
+    irq_eoi(34);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x43_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(35);
+    irq_eoi(35);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x44_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(36);
+    irq_eoi(36);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x45_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(37);
+    irq_eoi(37);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x46_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(38);
+    irq_eoi(38);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x47_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(39);
+    irq_eoi(39);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x48_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(40);
+    irq_eoi(40);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x49_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(41);
+    irq_eoi(41);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x4A_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(42);
+    irq_eoi(42);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x4B_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(43);
+    irq_eoi(43);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x4C_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(44);
+    irq_eoi(44);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x4D_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(45);
+    irq_eoi(45);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x4E_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(46);
+    irq_eoi(46);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x4F_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(47);
+    irq_eoi(47);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x50_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(48);
+    irq_eoi(48);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x51_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(49);
+    irq_eoi(49);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x52_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(50);
+    irq_eoi(50);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x53_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(51);
+    irq_eoi(51);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x54_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(52);
+    irq_eoi(52);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x55_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(53);
+    irq_eoi(53);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x56_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(54);
+    irq_eoi(54);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x57_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(55);
+    irq_eoi(55);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x58_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(56);
+    irq_eoi(56);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x59_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(57);
+    irq_eoi(57);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x5A_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(58);
+    irq_eoi(58);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x5B_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(59);
+    irq_eoi(59);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x5C_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(60);
+    irq_eoi(60);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x5D_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(61);
+    irq_eoi(61);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x5E_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(62);
+    irq_eoi(62);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0x5F_handler(void *arg) {
     UNUSED(arg);
-    
+    run_interrupt_handlers(63);
+    irq_eoi(63);
+    thread_preempt();
 }
 
 __attribute__((interrupt))
@@ -1546,19 +1882,27 @@ void __irq_0xCF_handler(void *arg) {
 __attribute__((interrupt))
 void __irq_0xD0_handler(void *arg) {
     UNUSED(arg);
-    
+    lapic_timer_interrupt();
+    lapic_eoi();
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0xD1_handler(void *arg) {
     UNUSED(arg);
     
+    // IPI_RESCHEDULE_VECTOR, whoever sent it already set need_resched for us
+    lapic_eoi();
+    thread_preempt();
 }
 
 __attribute__((interrupt))
 void __irq_0xD2_handler(void *arg) {
     UNUSED(arg);
     
+    // IPI_TLB_SHOOTDOWN_VECTOR
+    tlb_shootdown_poll();
+    lapic_eoi();
 }
 
 __attribute__((interrupt))
@@ -2089,5 +2433,9 @@ void init_interrupt_descriptor_table() {
     set_idt_entry(&idt_table[0xFE], (u32)&__irq_0xFE_handler, INTERRUPT_PRESENT | INTERRUPT_TYPE_GATE_32, 0);
     set_idt_entry(&idt_table[0xFF], (u32)&__irq_0xFF_handler, INTERRUPT_PRESENT | INTERRUPT_TYPE_GATE_32, 0);
     
+    load_interrupt_descriptor_table();
+}
+
+void load_interrupt_descriptor_table() {
     set_idt(&idt_table, sizeof(idt_table[0]) * 256);
 }
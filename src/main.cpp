@@ -6,38 +6,15 @@
 #include "keyboard.h"
 #include "pci.h"
 #include "print.h"
-
-struct Multiboot_Mmap {
-    u32 size;
-    u64 base_addr;
-    u64 length;
-    
-    enum {
-        MEMORY_AVAILABLE = 1,
-        MEMORY_RESERVED = 2,
-        MEMORY_ACPI_RECLAIMABLE = 3,
-        MEMORY_NVS = 4,
-        MEMORY_BADRAM = 5,
-    };
-    u32 type;
-} PACKED;
-
-struct Multiboot_Information {
-    u32 flags;
-    u32 mem_lower;
-    u32 mem_upper;
-    u32 boot_device;
-    u32 cmdline;
-    u32 mods_count;
-    u32 mods_addr;
-    u8 syms[12];
-    u32 mmap_length;
-    u32 mmap_addr;
-    u32 drives_length;
-    u32 drives_addr;
-    u32 config_table;
-    u32 boot_loader_name;
-};
+#include "multiboot.h"
+#include "page_allocator.h"
+#include "cpu.h"
+#include "arena.h"
+#include "apic.h"
+#include "timer.h"
+#include "thread.h"
+#include "smp.h"
+#include "spinlock.h"
 
 s64 strlen(char *c_string) {
     if (!c_string) return 0;
@@ -59,229 +36,366 @@ String temp_string(char *c_string) {
     return temp_string(c_string, strlen(c_string));
 }
 
-void memcpy(void *dst, void *src, u32 num) {
-    u8 *_dst = reinterpret_cast<u8 *>(dst);
-    u8 *_src = reinterpret_cast<u8 *>(src);
+extern "C" {
+    void load_page_directory(u32 page_directory);
     
-    for (u32 i = 0; i < num; ++i) {
-        _dst[i] = _src[i];
-    }
-}
-
-void  *zero_memory(void *_dst, u32 size) {
-    u8 *dst = reinterpret_cast<u8 *>(_dst);
-    for (u32 i = 0; i < size; ++i) {
-        dst[i] =  0;
-    }
+    void enable_paging();
+    
+    void flush_tlb();
+    
+    void flush_tlb_global();
     
-    return _dst;
+    void invalidate_page_i486(u32 page);
 }
 
-struct Bitmap_Entry {
-    u32 range_start;
-    u32 range_end;
-    u32 *buffer;
-};
+void invalidate_page(u32 page) {
+    // @TODO maybe, invlpg instruction exists in i486 and newer, but we probably don't care to support anything thats several decades old!
+    // if (supports_invlpg(cpu)) {
+    invalidate_page_i486(page);
+    // } else {
+    //     flush_tlb();
+    // }
+}
 
-#define BITMAP_BUFFER_COUNT 1024
-#define BITMAP_NUM_PAGES    (BITMAP_BUFFER_COUNT * 32)
 
-u32 initial_memory_use_bitmap[BITMAP_BUFFER_COUNT] ALIGN(4096);
-Bitmap_Entry initial_bitmap_entry;
+u32 page_directory[1024] ALIGN(PAGE_SIZE);
+u32 first_page_table[1024] ALIGN(PAGE_SIZE);
+// this will allow the heap to map pages into the heap's address space
+// until we can map + generate page tables from the heap
+u32 heap_page_table[1024] ALIGN(PAGE_SIZE);
 
-u32 upper_memory_size_pages; // initially set in kernel_main
-Array<Bitmap_Entry> bitmap_entries;
-u32 num_bitmap_entries;
 
-void mark_page_as_used(u32 physical) {
-    kassert((physical & (PAGE_SIZE-1)) == 0);
-    kassert(physical >= 0x00100000);
+u32 virtual_to_physical_address(u32 virtual_addr) {
+    u32 dir_index = virtual_addr >> 22;
+    u32 table_index = (virtual_addr >> 12) & 0x03FF;
     
-    u32 page_number = ((physical - 0x00100000) / PAGE_SIZE);
-    u32 bitmap_index = page_number / BITMAP_NUM_PAGES;
-    u32 buffer_index = (page_number / 32) % BITMAP_BUFFER_COUNT;
-    u32 page_bit = page_number % 32;
+    u32 *pd = (u32 *) 0xFFFFF000;
+    u32 *pt = ((u32 *) 0xFFC00000) + (0x400 * dir_index);
     
+    if (!(pd[dir_index] & PAGE_PRESENT)) return 0;
+    if (pd[dir_index] & PAGE_SIZE_4MiB) return (pd[dir_index] & ~0x3FFFFF) + (virtual_addr & 0x3FFFFF);
+    if (!(pt[table_index] & PAGE_PRESENT)) return 0;
     
-    bitmap_entries[bitmap_index].buffer[buffer_index] |= (1 << page_bit);
+    return (pt[table_index] & ~0xFFF) + (virtual_addr & 0xFFF);
 }
 
-void mark_page_as_free(u32 physical) {
-    kassert((physical & (PAGE_SIZE-1)) == 0);
-    kassert(physical >= 0x00100000);
-    
-    u32 page_number = ((physical - 0x00100000) / PAGE_SIZE);
-    u32 bitmap_index = page_number / BITMAP_NUM_PAGES;
-    u32 buffer_index = (page_number / 32) % BITMAP_BUFFER_COUNT;
-    u32 page_bit = page_number % 32;
-    
-    bitmap_entries[bitmap_index].buffer[buffer_index] &= ~(1 << page_bit);
+// above this many pages it's cheaper to flush the whole TLB than to invlpg every one of them
+#define TLB_FLUSH_ALL_THRESHOLD 32
+
+#define LARGE_PAGE_SIZE  0x400000
+#define LARGE_PAGE_PAGES 1024
+
+static u32 *page_table_of(u32 dir_index) {
+    return ((u32 *) 0xFFC00000) + (0x400 * dir_index);
 }
 
+void tlb_flush_address_space() {
+    flush_tlb();
+}
 
-void mark_page_range_as_used(u32 physical_start, u32 physical_end) {
-    kassert((physical_start & (PAGE_SIZE-1)) == 0);
-    kassert((physical_end & (PAGE_SIZE-1)) == 0);
-    kassert(physical_start <= physical_end);
-    
-    // @Speed there's probably a faster way to mark large memory regions as used
-    for (; physical_start <= physical_end; physical_start += PAGE_SIZE) {
-        mark_page_as_used(physical_start);
-    }
+void tlb_flush_all() {
+    if (cpu_features.pge) flush_tlb_global();
+    else                  flush_tlb();
 }
-u32 maybe_take_ownership_of_num_pages(u32 num) {
-    if (num > upper_memory_size_pages) {
-        u32 out = upper_memory_size_pages;
-        upper_memory_size_pages = 0;
-        return out;
+
+// invlpg drops an entry whether it is global or not
+static void tlb_invalidate_range(u32 virtual_addr, u32 count) {
+    if (count > TLB_FLUSH_ALL_THRESHOLD) {
+        tlb_flush_all();
+        return;
     }
     
-    upper_memory_size_pages -= num;
-    return num;
+    for (u32 i = 0; i < count; ++i) {
+        invalidate_page(virtual_addr + (i * PAGE_SIZE));
+    }
 }
 
-void make_bitmap_entry(Bitmap_Entry *entry, u32 range_start, u32 num_pages, u32 *bitmap) {
-    kassert(num_pages && "cannot make a bitmap entry of zero size!");
+// Once the other cpus are up, whoever changes an entry that may be in a TLB sends them
+// IPI_TLB_SHOOTDOWN_VECTOR and waits until every one of them has invalidated the range too. Only the
+// holder of paging_lock shoots down, so there is only ever one request. A cpu spinning on any lock with
+// interrupts off works on the request from its spin loop, see spinlock.h.
+//
+// That only covers waiters that are in a spin loop, anything else waiting with interrupts off for something
+// we hold would never answer. So nothing but paging_lock may be held while we wait, tlb_shootdown() asserts it.
+struct Tlb_Shootdown_Request {
+    u32 virtual_addr;
+    u32 count;
+    volatile u32 pending; // cpus that haven't invalidated yet
+};
+
+static Tlb_Shootdown_Request tlb_shootdown_request;
+
+// Every change to the page tables happens under paging_lock, the underscore versions below want it held.
+Spin_Lock paging_lock;
+
+void tlb_shootdown_poll() {
+    Cpu *cpu = this_cpu();
+    if (!__atomic_exchange_n(&cpu->tlb_shootdown_pending, false, __ATOMIC_ACQUIRE)) return;
     
-    entry->range_start = range_start;
-    entry->range_end = range_start + (num_pages * PAGE_SIZE);
-    entry->buffer = bitmap;
+    tlb_invalidate_range(tlb_shootdown_request.virtual_addr, tlb_shootdown_request.count);
+    __atomic_fetch_sub(&tlb_shootdown_request.pending, 1, __ATOMIC_RELEASE);
 }
 
-u32 next_free_page() {
-    for (s64 i = 0; i < bitmap_entries.count; ++i) {
-        auto entry = bitmap_entries[i];
+// called with paging_lock held, and no other spin lock
+void tlb_shootdown(u32 virtual_addr, u32 count) {
+    kassert(this_cpu()->spin_locks_held == 1 && "tlb_shootdown with a spin lock held besides paging_lock");
+    kassert(paging_lock.locked && "tlb_shootdown without paging_lock");
+    tlb_invalidate_range(virtual_addr, count);
+    
+    Tlb_Shootdown_Request *request = &tlb_shootdown_request;
+    request->virtual_addr = virtual_addr;
+    request->count = count;
+    __atomic_store_n(&request->pending, 0, __ATOMIC_RELAXED);
+    
+    // Every cpu that is online gets the IPI, not only the ones counted in cpu_count, smp_start_aps() may be
+    // starting one right now. ap_entry() sets online and then flushes everything, so a cpu we don't see
+    // online yet flushes after our entries changed: the fence keeps our page table writes from being
+    // passed by the reads of online.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    Cpu *self = this_cpu();
+    for (u32 i = 0; i < APIC_MAX_CPUS; ++i) {
+        Cpu *cpu = &cpus[i];
+        if (cpu == self || !__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) continue;
         
-        // @TODO i'm pretty sure this drops a handful of pages if we have a number of pages that don't divide evenly into 32
-        u32 buffer_count = ((entry.range_end - entry.range_start) / PAGE_SIZE) / 32;
-        for (u32 j = 0; j < buffer_count; ++j) {
-            u32 value = entry.buffer[j];
-            if (value == 0xFFFFFFFF) continue;
-            
-            for (int k = 0; k < 32; ++k) {
-                if (((value >> k) & 1) == 0) {
-                    u32 page = (k * PAGE_SIZE) + (j * 32 * PAGE_SIZE) + entry.range_start;
-                    mark_page_as_used(page);
-                    return page;
-                }
-            }
-        }
+        __atomic_fetch_add(&request->pending, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&cpu->tlb_shootdown_pending, true, __ATOMIC_RELEASE);
+        lapic_send_ipi(cpu->apic_id, IPI_TLB_SHOOTDOWN_VECTOR);
     }
     
-    return 0;
+    while (__atomic_load_n(&request->pending, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
 }
 
-void page_allocator_init() {
-    u32 total_num_pages = upper_memory_size_pages;
-    
-    zero_memory(&initial_memory_use_bitmap, sizeof(initial_memory_use_bitmap));
-    make_bitmap_entry(&initial_bitmap_entry, 0x00100000, maybe_take_ownership_of_num_pages(BITMAP_NUM_PAGES), &initial_memory_use_bitmap[0]);
+// gives this directory entry a fresh page table, with entry i set to (base + i pages) | page_flags
+static u32 *make_page_table(u32 dir_index, u32 dir_flags, u32 base, u32 page_flags) {
+    u32 *pd = (u32 *) 0xFFFFF000;
+    u32 *pt = page_table_of(dir_index);
     
-    bitmap_entries.data = &initial_bitmap_entry;
-    bitmap_entries.allocated = 1;
-    bitmap_entries.count = 1;
+    u32 table_physical = next_free_page();
+    kassert(table_physical && "out of memory for page tables");
     
-    extern u8 __KERNEL_MEMORY_START[];
-    extern u8 __KERNEL_MEMORY_END[];
+    pd[dir_index] = table_physical | dir_flags | PAGE_PRESENT;
     
-    u32 kstart = (u32)__KERNEL_MEMORY_START;
-    u32 kend = (u32)__KERNEL_MEMORY_END;
+    // the table is only accessible through the recursive mapping, make sure we dont see a stale entry for it
+    invalidate_page((u32) pt);
     
-    kprint("kernel physical address: %X\n", kstart - KERNEL_VIRTUAL_BASE_ADDRESS);
-    kprint("kernel end:              %X\n", kend - KERNEL_VIRTUAL_BASE_ADDRESS);
+    for (int i = 0; i < 1024; ++i) {
+        pt[i] = (base + (i * PAGE_SIZE)) | page_flags;
+    }
     
-    // mark kernel area as in use
-    mark_page_range_as_used(kstart - KERNEL_VIRTUAL_BASE_ADDRESS, kend - KERNEL_VIRTUAL_BASE_ADDRESS);
+    return pt;
+}
+
+// makes sure there is a page table for this directory entry, taking a fresh page if there isn't
+// and breaking up a 4MiB page into 4KiB ones if there is one
+static u32 *get_or_make_page_table(u32 dir_index) {
+    u32 *pd = (u32 *) 0xFFFFF000;
+    u32 pde = pd[dir_index];
     
-    // // now that we have a base tracker we can dynamically allocate
-    // // a region for bitmaps to track all of availabe physical memory
-    // bitmap_entries.resize((total_num_pages / BITMAP_NUM_PAGES) + ((total_num_pages % BITMAP_NUM_PAGES) ? 1 : 0));
+    if (!(pde & PAGE_PRESENT)) {
+        return make_page_table(dir_index, PAGE_READ_WRITE, 0, PAGE_READ_WRITE);
+    }
     
-    // kprint("Total ram size: %u MB\n", (total_num_pages * PAGE_SIZE) / (1024*1024));
-    // kprint("Bitmap entry count: %d\n", bitmap_entries.count);
+    if (pde & PAGE_SIZE_4MiB) {
+        // same translations as before, but the TLB may still hold the large one
+        u32 page_flags = (pde & 0xFFF & ~PAGE_SIZE_4MiB) | ((pde & PAGE_LARGE_PAT_BIT) ? PAGE_PAT_BIT : 0);
+        u32 *pt = make_page_table(dir_index, pde & (PAGE_READ_WRITE | PAGE_IS_NOT_PRIVILEGED), pde & ~0x3FFFFF, page_flags);
+        tlb_shootdown(dir_index << 22, LARGE_PAGE_PAGES);
+        return pt;
+    }
     
-    // for (s64 i = 1; i < bitmap_entries.count; ++i) {
-    //     auto last_etry = *bitmap_entries[i-1];
-    //     u32 num_pages = maybe_take_ownership_of_num_pages(BITMAP_NUM_PAGES);
-    //     kassert(num_pages);
-    //     // make_bitmap_entry();
-    // }
+    return page_table_of(dir_index);
 }
 
-extern "C" {
-    void load_page_directory(u32 page_directory);
+// maps count pages of physically contiguous memory, making page tables as needed. Entries that were
+// not present cant be in the TLB, so we only flush when we replaced existing mappings, once at the end.
+//
+// If flags has PAGE_SIZE_4MiB set, 4MiB pages are used for the parts of the range where both addresses
+// are 4MiB aligned and that are not already covered by a page table, if the cpu supports them.
+//
+// PAGE_WRITE_COMBINING selects the write-combining PAT entry. Without PAT the range is mapped UC- and
+// we try to cover it with a write-combining MTRR instead, which only works for power of two sized ranges.
+
+static void _map_range(u32 physical, u32 virtual_addr, u32 count, u32 flags) {
+    kassert((physical & (PAGE_SIZE-1)) == 0);
+    kassert((virtual_addr & (PAGE_SIZE-1)) == 0);
     
-    void enable_paging();
+    u32 *pd = (u32 *) 0xFFFFF000;
+    bool allow_large_pages = (flags & PAGE_SIZE_4MiB) && cpu_features.pse;
+    u32 page_flags = (flags & 0xFFF & ~(PAGE_SIZE_4MiB | PAGE_WRITE_COMBINING)) | PAGE_PRESENT;
+    u32 large_page_flags = page_flags;
+    
+    if (flags & PAGE_WRITE_COMBINING) {
+        page_flags &= ~(PAGE_USE_WRITE_THROUGH | PAGE_DO_NOT_CACHE);
+        if (cpu_features.pat) {
+            large_page_flags = page_flags | PAGE_LARGE_PAT_BIT;
+            page_flags |= PAGE_PAT_BIT;
+        } else {
+            page_flags |= PAGE_DO_NOT_CACHE;
+            large_page_flags = page_flags;
+            cpu_add_write_combining_range(physical, count * PAGE_SIZE);
+        }
+    }
     
-    void flush_tlb();
+    u32 first_replaced = 0;
+    u32 last_replaced = 0;
+    bool replaced_any = false;
     
-    void invalidate_page_i486(u32 page);
+    u32 *pt = nullptr;
+    u32 dir_index = 0;
+    u32 i = 0;
+    while (i < count) {
+        u32 addr = virtual_addr + (i * PAGE_SIZE);
+        u32 phys = physical + (i * PAGE_SIZE);
+        
+        if (allow_large_pages && count - i >= LARGE_PAGE_PAGES &&
+            (addr & (LARGE_PAGE_SIZE-1)) == 0 && (phys & (LARGE_PAGE_SIZE-1)) == 0) {
+            u32 pde = pd[addr >> 22];
+            if (!(pde & PAGE_PRESENT) || (pde & PAGE_SIZE_4MiB)) {
+                if (pde & PAGE_PRESENT) {
+                    if (!replaced_any) first_replaced = addr;
+                    last_replaced = addr + LARGE_PAGE_SIZE - PAGE_SIZE;
+                    replaced_any = true;
+                }
+                
+                pd[addr >> 22] = phys | large_page_flags | PAGE_SIZE_4MiB;
+                pt = nullptr;
+                i += LARGE_PAGE_PAGES;
+                continue;
+            }
+        }
+        
+        u32 table_index = (addr >> 12) & 0x03FF;
+        if (!pt || (addr >> 22) != dir_index) {
+            dir_index = addr >> 22;
+            pt = get_or_make_page_table(dir_index);
+        }
+        
+        if (pt[table_index] & PAGE_PRESENT) {
+            if (!replaced_any) first_replaced = addr;
+            last_replaced = addr;
+            replaced_any = true;
+        }
+        
+        pt[table_index] = phys | page_flags;
+        i++;
+    }
+    
+    if (replaced_any) tlb_shootdown(first_replaced, ((last_replaced - first_replaced) / PAGE_SIZE) + 1);
 }
 
-void invalidate_page(u32 page) {
-    // @TODO maybe, invlpg instruction exists in i486 and newer, but we probably don't care to support anything thats several decades old!
-    // if (supports_invlpg(cpu)) {
-    invalidate_page_i486(page);
-    // } else {
-    //     flush_tlb();
-    // }
+void map_range(u32 physical, u32 virtual_addr, u32 count, u32 flags) {
+    u32 eflags = spin_lock_irqsave(&paging_lock);
+    _map_range(physical, virtual_addr, count, flags);
+    spin_unlock_irqrestore(&paging_lock, eflags);
 }
 
-
-u32 page_directory[1024] ALIGN(PAGE_SIZE);
-u32 first_page_table[1024] ALIGN(PAGE_SIZE);
-// this will allow the heap to map pages into the heap's address space
-// until we can map + generate page tables from the heap
-u32 heap_page_table[1024] ALIGN(PAGE_SIZE);
-
-
-u32 virtual_to_physical_address(u32 virtual_addr) {
+bool map_page_if_unmapped(u32 physical, u32 virtual_addr, u32 flags) {
+    u32 *pd = (u32 *) 0xFFFFF000;
     u32 dir_index = virtual_addr >> 22;
     u32 table_index = (virtual_addr >> 12) & 0x03FF;
     
-    u32 *pd = (u32 *) 0xFFFFF000;
-    u32 *pt = ((u32 *) 0xFFC00000) + (0x400 * dir_index);
+    u32 eflags = spin_lock_irqsave(&paging_lock);
+    bool present = (pd[dir_index] & PAGE_PRESENT) &&
+        ((pd[dir_index] & PAGE_SIZE_4MiB) || (page_table_of(dir_index)[table_index] & PAGE_PRESENT));
+    if (!present) _map_range(physical, virtual_addr, 1, flags);
+    spin_unlock_irqrestore(&paging_lock, eflags);
     
-    if (!(pd[dir_index] & PAGE_PRESENT)) return 0;
-    if (!(pt[table_index] & PAGE_PRESENT)) return 0;
-    
-    return (pt[table_index] & ~0xFFF) + (virtual_addr & 0xFFF);
+    return !present;
 }
 
-void map_page(u32 physical, u32 virtual_addr, u32 flags) {
-    u32 dir_index = virtual_addr >> 22;
-    u32 table_index = (virtual_addr >> 12) & 0x03FF;
-    
-    u32 *pd =  (u32 *) 0xFFFFF000;
-    u32 *pt = ((u32 *) 0xFFC00000) + (0x400 * dir_index);
+static void _unmap_range(u32 virtual_addr, u32 count) {
+    kassert((virtual_addr & (PAGE_SIZE-1)) == 0);
     
-    if (!(pd[dir_index] & PAGE_PRESENT)) {
-        u32 *table = nullptr; // @Incomplete we crash if hit here
-        kassert(table);
-        for (int i = 0; i < 1024; ++i) {
-            table[i] = PAGE_READ_WRITE;
+    u32 *pd = (u32 *) 0xFFFFF000;
+    u32 i = 0;
+    while (i < count) {
+        u32 addr = virtual_addr + (i * PAGE_SIZE);
+        u32 dir_index = addr >> 22;
+        u32 table_index = (addr >> 12) & 0x03FF;
+        
+        if (!(pd[dir_index] & PAGE_PRESENT)) {
+            i++;
+            continue;
         }
-        pd[dir_index] = virtual_to_physical_address((u32) table) | PAGE_PRESENT | PAGE_READ_WRITE;
-        flush_tlb(); // @Cleanup invalidate the page?
         
-        // it should be accessible now!
-        pt = ((u32 *) 0xFFC00000) + (0x400 * dir_index);
+        if (pd[dir_index] & PAGE_SIZE_4MiB) {
+            if ((addr & (LARGE_PAGE_SIZE-1)) == 0 && count - i >= LARGE_PAGE_PAGES) {
+                pd[dir_index] = PAGE_READ_WRITE;
+                i += LARGE_PAGE_PAGES;
+                continue;
+            }
+            
+            // only part of the large page goes away
+            get_or_make_page_table(dir_index);
+        }
+        
+        page_table_of(dir_index)[table_index] = PAGE_READ_WRITE;
+        i++;
     }
     
-    pt[table_index] = (physical | (flags & 0xFFF)) | PAGE_PRESENT;
+    tlb_shootdown(virtual_addr, count);
 }
 
-void unmap_page(u32 virtual_addr) {
-    u32 dir_index = virtual_addr >> 22;
-    u32 table_index = (virtual_addr >> 12) & 0x03FF;
+void unmap_range(u32 virtual_addr, u32 count) {
+    u32 eflags = spin_lock_irqsave(&paging_lock);
+    _unmap_range(virtual_addr, count);
+    spin_unlock_irqrestore(&paging_lock, eflags);
+}
+
+// physical memory is mapped at DIRECT_MAP_VIRTUAL_ADDRESS, up to DIRECT_MAP_MAX_SIZE of it
+u32 direct_map_size;
+
+void init_direct_map() {
+    direct_map_size = page_allocator_memory_end();
+    if (direct_map_size > DIRECT_MAP_MAX_SIZE) direct_map_size = DIRECT_MAP_MAX_SIZE;
+    direct_map_size &= ~(PAGE_SIZE-1);
     
-    u32 *pd = (u32 *) 0xFFFFF000;
-    u32 *pt = ((u32 *) 0xFFC00000) + (0x400 * dir_index);
+    map_range(0, DIRECT_MAP_VIRTUAL_ADDRESS, direct_map_size / PAGE_SIZE, PAGE_READ_WRITE | PAGE_GLOBAL_BIT | PAGE_SIZE_4MiB);
+    kprint("direct map: %u MB at %X\n", direct_map_size / (1024 * 1024), DIRECT_MAP_VIRTUAL_ADDRESS);
+    
+    // zero_physical_page() writes the entries of the scratch pages itself, so their table has to be there
+    kassert(ZERO_PAGE_SCRATCH_VIRTUAL_ADDRESS >> 22 == (ZERO_PAGE_SCRATCH_VIRTUAL_ADDRESS + APIC_MAX_CPUS * PAGE_SIZE - 1) >> 22);
+    u32 eflags = spin_lock_irqsave(&paging_lock);
+    get_or_make_page_table(ZERO_PAGE_SCRATCH_VIRTUAL_ADDRESS >> 22);
+    spin_unlock_irqrestore(&paging_lock, eflags);
+}
+
+void *physical_to_virtual(u32 physical) {
+    if (physical >= direct_map_size) return nullptr;
+    return reinterpret_cast<void *>(DIRECT_MAP_VIRTUAL_ADDRESS + physical);
+}
+
+void zero_physical_page(u32 physical) {
+    void *page = physical_to_virtual(physical);
+    if (page) {
+        zero_memory(page, PAGE_SIZE);
+        return;
+    }
     
-    if (!(pd[dir_index] & PAGE_PRESENT)) return;
-    if (!(pt[table_index] & PAGE_PRESENT)) return;
+    // Every cpu has a scratch page of its own and only touches it with interrupts off, so nobody can get in
+    // between mapping and zeroing. No other cpu ever reads through our slot, whatever it may have cached for
+    // it can't do any harm, so we write the entry ourselves and only invalidate it here. That keeps
+    // paging_lock and tlb_shootdown() out of it, this runs for every page the zero pool refills.
+    kassert(direct_map_size && "zero_physical_page before init_direct_map");
+    u32 eflags = DISABLE_INTERRUPTS();
+    u32 scratch = ZERO_PAGE_SCRATCH_VIRTUAL_ADDRESS + (this_cpu()->index * PAGE_SIZE);
+    u32 *pt = page_table_of(scratch >> 22);
+    pt[(scratch >> 12) & 0x03FF] = physical | PAGE_PRESENT | PAGE_READ_WRITE;
+    invalidate_page(scratch);
     
-    pt[table_index] = PAGE_READ_WRITE;
+    zero_memory(reinterpret_cast<void *>(scratch), PAGE_SIZE);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+void map_page(u32 physical, u32 virtual_addr, u32 flags) {
+    map_range(physical, virtual_addr, 1, flags);
+}
+
+void unmap_page(u32 virtual_addr) {
+    unmap_range(virtual_addr, 1);
 }
 
 extern "C"
@@ -296,8 +410,12 @@ void map_page_table(u32 *table, u32 virtual_addr) {
     u32 dir_index = virtual_addr >> 22;
     
     u32 *pd = (u32 *) 0xFFFFF000;
+    bool was_present = (pd[dir_index] & PAGE_PRESENT);
     pd[dir_index] = table_physical | PAGE_PRESENT | PAGE_READ_WRITE;
-    flush_tlb(); // are we supposed to invalidate the directory or the table?
+    
+    // the recursive mapping of the table always changes, the pages it maps only do if we replaced a table
+    invalidate_page((u32) page_table_of(dir_index));
+    if (was_present) tlb_flush_all();
 }
 
 
@@ -313,8 +431,10 @@ u32 *init_page_table_directory() {
         pd[i] = PAGE_READ_WRITE;
     }
     
+    // global only counts once cpu_init() turns on CR4.PGE, by then the identity mapping
+    // through pd[0] that shares this table is gone
     for (int i = 0; i < 1024; ++i) {
-        pt[i] = (i * PAGE_SIZE) | PAGE_PRESENT | PAGE_READ_WRITE;
+        pt[i] = (i * PAGE_SIZE) | PAGE_PRESENT | PAGE_READ_WRITE | PAGE_GLOBAL_BIT;
     }
     
     for (int i = 0; i < 1024; ++i) {
@@ -404,6 +524,11 @@ struct {
     u32 offset;
 } gdt_descriptor;
 
+// set_gdt() leaves GS at the flat data segment, whoever calls this has to load their per cpu one again
+void gdt_load() {
+    set_gdt(&gdt_table, sizeof(u64) * GDT_ENTRY_COUNT);
+}
+
 void encode_gdt_entry(u64 *gdt_entry, u32 base, u32 limit, u8 type) {
     u8 *target = reinterpret_cast<u8 *>(gdt_entry);
     
@@ -485,6 +610,12 @@ void clear_irq_mask(u8 irq_line) {
 }
 
 
+void pic_disable() {
+    pic_remap(PIC_DISABLED_VECTOR_BASE, PIC_DISABLED_VECTOR_BASE + 8);
+    _port_io_write_u8(PIC1_DATA, 0xFF); _io_wait();
+    _port_io_write_u8(PIC2_DATA, 0xFF); _io_wait();
+}
+
 u16 pic_get_isr() {
     _port_io_write_u8(PIC1, PIC_READ_ISR);
     _port_io_write_u8(PIC2, PIC_READ_ISR);
@@ -531,7 +662,7 @@ void ps2_enable_devices() {
 }
 
 void ps2_initialize() {
-    set_irq_mask(1);
+    irq_mask(1);
     ps2_disable_devices();
     ps2_flush_output_buffers();
     
@@ -607,7 +738,8 @@ void ps2_initialize() {
     response = _port_io_read_u8(PS2_DATA);
     kassert(response == 0xFA);
     
-    clear_irq_mask(1);
+    register_irq_handler(1, "PS/2 keyboard", keyboard_irq_handler, nullptr);
+    irq_unmask(1);
 }
 
 u16 pci_read_u16(u32 bus, u32 slot, u32 func, u32 offset) {
@@ -692,132 +824,8 @@ void pci_enumerate_devices() {
     }
 }
 
-#define PIT_CHN0_DATA 0x40
-#define PIT_CHN1_DATA 0x41
-#define PIT_CHN2_DATA 0x42
-#define PIT_CMD       0x43
-
-#define PIT_CMD_SEL_CHN0 (0 << 6)
-#define PIT_CMD_SEL_CHN1 (1 << 6)
-#define PIT_CMD_SEL_CHN2 (2 << 6)
-#define PIT_CMD_READBACK (3 << 6)
-
-#define PIT_CMD_ACCESS_LATCH (0 << 4)
-#define PIT_CMD_ACCESS_LO    (1 << 4)
-#define PIT_CMD_ACCESS_HI    (2 << 4)
-#define PIT_CMD_ACCESS_LOHI  (3 << 4)
-
-#define PIT_CMD_OP_INT      (0 << 1)
-#define PIT_CMD_OP_ONE_SHOT (1 << 1)
-#define PIT_CMD_OP_RATE_GEN (2 << 1)
-#define PIT_CMD_OP_SQR_WAVE (3 << 1)
-#define PIT_CMD_OP_SW_STROBE (4 << 1)
-#define PIT_CMD_OP_HW_STROBE (5 << 1)
-
-#define PIT_CHANNEL0 0
-#define PIT_CHANNEL1 1
-#define PIT_CHANNEL2 2
-
-// same as Mode 2
-// #define PIT_CMD_OP_RATE_GEN2 (6 << 1)
-// same as Mode 3
-// #define PIT_CMD_OP_SQR_WAVE2 (7 << 1)
-
-#define PIT_CMD_BINARY16 (0 << 0)
-#define PIT_CMD_BCD      (1 << 0)
-
-#define PIT_MIN_FREQ    8 // Hz
-#define PIT_MAX_FREQ    1193181
-
-u16 pit_read_count(u8 channel) {
-    kassert(channel <= PIT_CHANNEL2);
-    
-    u32 eflags = DISABLE_INTERRUPTS();
-    
-    io_write_u8(PIT_CMD, channel << 6);
-    u8 lo = io_read_u8(PIT_CHN0_DATA + channel);
-    u8 hi = io_read_u8(PIT_CHN0_DATA + channel);
-    
-    u16 count = lo | (hi << 8);
-    
-    RESTORE_INTERRUPTS(eflags);
-    
-    return count;
-}
-
-void pit_set_reload_value(u8 channel, u16 value) {
-    u32 eflags = DISABLE_INTERRUPTS();
-    
-    io_write_u8(PIT_CHN0_DATA + channel, value & 0xFF);
-    io_write_u8(PIT_CHN0_DATA + channel, (value >> 8) & 0xFF);
-    
-    RESTORE_INTERRUPTS(eflags);
-}
-
-irq_result_type pit_irq_handler(s32 irq, void *dev);
-
-struct PIT_Data {
-    fixed32_32 system_timer_ms;
-    fixed32_32 irq0_step_ms;
-    u32 irq0_freq;
-    u16 pit_reload_value;
-    int once = 1;
-    
-    void init(u32 freq) {
-        u64 reload_value;
-        if (freq <= PIT_MIN_FREQ || freq >= PIT_MAX_FREQ) {
-            reload_value = 0x10000;
-        } else {
-            u64 value = PIT_MAX_FREQ / freq;
-            u32 rem = PIT_MAX_FREQ % freq;
-            
-            if (rem >= (PIT_MAX_FREQ / 2)) value++;
-            
-            
-            reload_value = value;
-        }
-        
-        pit_reload_value = (reload_value & 0xFFFF);
-        
-        fixed32_32 time_step_ms = ((reload_value * 3000) << 32) / 3579545;
-        irq0_step_ms = time_step_ms;
-        kprint("reload: %d\n", reload_value);
-        kprint("time step ms: %m\n", time_step_ms);
-        
-        u32 actual_freq = PIT_MAX_FREQ / reload_value;
-        
-        kprint("FREQ: %d\n", actual_freq);
-        irq0_freq = actual_freq;
-        
-        system_timer_ms = 0;
-        once = 1;
-        
-        u32 eflags = DISABLE_INTERRUPTS();
-        
-        io_write_u8(PIT_CMD, PIT_CMD_SEL_CHN0 | PIT_CMD_ACCESS_LOHI | PIT_CMD_OP_RATE_GEN);
-        pit_set_reload_value(PIT_CHANNEL0, pit_reload_value);
-        register_irq_handler(0, "PIT", pit_irq_handler, this);
-        clear_irq_mask(0);
-        
-        RESTORE_INTERRUPTS(eflags);
-        
-    }
-    
-} pit_data;
-
-irq_result_type pit_irq_handler(s32 irq, void *dev) {
-    PIT_Data *pit = reinterpret_cast<PIT_Data *>(dev);
-    
-    if (pit->once) {
-        pit->once = 0;
-        kprint("\n\nINTERRUTP: %m\n\n", pit->irq0_step_ms);
-    }
-    
-    pit->system_timer_ms += pit->irq0_step_ms;
-    return IRQ_RESULT_HANDLED;
-}
-
 void create_ide_driver(Pci_Device_Config *header);
+bool ide_bench_read(bool dma, u32 sector_count, u64 *elapsed_ns);
 void create_svga_driver(Pci_Device_Config *header);
 
 void kernel_shell();
@@ -827,7 +835,6 @@ void kernel_main(Multiboot_Information *info) {
     asm("cli");
     _port_io_write_u8(PIC1_DATA, 0xFF); _io_wait();
     _port_io_write_u8(PIC2_DATA, 0xFF); _io_wait();
-    upper_memory_size_pages = info->mem_upper / 4; // convert KB to pages (4096 byte blocks)
     vga = Vga();
     
     Stream *output = &streams[0];
@@ -844,9 +851,16 @@ void kernel_main(Multiboot_Information *info) {
     encode_gdt_entry(&gdt_table[0], 0, 0, 0);
     encode_gdt_entry(&gdt_table[1], 0, 0xFFFFFFFF, 0x9A); // code segment
     encode_gdt_entry(&gdt_table[2], 0, 0xFFFFFFFF, 0x92); // data segment
-    gdt_descriptor.size = sizeof(u64) * 3;
+    
+    // one data segment per cpu for GS, over its Cpu
+    for (u32 i = 0; i < APIC_MAX_CPUS; ++i) {
+        encode_gdt_entry(&gdt_table[GDT_CPU_DATA_FIRST + i], reinterpret_cast<u32>(&cpus[i]), sizeof(Cpu) - 1, 0x92);
+    }
+    
+    gdt_descriptor.size = sizeof(u64) * GDT_ENTRY_COUNT;
     gdt_descriptor.offset = reinterpret_cast<u32>(&gdt_table[0]);
-    set_gdt(&gdt_table, sizeof(u64) * 3);
+    gdt_load();
+    smp_init_bsp();
     kprint("done\n");
     kprint("Setting up IDT...");
     init_interrupt_descriptor_table();
@@ -856,10 +870,19 @@ void kernel_main(Multiboot_Information *info) {
     ps2_initialize();
     asm("sti");
     
-    page_allocator_init();
+    cpu_init();
+    
+    page_allocator_init(info);
+    init_direct_map();
     
     init_heap();
     
+    switch_irqs_to_apic();
+    timer_init();
+    threads_init();
+    start_deferred_work_thread();
+    smp_start_aps();
+    
     kprint("Kernel is at physical addr: %X\n", virtual_to_physical_address(KERNEL_VIRTUAL_BASE_ADDRESS + 0x00100000));
     
     // kprint("Image begins at phys: %X\n", virtual_to_physical_address((u32) image_data));
@@ -962,9 +985,19 @@ void svga_update_screen(VMW_SVGA_Driver *svga);
 void svga_draw_circle(VMW_SVGA_Driver *svga, s32 x, s32 y, s32 radius, u32 color);
 void svga_copy_line_to_fb(VMW_SVGA_Driver *svga, u8 *buffer, s32 width_in_pixels, s32 x, s32 y, u32 filter_color);
 void svga_cmd_update_rect(VMW_SVGA_Driver *svga, u32 x, u32 y, u32 width, u32 height);
+u32 svga_framebuffer_bytes(VMW_SVGA_Driver *svga);
+void svga_map_vram(VMW_SVGA_Driver *svga, bool write_combining);
 
 struct nk_context ctx;
 
+// for anything that only has to live until the next frame, reset at the start of each one
+Arena frame_arena;
+allocator_type frame_allocator = arena_allocator<&frame_arena>;
+
+// the keyboard events of this frame, drained from keyboard_event_queue at the start of it
+Input frame_input[KEYBOARD_EVENT_QUEUE_SIZE];
+u32 frame_input_count = 0;
+
 struct Terminal_Em {
     int current_scroll_offset_lines;
     String_Builder text_buffer; // this is a backlog
@@ -991,6 +1024,105 @@ void command_pci_info() {
     }
 }
 
+static void print_lock_stats(char *name, Lock_Stats *stats) {
+    kprint("    %s lock: %u acquisitions, %u contended, %u spins\n", name, stats->acquisitions, stats->contentions, stats->spins);
+}
+
+void command_mem_info() {
+    Page_Allocator_Stats pages = page_allocator_get_stats();
+    kprint("physical: %u MB in %u regions, %u pages used, %u pages free\n", pages.total_pages / 256, pages.region_count, pages.used_pages, pages.free_pages);
+    kprint("page cache: %u pages, %u hits, %u misses, %u drains\n", pages.cached_pages, pages.cache_hits, pages.cache_misses, pages.cache_drains);
+    kprint("zero pages: %u pages, %u hits, %u misses\n", pages.zeroed_pages, pages.zero_pool_hits, pages.zero_pool_misses);
+    
+    Heap_Stats heap = heap_get_stats();
+    kprint("heap: %u KB reserved, %u KB mapped, %u KB allocated, %u KB in free spans\n", heap.span_bytes / 1024, heap.mapped_bytes / 1024, heap.allocated_bytes / 1024, heap.free_span_bytes / 1024);
+    
+    print_lock_stats("buddy", &pages.buddy_lock);
+    print_lock_stats("zero pool", &pages.zero_pool_lock);
+    print_lock_stats("heap", &heap.lock);
+}
+
+void command_irq_stats() {
+    for (s32 irq = 0; irq < IRQ_COUNT; ++irq) {
+        Irq_Stats stats = irq_get_stats(irq);
+        if (!stats.count && !stats.spurious) continue;
+        
+        u32 average = stats.count ? static_cast<u32>(div_u64(stats.cycles, stats.count)) : 0;
+        kprint("irq %d: %u interrupts, %u avg cycles, %u max cycles, %u Mcycles total\n", irq, stats.count, average,
+               static_cast<u32>(stats.max_cycles), static_cast<u32>(stats.cycles >> 20));
+        kprint("    %u spurious, %u unhandled, %u deferred work dropped\n", stats.spurious, stats.unhandled, stats.deferred_work_dropped);
+        
+        for (u32 i = 0; i < stats.handler_count; ++i) {
+            Irq_Handler_Stats *handler = &stats.handlers[i];
+            average = handler->count ? static_cast<u32>(div_u64(handler->cycles, handler->count)) : 0;
+            kprint("    %S: %u calls, %u avg cycles, %u max cycles\n", handler->device_name, handler->count, average,
+                   static_cast<u32>(handler->max_cycles));
+        }
+    }
+}
+
+void command_cpus() {
+    for (u32 i = 0; i < cpu_count; ++i) {
+        Cpu_Sched_Stats stats = thread_get_cpu_stats(i);
+        
+        u32 online_ms = static_cast<u32>(div_u64(stats.online_ns, 1000000));
+        u32 busy_ms = online_ms - static_cast<u32>(div_u64(stats.idle_ns, 1000000));
+        u32 busy_percent = online_ms ? static_cast<u32>(div_u64(static_cast<u64>(busy_ms) * 100, online_ms)) : 0;
+        kprint("cpu %u: APIC id %u, running %S, busy %u percent of %u ms\n", i, stats.apic_id, stats.current, busy_percent, online_ms);
+        kprint("    %u switches, %u steals, %u threads waiting\n", stats.switches, stats.steals, stats.queue_length);
+        print_lock_stats("run queue", &stats.run_queue_lock);
+    }
+}
+
+#define FB_BENCH_FRAMES 16
+
+// full screen fills through an uncached and then a write-combining mapping of VRAM
+void command_fb_bench() {
+    u32 frame_bytes = svga_framebuffer_bytes(&svga_driver);
+    
+    for (u32 pass = 0; pass < 2; ++pass) {
+        bool write_combining = (pass == 1);
+        svga_map_vram(&svga_driver, write_combining);
+        
+        u64 start_ns = clock_monotonic_ns();
+        for (u32 i = 0; i < FB_BENCH_FRAMES; ++i) {
+            svga_clear_screen(&svga_driver, 0xFF000000 | (i * 0x00101010));
+        }
+        
+        // a locked instruction drains the write-combining buffers, so we time the writes reaching VRAM
+        asm volatile("lock; orl $0, (%%esp)" ::: "memory");
+        // there is no libgcc for 64 bit division
+        u32 elapsed_ms = static_cast<u32>(div_u64(clock_monotonic_ns() - start_ns, 1000000));
+        if (elapsed_ms == 0) elapsed_ms = 1;
+        
+        u32 kilobytes = (frame_bytes / 1024) * FB_BENCH_FRAMES;
+        kprint("%s: %u frames of %u KB in %u ms, %u MB/s\n", write_combining ? "write-combining" : "uncached",
+               FB_BENCH_FRAMES, frame_bytes / 1024, elapsed_ms, kilobytes * 1000 / elapsed_ms / 1024);
+    }
+}
+
+#define DISK_BENCH_SECTORS 8192
+
+// sequential reads from the start of the first disk with PIO and then with bus master DMA
+void command_disk_bench() {
+    for (u32 pass = 0; pass < 2; ++pass) {
+        bool dma = (pass == 1);
+        const char *mode = dma ? "DMA" : "PIO";
+        
+        u64 elapsed_ns;
+        if (!ide_bench_read(dma, DISK_BENCH_SECTORS, &elapsed_ns)) {
+            kprint("%s: no disk, or the read failed\n", mode);
+            continue;
+        }
+        
+        u32 elapsed_ms = static_cast<u32>(div_u64(elapsed_ns, 1000000));
+        if (elapsed_ms == 0) elapsed_ms = 1;
+        
+        u32 kilobytes = DISK_BENCH_SECTORS / 2;
+        kprint("%s: %u KB in %u ms, %u KB/s\n", mode, kilobytes, elapsed_ms, kilobytes * 1000 / elapsed_ms);
+    }
+}
+
 #define COMMAND(cmd_str, name) do { if(strings_match(cmd_str, #name)) command_ ## name(); } while(0)
 
 void draw_terminal(struct nk_context *ctx, Terminal_Em *term) {
@@ -1002,8 +1134,8 @@ void draw_terminal(struct nk_context *ctx, Terminal_Em *term) {
     if (!state) return;
     
     if (true) {
-        for (s64 i = 0; i < keyboard_event_queue.count; i++) {
-            Input in = keyboard_event_queue[i];
+        for (u32 i = 0; i < frame_input_count; i++) {
+            Input in = frame_input[i];
             if (in.action != KEY_PRESS) continue;
             
             if (in.keycode >= KEYCODE_SPACE && in.keycode < KEYCODE_BACKSPACE) {
@@ -1016,6 +1148,11 @@ void draw_terminal(struct nk_context *ctx, Terminal_Em *term) {
                 
                 // if (strings_match(term->user_input.data, "pci_info")) {}
                 COMMAND(term->user_input.data, pci_info);
+                COMMAND(term->user_input.data, mem_info);
+                COMMAND(term->user_input.data, fb_bench);
+                COMMAND(term->user_input.data, irq_stats);
+                COMMAND(term->user_input.data, cpus);
+                COMMAND(term->user_input.data, disk_bench);
                 
                 term->user_input.data.length = 0;
                 
@@ -1068,9 +1205,8 @@ void draw_terminal(struct nk_context *ctx, Terminal_Em *term) {
     nk_draw_text(canvas, space, (char *)user_input.data, (int)user_input.length, font, bg, fg);
     
     /*
-    String line = sprint("%S@%S # %S", user, machine, user_input);
+    String line = sprint(frame_allocator, "%S@%S # %S", user, machine, user_input);
     nk_draw_text(canvas, space, (char *)line.data, (int)line.length, font, bg, fg);
-    heap_free(line.data);
     */
 }
 
@@ -1099,6 +1235,8 @@ int terminal_putchar(void *payload, u8 c) {
 
 Terminal_Em term;
 
+#define FRAME_INTERVAL_NS 100000000 // 10 frames a second
+
 void kernel_shell() {
     enum {EASY, HARD};
     static int op = EASY;
@@ -1132,27 +1270,33 @@ void kernel_shell() {
     
     //kprint("Testing kprint ! %d\n", 123456789);
     
-    pit_data.init(700);
-    
     // for (;;) asm("hlt");
     
     int counter = 20;
     
+    u64 next_frame_ns = clock_monotonic_ns();
+    
     while (true) {
-        // 1 second
-        asm("hlt");
-        u32 eflags = DISABLE_INTERRUPTS();
+        // the other threads have the cpu until the next frame, or the idle thread if nobody wants it
+        thread_sleep_until(next_frame_ns);
         
-        if (pit_data.system_timer_ms < ((1000LL / 10LL) << 32)) {
-            RESTORE_INTERRUPTS(eflags);
-            continue;
-        }
+        // counted from the last deadline rather than from now, so frames don't drift. After falling behind
+        // we start over instead of rushing out the frames we missed.
+        u64 now_ns = clock_monotonic_ns();
+        next_frame_ns += FRAME_INTERVAL_NS;
+        if (next_frame_ns <= now_ns) next_frame_ns = now_ns + FRAME_INTERVAL_NS;
         
-        pit_data.system_timer_ms = 0;
+        arena_reset(&frame_arena);
+        
+        // the keyboard interrupt keeps pushing while we run, whatever comes in after this waits for the next frame
+        frame_input_count = 0;
+        while (frame_input_count < KEYBOARD_EVENT_QUEUE_SIZE && keyboard_event_queue.pop(&frame_input[frame_input_count])) {
+            frame_input_count++;
+        }
         
         nk_input_begin(&ctx);
-        for (s64 i = 0; i < keyboard_event_queue.count; i++) {
-            Input in = keyboard_event_queue[i];
+        for (u32 i = 0; i < frame_input_count; i++) {
+            Input in = frame_input[i];
             
             int state = (in.action == KEY_RELEASE) ? 0 : 1;
             switch (in.keycode) {
@@ -1233,11 +1377,6 @@ void kernel_shell() {
         }
         nk_end(&ctx);
         
-        // enable interrupts and clear the keyboard state at the end of the GUI update so we can
-        // read from the input queue during GUI updates
-        keyboard_event_queue.clear();
-        RESTORE_INTERRUPTS(eflags);
-        
         
         // svga_clear_screen(&svga_driver, 0xFF272822);
         const struct nk_command *it = 0;
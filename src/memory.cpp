@@ -0,0 +1,188 @@
+#include "kernel.h"
+#include "cpu.h"
+
+// Below MEMORY_REP_THRESHOLD bytes the startup cost of the string instructions dominates, so those copies
+// are plain dword loops. Bigger ones go through rep movsd/stosd once the destination is dword aligned,
+// which is fast on everything from the Pentium Pro on, as long as the source ends up aligned as well.
+// When it doesn't and the cpu has SSE2, memcpy moves 64 bytes per iteration through xmm registers with
+// unaligned loads and aligned stores instead. memset always has both sides aligned, so it sticks to rep stosd.
+// tools/memory_bench.cpp has the numbers.
+//
+// The SSE path saves and restores the xmm registers it uses itself, so it can run in interrupt
+// handlers without the kernel saving SSE state on every interrupt.
+// Threads may be preempted in the middle of a copy, the thread switch saves the xmm registers with fxsave.
+
+#define MEMORY_REP_THRESHOLD 64
+#define MEMORY_SSE_THRESHOLD 256
+
+// for the small loops, these may point anywhere and alias anything
+typedef u32 unaligned_u32 __attribute__((may_alias, aligned(1)));
+
+// the string instructions take their count in ecx (rcx for the host benchmark), so the counts are pointer sized
+static inline void rep_movsb(void *dst, void *src, uintptr_t count) {
+    asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(count) : : "memory");
+}
+
+static inline void rep_movsd(void *dst, void *src, uintptr_t count) {
+    asm volatile("rep movsl" : "+D"(dst), "+S"(src), "+c"(count) : : "memory");
+}
+
+static inline void rep_stosb(void *dst, u8 value, uintptr_t count) {
+    asm volatile("rep stosb" : "+D"(dst), "+c"(count) : "a"(value) : "memory");
+}
+
+static inline void rep_stosd(void *dst, u32 value, uintptr_t count) {
+    asm volatile("rep stosl" : "+D"(dst), "+c"(count) : "a"(value) : "memory");
+}
+
+// dst has to be 16 byte aligned
+static void sse_copy_blocks(u8 *dst, u8 *src, uintptr_t blocks) {
+    if (!blocks) return;
+    
+    u8 saved[64];
+    asm volatile(
+        "movdqu %%xmm0,  0(%[saved])\n"
+        "movdqu %%xmm1, 16(%[saved])\n"
+        "movdqu %%xmm2, 32(%[saved])\n"
+        "movdqu %%xmm3, 48(%[saved])\n"
+        "1:\n"
+        "movdqu  0(%[src]), %%xmm0\n"
+        "movdqu 16(%[src]), %%xmm1\n"
+        "movdqu 32(%[src]), %%xmm2\n"
+        "movdqu 48(%[src]), %%xmm3\n"
+        "movdqa %%xmm0,  0(%[dst])\n"
+        "movdqa %%xmm1, 16(%[dst])\n"
+        "movdqa %%xmm2, 32(%[dst])\n"
+        "movdqa %%xmm3, 48(%[dst])\n"
+        "add $64, %[src]\n"
+        "add $64, %[dst]\n"
+        "dec %[blocks]\n"
+        "jnz 1b\n"
+        "movdqu  0(%[saved]), %%xmm0\n"
+        "movdqu 16(%[saved]), %%xmm1\n"
+        "movdqu 32(%[saved]), %%xmm2\n"
+        "movdqu 48(%[saved]), %%xmm3\n"
+        : [dst] "+r"(dst), [src] "+r"(src), [blocks] "+r"(blocks)
+        : [saved] "r"(saved)
+        : "memory", "cc");
+}
+
+// the small loops must not be turned into a call to memcpy
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+void memcpy(void *_dst, void *_src, u32 num) {
+    u8 *dst = reinterpret_cast<u8 *>(_dst);
+    u8 *src = reinterpret_cast<u8 *>(_src);
+    
+    if (num >= MEMORY_REP_THRESHOLD) {
+        bool mutually_aligned = ((reinterpret_cast<uintptr_t>(dst) ^ reinterpret_cast<uintptr_t>(src)) & 3) == 0;
+        u32 align = (!mutually_aligned && num >= MEMORY_SSE_THRESHOLD && cpu_features.sse2) ? 16 : 4;
+        
+        u32 head = static_cast<u32>(-reinterpret_cast<uintptr_t>(dst)) & (align - 1);
+        rep_movsb(dst, src, head);
+        dst += head;
+        src += head;
+        num -= head;
+        
+        if (align == 16) {
+            sse_copy_blocks(dst, src, num / 64);
+            dst += num & ~63u;
+            src += num & ~63u;
+            num &= 63;
+        } else {
+            rep_movsd(dst, src, num / 4);
+            dst += num & ~3u;
+            src += num & ~3u;
+            num &= 3;
+        }
+    }
+    
+    while (num >= 4) {
+        *reinterpret_cast<unaligned_u32 *>(dst) = *reinterpret_cast<unaligned_u32 *>(src);
+        dst += 4;
+        src += 4;
+        num -= 4;
+    }
+    
+    while (num) {
+        *dst++ = *src++;
+        num--;
+    }
+}
+
+// the backwards loops must not be turned into a call to memmove
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+void *memmove(void *_dst, void *_src, u32 num) {
+    u8 *dst = reinterpret_cast<u8 *>(_dst);
+    u8 *src = reinterpret_cast<u8 *>(_src);
+    
+    // copying forwards only goes wrong if dst starts inside src
+    if (dst <= src || dst >= src + num) {
+        memcpy(dst, src, num);
+        return _dst;
+    }
+    
+    // @Speed std; rep movsd would do, but an interrupt arriving in the middle would run with the direction flag set
+    while (num && (reinterpret_cast<uintptr_t>(dst + num) & 3)) {
+        num--;
+        dst[num] = src[num];
+    }
+    
+    while (num >= 4) {
+        num -= 4;
+        *reinterpret_cast<unaligned_u32 *>(dst + num) = *reinterpret_cast<unaligned_u32 *>(src + num);
+    }
+    
+    while (num) {
+        num--;
+        dst[num] = src[num];
+    }
+    
+    return _dst;
+}
+
+// count is in u32s, dst has to be 4 byte aligned
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void fill_u32(u8 *dst, u32 value, u32 count) {
+    if (count * 4 >= MEMORY_REP_THRESHOLD) {
+        rep_stosd(dst, value, count);
+        return;
+    }
+    
+    u32 *words = reinterpret_cast<u32 *>(dst);
+    for (u32 i = 0; i < count; ++i) words[i] = value;
+}
+
+// the small loop must not be turned into a call to memset
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+void *memset(void *_dst, u8 value, u32 num) {
+    u8 *dst = reinterpret_cast<u8 *>(_dst);
+    
+    if (num >= MEMORY_REP_THRESHOLD) {
+        u32 head = static_cast<u32>(-reinterpret_cast<uintptr_t>(dst)) & 3;
+        rep_stosb(dst, value, head);
+        dst += head;
+        num -= head;
+        
+        fill_u32(dst, value * 0x01010101u, num / 4);
+        dst += num & ~3u;
+        num &= 3;
+    }
+    
+    while (num) {
+        *dst++ = value;
+        num--;
+    }
+    
+    return _dst;
+}
+
+void *memset32(void *dst, u32 value, u32 count) {
+    kassert((reinterpret_cast<uintptr_t>(dst) & 3) == 0);
+    
+    fill_u32(reinterpret_cast<u8 *>(dst), value, count);
+    return dst;
+}
+
+void *zero_memory(void *dst, u32 size) {
+    return memset(dst, 0, size);
+}
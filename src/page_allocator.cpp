@@ -0,0 +1,713 @@
+#include "kernel.h"
+#include "page_allocator.h"
+#include "smp.h"
+#include "spinlock.h"
+
+// Physical page frames are handed out by a binary buddy allocator. Each Bitmap_Entry tracks one
+// contiguous range of physical memory with
+//   - a bitmap with one bit per page that is set while the page is in use, and
+//   - one Summary_Bitmap per order that has a bit set for every naturally aligned block of 2^order
+//     pages that is free and not part of a larger free block.
+// Allocating splits the smallest free block that is big enough, freeing merges a block with its buddy
+// for as long as the buddy is free too, so both take at most PAGE_ALLOCATOR_MAX_ORDER steps.
+// Page indices count from block_base, which is range_start aligned down to the largest block size so
+// that blocks are physically aligned too, pages between block_base and range_start are marked as in use.
+//
+// buddy_lock covers the bitmaps and the stats, anybody may allocate pages from an irq handler.
+//
+// There is one Bitmap_Entry per usable region in the multiboot memory map. Without PAE we can't address
+// more than 4GiB of physical memory, so the bitmaps for all of them come out of a static pool sized for
+// that, we cant allocate them anywhere else this early anyway.
+
+#define PAGE_ALLOCATOR_MAX_BLOCK_SIZE (PAGE_SIZE << PAGE_ALLOCATOR_MAX_ORDER)
+
+// A bitmap with two levels of summary on top, bit i of levels[n+1] is set while word i of levels[n]
+// is not zero. Even for order 0 blocks of a 4GiB region the top level is only 32 words, so finding
+// a set bit is three __builtin_ctz away from a short scan.
+#define SUMMARY_BITMAP_LEVELS 3
+
+struct Summary_Bitmap {
+    u32 *levels[SUMMARY_BITMAP_LEVELS];
+    u32 word_counts[SUMMARY_BITMAP_LEVELS];
+};
+
+struct Bitmap_Entry {
+    u32 range_start;
+    u32 range_end;
+    u32 *buffer;
+    
+    u32 block_base;
+    u32 num_pages; // counted from block_base
+    Summary_Bitmap free_blocks[PAGE_ALLOCATOR_MAX_ORDER+1];
+    u32 free_block_count[PAGE_ALLOCATOR_MAX_ORDER+1];
+};
+
+#define PAGE_ALLOCATOR_MAX_REGIONS 32
+#define PAGE_ALLOCATOR_MAX_PAGES   0x100000 // 4GiB
+
+// one bit per page plus about two more bits for the free block bitmaps of all orders and a 32nd of that
+// for their summaries, and room for every region to need an extra max size block for alignment plus a
+// word of rounding per bitmap level
+#define PAGE_ALLOCATOR_POOL_BITS_PER_REGION (PAGE_ALLOCATOR_MAX_PAGES / PAGE_ALLOCATOR_MAX_REGIONS + (1 << PAGE_ALLOCATOR_MAX_ORDER))
+#define PAGE_ALLOCATOR_POOL_WORD_COUNT \
+    (PAGE_ALLOCATOR_MAX_REGIONS * ((3 * PAGE_ALLOCATOR_POOL_BITS_PER_REGION) / 32 + (2 * PAGE_ALLOCATOR_POOL_BITS_PER_REGION) / 1024 + \
+                                   1 + (PAGE_ALLOCATOR_MAX_ORDER + 1) * SUMMARY_BITMAP_LEVELS))
+
+u32 bitmap_pool[PAGE_ALLOCATOR_POOL_WORD_COUNT] ALIGN(4096);
+u32 bitmap_pool_used;
+
+Bitmap_Entry bitmap_entry_storage[PAGE_ALLOCATOR_MAX_REGIONS];
+Array<Bitmap_Entry> bitmap_entries;
+
+Page_Allocator_Stats page_allocator_stats;
+Ticket_Lock buddy_lock; // fair, every cpu whose page cache runs dry or overflows ends up here
+
+static inline bool bitmap_test(u32 *bitmap, u32 index) {
+    return (bitmap[index / 32] >> (index % 32)) & 1;
+}
+
+static inline void bitmap_set(u32 *bitmap, u32 index) {
+    bitmap[index / 32] |= (1 << (index % 32));
+}
+
+static inline void bitmap_clear(u32 *bitmap, u32 index) {
+    bitmap[index / 32] &= ~(1 << (index % 32));
+}
+
+// mask of the bits [first, first+count) within one word
+static inline u32 bitmap_word_mask(u32 first, u32 count) {
+    if (count >= 32) return 0xFFFFFFFF;
+    return ((1u << count) - 1) << first;
+}
+
+// sets or clears bits [first, first+count) a word at a time, asserting that none of them were in that state already
+static void bitmap_change_range(u32 *bitmap, u32 first, u32 count, bool set) {
+    while (count) {
+        u32 bit = first % 32;
+        u32 num_bits = 32 - bit;
+        if (num_bits > count) num_bits = count;
+        
+        u32 mask = bitmap_word_mask(bit, num_bits);
+        u32 *word = &bitmap[first / 32];
+        if (set) {
+            kassert((*word & mask) == 0);
+            *word |= mask;
+        } else {
+            kassert((*word & mask) == mask);
+            *word &= ~mask;
+        }
+        
+        first += num_bits;
+        count -= num_bits;
+    }
+}
+
+static bool bitmap_range_is_clear(u32 *bitmap, u32 first, u32 count) {
+    while (count) {
+        u32 bit = first % 32;
+        u32 num_bits = 32 - bit;
+        if (num_bits > count) num_bits = count;
+        
+        if (bitmap[first / 32] & bitmap_word_mask(bit, num_bits)) return false;
+        
+        first += num_bits;
+        count -= num_bits;
+    }
+    
+    return true;
+}
+
+static inline bool summary_test(Summary_Bitmap *bitmap, u32 index) {
+    return bitmap_test(bitmap->levels[0], index);
+}
+
+static void summary_set(Summary_Bitmap *bitmap, u32 index) {
+    for (u32 level = 0; level < SUMMARY_BITMAP_LEVELS; ++level) {
+        u32 *word = &bitmap->levels[level][index / 32];
+        bool was_empty = (*word == 0);
+        *word |= (1 << (index % 32));
+        
+        if (!was_empty) break;
+        index /= 32;
+    }
+}
+
+static void summary_clear(Summary_Bitmap *bitmap, u32 index) {
+    for (u32 level = 0; level < SUMMARY_BITMAP_LEVELS; ++level) {
+        u32 *word = &bitmap->levels[level][index / 32];
+        *word &= ~(1 << (index % 32));
+        
+        if (*word) break;
+        index /= 32;
+    }
+}
+
+// returns the lowest set bit, the caller must make sure there is one
+static u32 summary_find_first(Summary_Bitmap *bitmap) {
+    u32 *top = bitmap->levels[SUMMARY_BITMAP_LEVELS-1];
+    u32 top_count = bitmap->word_counts[SUMMARY_BITMAP_LEVELS-1];
+    
+    // index starts out as a word index into the top level and becomes a bit index into each level below
+    u32 index = 0;
+    while (index < top_count && top[index] == 0) index++;
+    kassert(index < top_count && "free block count and free block bitmap are out of sync");
+    
+    for (s32 level = SUMMARY_BITMAP_LEVELS-1; level >= 0; --level) {
+        index = (index * 32) + __builtin_ctz(bitmap->levels[level][index]);
+    }
+    
+    return index;
+}
+
+static u32 free_block_word_count(u32 num_pages, u32 order) {
+    u32 num_blocks = (num_pages + (1 << order) - 1) >> order;
+    return (num_blocks + 31) / 32;
+}
+
+static Bitmap_Entry *find_bitmap_entry(u32 physical) {
+    for (s64 i = 0; i < bitmap_entries.count; ++i) {
+        Bitmap_Entry *entry = &bitmap_entries.data[i];
+        if (physical >= entry->range_start && physical < entry->range_end) return entry;
+        if (physical < entry->range_start) break; // entries are sorted
+    }
+    
+    return nullptr;
+}
+
+static void buddy_push_block(Bitmap_Entry *entry, u32 block, u32 order) {
+    summary_set(&entry->free_blocks[order], block);
+    entry->free_block_count[order]++;
+    page_allocator_stats.free_pages += (1 << order);
+}
+
+static void buddy_remove_block(Bitmap_Entry *entry, u32 block, u32 order) {
+    summary_clear(&entry->free_blocks[order], block);
+    entry->free_block_count[order]--;
+    page_allocator_stats.free_pages -= (1 << order);
+}
+
+// marks a block as free and merges it with its buddies for as long as we can
+static void buddy_free_block(Bitmap_Entry *entry, u32 block, u32 order) {
+    while (order < PAGE_ALLOCATOR_MAX_ORDER) {
+        u32 buddy = block ^ 1;
+        if (!summary_test(&entry->free_blocks[order], buddy)) break;
+        
+        buddy_remove_block(entry, buddy, order);
+        block >>= 1;
+        order++;
+    }
+    
+    buddy_push_block(entry, block, order);
+}
+
+static u32 buddy_alloc(Bitmap_Entry *entry, u32 order) {
+    u32 found_order = order;
+    while (found_order <= PAGE_ALLOCATOR_MAX_ORDER && entry->free_block_count[found_order] == 0) found_order++;
+    if (found_order > PAGE_ALLOCATOR_MAX_ORDER) return 0;
+    
+    u32 block = summary_find_first(&entry->free_blocks[found_order]);
+    buddy_remove_block(entry, block, found_order);
+    
+    // give the upper halves back until we're down to the size that was asked for
+    while (found_order > order) {
+        found_order--;
+        block <<= 1;
+        buddy_push_block(entry, block + 1, found_order);
+    }
+    
+    u32 first_page = block << order;
+    bitmap_change_range(entry->buffer, first_page, 1 << order, true);
+    return entry->block_base + (first_page * PAGE_SIZE);
+}
+
+// builds the free block bitmaps from the page bitmap, using the largest blocks that fit
+static void buddy_seed(Bitmap_Entry *entry) {
+    u32 page = 0;
+    while (page < entry->num_pages) {
+        u32 word = entry->buffer[page / 32];
+        if (word == 0xFFFFFFFF && (page % 32) == 0) {
+            page += 32;
+            continue;
+        }
+        
+        if (bitmap_test(entry->buffer, page)) {
+            page++;
+            continue;
+        }
+        
+        u32 order = page ? __builtin_ctz(page) : PAGE_ALLOCATOR_MAX_ORDER;
+        if (order > PAGE_ALLOCATOR_MAX_ORDER) order = PAGE_ALLOCATOR_MAX_ORDER;
+        
+        while (order > 0) {
+            u32 count = 1 << order;
+            if (page + count <= entry->num_pages && bitmap_range_is_clear(entry->buffer, page, count)) break;
+            order--;
+        }
+        
+        buddy_push_block(entry, page >> order, order);
+        page += (1 << order);
+    }
+}
+
+// gives back the parts of a free block that lie outside of the pages [first, end)
+static void buddy_split_around(Bitmap_Entry *entry, u32 block, u32 order, u32 first, u32 end) {
+    u32 block_first = block << order;
+    u32 block_end = block_first + (1 << order);
+    
+    if (block_end <= first || block_first >= end) {
+        buddy_push_block(entry, block, order);
+        return;
+    }
+    
+    if (order == 0) return;
+    
+    buddy_split_around(entry, block * 2, order - 1, first, end);
+    buddy_split_around(entry, block * 2 + 1, order - 1, first, end);
+}
+
+// takes the pages [first, end) out of the free blocks they are in and marks them as used,
+// pages that are already in use are skipped
+static void mark_entry_range_as_used(Bitmap_Entry *entry, u32 first, u32 end) {
+    u32 page = first;
+    while (page < end) {
+        u32 word = entry->buffer[page / 32];
+        if (word == 0xFFFFFFFF) {
+            page = (page & ~31u) + 32;
+            continue;
+        }
+        
+        if (bitmap_test(entry->buffer, page)) {
+            page++;
+            continue;
+        }
+        
+        // the run of free pages that we are about to mark as used
+        u32 run_end = page + 1;
+        while (run_end < end && !bitmap_test(entry->buffer, run_end)) {
+            if ((run_end % 32) == 0 && run_end + 32 <= end && entry->buffer[run_end / 32] == 0) run_end += 32;
+            else run_end++;
+        }
+        
+        // a free page belongs to exactly one free block, unless the buddy bitmaps have not been seeded yet
+        u32 scan = page;
+        while (scan < run_end) {
+            u32 order = 0;
+            while (order <= PAGE_ALLOCATOR_MAX_ORDER && !summary_test(&entry->free_blocks[order], scan >> order)) order++;
+            if (order > PAGE_ALLOCATOR_MAX_ORDER) {
+                scan++;
+                continue;
+            }
+            
+            u32 block = scan >> order;
+            buddy_remove_block(entry, block, order);
+            buddy_split_around(entry, block, order, page, run_end);
+            scan = (block + 1) << order;
+        }
+        
+        bitmap_change_range(entry->buffer, page, run_end - page, true);
+        page = run_end;
+    }
+}
+
+void mark_page_range_as_used(u32 physical_start, u32 physical_end) {
+    kassert((physical_start & (PAGE_SIZE-1)) == 0);
+    kassert((physical_end & (PAGE_SIZE-1)) == 0);
+    kassert(physical_start <= physical_end);
+    kassert(physical_start >= 0x00100000);
+    
+    u32 eflags = ticket_lock_irqsave(&buddy_lock);
+    for (s64 i = 0; i < bitmap_entries.count; ++i) {
+        Bitmap_Entry *entry = &bitmap_entries.data[i];
+        
+        // physical_end is inclusive
+        if (physical_end < entry->range_start || physical_start >= entry->range_end) continue;
+        
+        u32 start = (physical_start > entry->range_start) ? physical_start : entry->range_start;
+        u32 end = (physical_end < entry->range_end - PAGE_SIZE) ? physical_end : entry->range_end - PAGE_SIZE;
+        
+        mark_entry_range_as_used(entry, (start - entry->block_base) / PAGE_SIZE, (end - entry->block_base) / PAGE_SIZE + 1);
+    }
+    ticket_unlock_irqrestore(&buddy_lock, eflags);
+}
+
+void mark_page_as_used(u32 physical) {
+    mark_page_range_as_used(physical, physical);
+}
+
+void mark_page_as_free(u32 physical) {
+    free_pages(physical, 0);
+}
+
+static u32 *take_bitmap_words(u32 count) {
+    kassert(bitmap_pool_used + count <= PAGE_ALLOCATOR_POOL_WORD_COUNT);
+    
+    u32 *words = &bitmap_pool[bitmap_pool_used];
+    bitmap_pool_used += count;
+    
+    zero_memory(words, count * sizeof(u32));
+    return words;
+}
+
+void make_bitmap_entry(Bitmap_Entry *entry, u32 range_start, u32 range_end) {
+    kassert(range_start < range_end && "cannot make a bitmap entry of zero size!");
+    
+    entry->range_start = range_start;
+    entry->range_end = range_end;
+    entry->block_base = range_start & ~(PAGE_ALLOCATOR_MAX_BLOCK_SIZE - 1);
+    entry->num_pages = (range_end - entry->block_base) / PAGE_SIZE;
+    
+    entry->buffer = take_bitmap_words((entry->num_pages + 31) / 32);
+    
+    u32 lead_pages = (range_start - entry->block_base) / PAGE_SIZE;
+    bitmap_change_range(entry->buffer, 0, lead_pages, true);
+    
+    for (u32 order = 0; order <= PAGE_ALLOCATOR_MAX_ORDER; ++order) {
+        Summary_Bitmap *bitmap = &entry->free_blocks[order];
+        
+        u32 word_count = free_block_word_count(entry->num_pages, order);
+        for (u32 level = 0; level < SUMMARY_BITMAP_LEVELS; ++level) {
+            bitmap->levels[level] = take_bitmap_words(word_count);
+            bitmap->word_counts[level] = word_count;
+            word_count = (word_count + 31) / 32;
+        }
+        
+        entry->free_block_count[order] = 0;
+    }
+    
+    page_allocator_stats.total_pages += (range_end - range_start) / PAGE_SIZE;
+}
+
+u32 alloc_pages(u32 order) {
+    kassert(order <= PAGE_ALLOCATOR_MAX_ORDER);
+    
+    u32 eflags = ticket_lock_irqsave(&buddy_lock);
+    u32 result = 0;
+    for (s64 i = 0; i < bitmap_entries.count && !result; ++i) {
+        result = buddy_alloc(&bitmap_entries.data[i], order);
+    }
+    ticket_unlock_irqrestore(&buddy_lock, eflags);
+    
+    return result;
+}
+
+void free_pages(u32 physical, u32 order) {
+    kassert(order <= PAGE_ALLOCATOR_MAX_ORDER);
+    kassert((physical & ((PAGE_SIZE << order) - 1)) == 0);
+    
+    u32 eflags = ticket_lock_irqsave(&buddy_lock);
+    Bitmap_Entry *entry = find_bitmap_entry(physical);
+    kassert(entry && "free_pages on memory we dont track");
+    
+    u32 first_page = (physical - entry->block_base) / PAGE_SIZE;
+    bitmap_change_range(entry->buffer, first_page, 1 << order, false);
+    buddy_free_block(entry, first_page >> order, order);
+    ticket_unlock_irqrestore(&buddy_lock, eflags);
+}
+
+// Single pages go through a magazine cache in front of the buddy allocator. A magazine is a stack of
+// up to PAGE_MAGAZINE_SIZE free pages, and a cache holds two of them so that alternating allocs and
+// frees at a magazine boundary dont go back to the buddy allocator every time. When both are empty
+// we refill a whole magazine at once, when both are full we drain a whole one.
+//
+// Every cpu has a cache of its own, so it only needs interrupts disabled and not a lock, the buddy
+// allocator and its lock are only touched when refilling or draining.
+
+#define PAGE_MAGAZINE_SIZE 32
+#define PAGE_MAGAZINE_ORDER 5 // a magazine worth of pages as one buddy block
+
+struct Page_Magazine {
+    u32 count;
+    u32 pages[PAGE_MAGAZINE_SIZE];
+};
+
+struct Page_Cache {
+    Page_Magazine magazines[2];
+    u32 loaded; // index of the magazine we pop from and push to, the other one is the previous one
+    
+    u32 hits;
+    u32 misses;
+    u32 drains;
+};
+
+Page_Cache page_caches[APIC_MAX_CPUS];
+
+// with interrupts disabled, we could end up on another cpu otherwise
+static Page_Cache *this_cpu_page_cache() {
+    return &page_caches[this_cpu()->index];
+}
+
+static void page_magazine_refill(Page_Magazine *magazine) {
+    kassert(magazine->count == 0);
+    
+    // one block keeps the pages contiguous and is a single trip through the buddy allocator, the
+    // pages are pushed in reverse so that they come out in ascending order
+    u32 block = alloc_pages(PAGE_MAGAZINE_ORDER);
+    if (block) {
+        for (s32 i = PAGE_MAGAZINE_SIZE - 1; i >= 0; --i) {
+            magazine->pages[magazine->count++] = block + (i * PAGE_SIZE);
+        }
+        return;
+    }
+    
+    while (magazine->count < PAGE_MAGAZINE_SIZE) {
+        u32 page = alloc_pages(0);
+        if (!page) break;
+        
+        magazine->pages[magazine->count++] = page;
+    }
+}
+
+static void page_magazine_drain(Page_Magazine *magazine) {
+    while (magazine->count) {
+        free_pages(magazine->pages[--magazine->count], 0);
+    }
+}
+
+u32 next_free_page() {
+    u32 eflags = DISABLE_INTERRUPTS();
+    Page_Cache *cache = this_cpu_page_cache();
+    Page_Magazine *loaded = &cache->magazines[cache->loaded];
+    
+    if (loaded->count) {
+        cache->hits++;
+    } else if (cache->magazines[cache->loaded ^ 1].count) {
+        cache->hits++;
+        cache->loaded ^= 1;
+        loaded = &cache->magazines[cache->loaded];
+    } else {
+        cache->misses++;
+        page_magazine_refill(loaded);
+    }
+    
+    u32 page = 0;
+    if (loaded->count) page = loaded->pages[--loaded->count];
+    RESTORE_INTERRUPTS(eflags);
+    
+    return page;
+}
+
+void free_page(u32 physical) {
+    kassert((physical & (PAGE_SIZE-1)) == 0);
+    
+    u32 eflags = DISABLE_INTERRUPTS();
+    Page_Cache *cache = this_cpu_page_cache();
+    Page_Magazine *loaded = &cache->magazines[cache->loaded];
+    
+    if (loaded->count == PAGE_MAGAZINE_SIZE) {
+        Page_Magazine *previous = &cache->magazines[cache->loaded ^ 1];
+        if (previous->count) {
+            cache->drains++;
+            page_magazine_drain(previous);
+        }
+        
+        cache->loaded ^= 1;
+        loaded = previous;
+    }
+    
+    loaded->pages[loaded->count++] = physical;
+    RESTORE_INTERRUPTS(eflags);
+}
+
+// Pages that are zeroed ahead of time, so that alloc_zeroed_page() doesn't have to zero them on the spot.
+// The idle loops top the pool up a few pages at a time, when it runs dry we zero the page right there.
+// There is one pool for all cpus, under its own lock.
+
+#define PAGE_ZERO_POOL_SIZE       64
+#define PAGE_ZERO_POOL_IDLE_BATCH 8
+
+struct Page_Zero_Pool {
+    u32 count;
+    u32 pages[PAGE_ZERO_POOL_SIZE];
+    
+    u32 hits;
+    u32 misses;
+};
+
+Page_Zero_Pool page_zero_pool;
+Spin_Lock page_zero_pool_lock;
+
+u32 alloc_zeroed_page() {
+    u32 page = 0;
+    
+    u32 eflags = spin_lock_irqsave(&page_zero_pool_lock);
+    if (page_zero_pool.count) {
+        page = page_zero_pool.pages[--page_zero_pool.count];
+        page_zero_pool.hits++;
+    } else {
+        page_zero_pool.misses++;
+    }
+    spin_unlock_irqrestore(&page_zero_pool_lock, eflags);
+    
+    if (page) return page;
+    
+    page = next_free_page();
+    if (page) zero_physical_page(page);
+    return page;
+}
+
+bool page_zero_pool_refill() {
+    for (u32 i = 0; i < PAGE_ZERO_POOL_IDLE_BATCH; ++i) {
+        if (page_zero_pool.count >= PAGE_ZERO_POOL_SIZE) return false;
+        
+        u32 page = next_free_page();
+        if (!page) return false;
+        
+        // interrupts stay on while we zero, somebody may take from the pool or fill it up in the meantime
+        zero_physical_page(page);
+        
+        u32 eflags = spin_lock_irqsave(&page_zero_pool_lock);
+        bool added = page_zero_pool.count < PAGE_ZERO_POOL_SIZE;
+        if (added) page_zero_pool.pages[page_zero_pool.count++] = page;
+        spin_unlock_irqrestore(&page_zero_pool_lock, eflags);
+        
+        if (!added) free_page(page);
+    }
+    
+    return true;
+}
+
+struct Memory_Range {
+    u32 start;
+    u32 end;
+};
+
+// adds a usable range to the sorted list, merging it with neighbours it touches
+static void add_memory_range(Memory_Range *ranges, u32 *count, u32 start, u32 end) {
+    u32 i = 0;
+    while (i < *count && ranges[i].start < start) i++;
+    
+    if (i > 0 && ranges[i-1].end >= start) {
+        if (end > ranges[i-1].end) ranges[i-1].end = end;
+        i--;
+    } else {
+        if (*count == PAGE_ALLOCATOR_MAX_REGIONS) {
+            kprint("page allocator: too many memory regions, ignoring %X-%X\n", start, end);
+            return;
+        }
+        
+        for (u32 j = *count; j > i; --j) ranges[j] = ranges[j-1];
+        ranges[i].start = start;
+        ranges[i].end = end;
+        (*count)++;
+    }
+    
+    // the grown range may now reach into the ones after it
+    while (i + 1 < *count && ranges[i+1].start <= ranges[i].end) {
+        if (ranges[i+1].end > ranges[i].end) ranges[i].end = ranges[i+1].end;
+        for (u32 j = i + 1; j + 1 < *count; ++j) ranges[j] = ranges[j+1];
+        (*count)--;
+    }
+}
+
+// clips a multiboot region to whole pages between 1MiB and 4GiB
+static void add_multiboot_region(Memory_Range *ranges, u32 *count, u64 base, u64 length) {
+    u64 start = (base + PAGE_SIZE - 1) & ~((u64) PAGE_SIZE - 1);
+    u64 end = (base + length) & ~((u64) PAGE_SIZE - 1);
+    
+    // we leave low memory to the BIOS and friends
+    if (start < 0x00100000) start = 0x00100000;
+    
+    // the last page is dropped so that range_end fits in a u32
+    if (end > 0xFFFFF000) end = 0xFFFFF000;
+    
+    if (start >= end) return;
+    add_memory_range(ranges, count, (u32) start, (u32) end);
+}
+
+// the caches of the other cpus are read without their owners stopping, their part may be a little off
+Page_Allocator_Stats page_allocator_get_stats() {
+    u32 eflags = ticket_lock_irqsave(&buddy_lock);
+    Page_Allocator_Stats stats = page_allocator_stats;
+    stats.buddy_lock = buddy_lock.stats;
+    ticket_unlock_irqrestore(&buddy_lock, eflags);
+    
+    stats.cached_pages = 0;
+    stats.cache_hits = 0;
+    stats.cache_misses = 0;
+    stats.cache_drains = 0;
+    for (u32 i = 0; i < cpu_count; ++i) {
+        Page_Cache *cache = &page_caches[i];
+        stats.cached_pages += cache->magazines[0].count + cache->magazines[1].count;
+        stats.cache_hits += cache->hits;
+        stats.cache_misses += cache->misses;
+        stats.cache_drains += cache->drains;
+    }
+    
+    eflags = spin_lock_irqsave(&page_zero_pool_lock);
+    stats.zeroed_pages = page_zero_pool.count;
+    stats.zero_pool_hits = page_zero_pool.hits;
+    stats.zero_pool_misses = page_zero_pool.misses;
+    stats.zero_pool_lock = page_zero_pool_lock.stats;
+    spin_unlock_irqrestore(&page_zero_pool_lock, eflags);
+    
+    stats.free_pages += stats.cached_pages + stats.zeroed_pages;
+    stats.used_pages = stats.total_pages - stats.free_pages;
+    return stats;
+}
+
+u32 page_allocator_memory_end() {
+    if (!bitmap_entries.count) return 0;
+    return bitmap_entries.data[bitmap_entries.count - 1].range_end;
+}
+
+void page_allocator_init(Multiboot_Information *info) {
+    Memory_Range ranges[PAGE_ALLOCATOR_MAX_REGIONS];
+    u32 range_count = 0;
+    
+    if (info->flags & MULTIBOOT_INFO_MEM_MAP) {
+        // the map lives in low memory which is still mapped at KERNEL_VIRTUAL_BASE_ADDRESS
+        kassert(info->mmap_addr + info->mmap_length <= 0x00400000);
+        
+        u32 mmap = info->mmap_addr + KERNEL_VIRTUAL_BASE_ADDRESS;
+        u32 mmap_end = mmap + info->mmap_length;
+        while (mmap < mmap_end) {
+            Multiboot_Mmap *region = reinterpret_cast<Multiboot_Mmap *>(static_cast<uintptr_t>(mmap));
+            kprint("mmap: %X%X length %X%X type %u\n", (u32) (region->base_addr >> 32), (u32) region->base_addr,
+                   (u32) (region->length >> 32), (u32) region->length, region->type);
+            
+            if (region->type == Multiboot_Mmap::MEMORY_AVAILABLE) {
+                add_multiboot_region(ranges, &range_count, region->base_addr, region->length);
+            }
+            
+            mmap += region->size + sizeof(region->size);
+        }
+    } else {
+        kassert(info->flags & MULTIBOOT_INFO_MEMORY);
+        kprint("no multiboot memory map, falling back to mem_upper\n");
+        add_multiboot_region(ranges, &range_count, 0x00100000, ((u64) info->mem_upper) * 1024);
+    }
+    
+    kassert(range_count && "no usable memory!");
+    
+    page_allocator_stats = {};
+    for (u32 i = 0; i < APIC_MAX_CPUS; ++i) page_caches[i] = {};
+    bitmap_pool_used = 0;
+    
+    for (u32 i = 0; i < range_count; ++i) {
+        make_bitmap_entry(&bitmap_entry_storage[i], ranges[i].start, ranges[i].end);
+    }
+    
+    bitmap_entries.data = &bitmap_entry_storage[0];
+    bitmap_entries.allocated = PAGE_ALLOCATOR_MAX_REGIONS;
+    bitmap_entries.count = range_count;
+    page_allocator_stats.region_count = range_count;
+    
+    extern u8 __KERNEL_MEMORY_START[];
+    extern u8 __KERNEL_MEMORY_END[];
+    
+    u32 kstart = (u32)(uintptr_t)__KERNEL_MEMORY_START;
+    u32 kend = (u32)(uintptr_t)__KERNEL_MEMORY_END;
+    
+    kprint("kernel physical address: %X\n", kstart - KERNEL_VIRTUAL_BASE_ADDRESS);
+    kprint("kernel end:              %X\n", kend - KERNEL_VIRTUAL_BASE_ADDRESS);
+    
+    // mark kernel area as in use
+    mark_page_range_as_used(kstart - KERNEL_VIRTUAL_BASE_ADDRESS, kend - KERNEL_VIRTUAL_BASE_ADDRESS);
+    
+    for (s64 i = 0; i < bitmap_entries.count; ++i) {
+        buddy_seed(&bitmap_entries.data[i]);
+    }
+    
+    Page_Allocator_Stats stats = page_allocator_get_stats();
+    kprint("Total ram size: %u MB in %u regions, %u pages free\n", (stats.total_pages / 256), stats.region_count, stats.free_pages);
+}
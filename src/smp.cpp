@@ -0,0 +1,158 @@
+#include "kernel.h"
+#include "cpu.h"
+#include "apic.h"
+#include "heap.h"
+#include "interrupts.h"
+#include "smp.h"
+#include "thread.h"
+#include "timer.h"
+
+// The other cpus (APs) are started one at a time with the INIT, STARTUP, STARTUP sequence from the
+// MultiProcessor Specification. Each one starts in real mode in the trampoline from boot.s, copied to
+// AP_TRAMPOLINE_ADDRESS, which is identity mapped while we start them so that turning on paging doesn't
+// pull the ground out from under it. It lands in ap_entry() on the stack of its idle thread.
+//
+// The bootstrap cpu keeps all the irqs and the timer, the others run threads and only get IPIs.
+
+#define AP_INIT_DELAY_MS       10
+#define AP_STARTUP_DELAY_US    200
+#define AP_ONLINE_TIMEOUT_MS   100
+
+// @Volatile matches ap_trampoline_params in boot.s
+struct Ap_Trampoline_Params {
+    u32 cr3;
+    u32 cr4;
+    u32 stack;
+    u32 entry;
+};
+
+extern "C" {
+    extern u8 ap_trampoline_start[];
+    extern u8 ap_trampoline_params[];
+    extern u8 ap_trampoline_end[];
+}
+
+Cpu cpus[APIC_MAX_CPUS];
+u32 cpu_count;
+
+// the one ap_entry() is for, only one cpu is started at a time
+Cpu *volatile starting_cpu;
+
+static void load_cpu_segment(Cpu *cpu) {
+    u16 selector = GDT_CPU_DATA_SELECTOR(cpu->index);
+    asm volatile("mov %0, %%gs" : : "r"(selector) : "memory");
+}
+
+void smp_init_bsp() {
+    Cpu *cpu = &cpus[0];
+    cpu->self = cpu;
+    cpu->index = 0;
+    cpu->online = true;
+    cpu_count = 1;
+    
+    load_cpu_segment(cpu);
+}
+
+extern "C" void ap_entry() {
+    Cpu *cpu = starting_cpu;
+    
+    // still on the GDT of the trampoline, which goes away together with its mapping
+    gdt_load();
+    load_cpu_segment(cpu);
+    load_interrupt_descriptor_table();
+    
+    cpu_init_ap();
+    lapic_init_ap();
+    cpu->apic_id = lapic_id();
+    
+    threads_init_ap();
+    
+    // from here on tlb_shootdown() sends us its IPIs, which our local APIC holds until we turn interrupts
+    // on. Whatever we cached before that may be stale, the flush drops it. The store has to be visible
+    // before the flush, which serializes.
+    __atomic_store_n(&cpu->online, true, __ATOMIC_SEQ_CST);
+    tlb_flush_all();
+    threads_run_idle();
+}
+
+static bool wait_for_online(Cpu *cpu, u32 timeout_us) {
+    u64 deadline = clock_monotonic_ns() + static_cast<u64>(timeout_us) * 1000;
+    while (clock_monotonic_ns() < deadline) {
+        if (__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) return true;
+        asm volatile("pause");
+    }
+    
+    return __atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE);
+}
+
+static bool start_ap(Cpu *cpu, u32 apic_id, Ap_Trampoline_Params *params) {
+    params->stack = threads_prepare_cpu(cpu);
+    starting_cpu = cpu;
+    
+    // the second STARTUP is only for cpus that missed the first one
+    lapic_send_init(apic_id);
+    mdelay(AP_INIT_DELAY_MS);
+    lapic_send_startup(apic_id, AP_TRAMPOLINE_ADDRESS);
+    if (wait_for_online(cpu, AP_STARTUP_DELAY_US)) return true;
+    
+    lapic_send_startup(apic_id, AP_TRAMPOLINE_ADDRESS);
+    return wait_for_online(cpu, AP_ONLINE_TIMEOUT_MS * 1000);
+}
+
+void smp_start_aps() {
+    if (apic_cpu_count() < 2) return;
+    
+    // the delays between the IPIs are taken with the TSC, without one there is no telling how long we waited
+    if (!irq_use_apic || !cpu_features.tsc) {
+        kprint("smp: %u cpus, but no APIC or TSC, staying on one\n", apic_cpu_count());
+        return;
+    }
+    
+    u8 *trampoline = reinterpret_cast<u8 *>(physical_to_virtual(AP_TRAMPOLINE_ADDRESS));
+    u32 trampoline_size = static_cast<u32>(ap_trampoline_end - ap_trampoline_start);
+    kassert(trampoline && trampoline_size <= PAGE_SIZE);
+    
+    memcpy(trampoline, ap_trampoline_start, trampoline_size);
+    map_range(AP_TRAMPOLINE_ADDRESS, AP_TRAMPOLINE_ADDRESS, 1, PAGE_READ_WRITE);
+    
+    Ap_Trampoline_Params *params = reinterpret_cast<Ap_Trampoline_Params *>(trampoline + (ap_trampoline_params - ap_trampoline_start));
+    u32 cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    params->cr3 = cr3;
+    params->cr4 = _read_cr4();
+    params->entry = reinterpret_cast<u32>(&ap_entry);
+    
+    u32 bsp_id = lapic_id();
+    cpus[0].apic_id = bsp_id;
+    
+    for (u32 i = 0; i < apic_cpu_count() && cpu_count < APIC_MAX_CPUS; ++i) {
+        u32 apic_id = apic_cpu_id(i);
+        if (apic_id == bsp_id) continue;
+        
+        Cpu *cpu = &cpus[cpu_count];
+        cpu->self = cpu;
+        cpu->index = cpu_count;
+        
+        u64 start_ns = clock_monotonic_ns();
+        if (!start_ap(cpu, apic_id, params)) {
+            // back to waiting for a STARTUP, so that it can't turn up later on the next one's Cpu. If it made it
+            // online just too late, tlb_shootdown() mustn't wait for it
+            lapic_send_init(apic_id);
+            __atomic_store_n(&cpu->online, false, __ATOMIC_SEQ_CST);
+            kprint("smp: cpu with APIC id %u did not come online\n", apic_id);
+            
+            heap_free(cpu->idle->stack);
+            heap_free(cpu->idle);
+            cpu->idle = nullptr;
+            continue;
+        }
+        
+        // from here on the schedulers of the others may look at it
+        __atomic_store_n(&cpu_count, cpu_count + 1, __ATOMIC_RELEASE);
+        u32 elapsed_us = static_cast<u32>(div_u64(clock_monotonic_ns() - start_ns, 1000));
+        kprint("smp: cpu %u online, APIC id %u, took %u us\n", cpu->index, cpu->apic_id, elapsed_us);
+    }
+    
+    unmap_range(AP_TRAMPOLINE_ADDRESS, 1);
+    kprint("smp: %u of %u cpus online\n", cpu_count, apic_cpu_count());
+}
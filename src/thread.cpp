@@ -0,0 +1,502 @@
+#include "kernel.h"
+#include "cpu.h"
+#include "apic.h"
+#include "heap.h"
+#include "page_allocator.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "thread.h"
+
+// Every switch goes through schedule() with interrupts disabled. A thread that is switched away from
+// sits in _switch_stack() until it is picked again; if that happened on the way out of an irq, the
+// rest of the irq stub and its iret run once it is back. A new stack is made to look like it went
+// through _switch_stack() too, returning into thread_start().
+//
+// Every cpu has a run queue of its own in its Cpu and schedule() only looks at that one. A thread that
+// wakes up goes back to the cpu it last ran on, where its cache may still be warm, and a cpu that has
+// run out of threads takes one from whichever cpu has the most waiting. Only one run queue lock is ever
+// held at a time, so two cpus stealing from each other can't deadlock.
+//
+// A thread that was put back in a run queue may be picked by another cpu while we are still on its stack.
+// on_cpu stays set until the switch away from it is done, and whoever wants to switch to it waits for that.
+//
+// The FPU and SSE state is saved on every switch rather than lazily, memcpy may be preempted with
+// live xmm registers and nuklear keeps floats in the x87 registers.
+
+struct {
+    Spin_Lock dead_lock;
+    Thread *dead; // freed by the idle threads, a thread can't free the stack it is running on
+    
+    Thread boot_thread;
+    u32 next_id;
+} scheduler;
+
+ALIGN(16) u8 boot_thread_fpu_state[THREAD_FPU_STATE_SIZE];
+
+static void fpu_save(u8 *state) {
+    if (cpu_features.sse2) {
+        asm volatile("fxsave (%0)" : : "r"(state) : "memory");
+    } else {
+        // unlike fxsave this also resets the FPU
+        asm volatile("fnsave (%0)" : : "r"(state) : "memory");
+    }
+}
+
+static void fpu_restore(u8 *state) {
+    if (cpu_features.sse2) {
+        asm volatile("fxrstor (%0)" : : "r"(state) : "memory");
+    } else {
+        asm volatile("frstor (%0)" : : "r"(state) : "memory");
+    }
+}
+
+// the run queue functions want the run queue lock of cpu held
+static void run_queue_push(Cpu *cpu, Thread *thread) {
+    thread->next = nullptr;
+    thread->cpu = cpu;
+    if (cpu->run_queue_tail) {
+        cpu->run_queue_tail->next = thread;
+    } else {
+        cpu->run_queue_head = thread;
+    }
+    
+    cpu->run_queue_tail = thread;
+    cpu->run_queue_length++;
+}
+
+static Thread *run_queue_pop(Cpu *cpu) {
+    Thread *thread = cpu->run_queue_head;
+    if (!thread) return nullptr;
+    
+    cpu->run_queue_head = thread->next;
+    if (!cpu->run_queue_head) cpu->run_queue_tail = nullptr;
+    cpu->run_queue_length--;
+    thread->next = nullptr;
+    return thread;
+}
+
+// the first thread whose cpu is done switching away from it, there is no point in waiting for the others
+static Thread *run_queue_take_stealable(Cpu *cpu) {
+    Thread *prev = nullptr;
+    for (Thread *it = cpu->run_queue_head; it; prev = it, it = it->next) {
+        if (it->on_cpu) continue;
+        
+        if (prev) prev->next = it->next;
+        else cpu->run_queue_head = it->next;
+        if (cpu->run_queue_tail == it) cpu->run_queue_tail = prev;
+        
+        cpu->run_queue_length--;
+        it->next = nullptr;
+        return it;
+    }
+    
+    return nullptr;
+}
+
+// with interrupts disabled. cpu runs schedule() on its way out of the next irq, or right away if that is us
+static void resched_cpu(Cpu *cpu) {
+    cpu->need_resched = true;
+    if (cpu != this_cpu()) lapic_send_ipi(cpu->apic_id, IPI_RESCHEDULE_VECTOR);
+}
+
+static void slice_timer_callback(void *data) {
+    resched_cpu(reinterpret_cast<Cpu *>(data));
+}
+
+static void start_slice(Cpu *cpu) {
+    timer_start(&cpu->slice_timer, clock_monotonic_ns() + THREAD_TIME_SLICE_NS, slice_timer_callback, cpu);
+}
+
+// after a thread was put in the run queue of cpu, with interrupts disabled. The idle thread gives way at
+// once, anybody else gets to finish their slice, and a cpu that has nothing to do is told to come and steal.
+static void run_queue_added(Cpu *cpu) {
+    if (cpu->current == cpu->idle) {
+        resched_cpu(cpu);
+        return;
+    }
+    
+    if (!timer_pending(&cpu->slice_timer)) start_slice(cpu);
+    
+    for (u32 i = 0; i < cpu_count; ++i) {
+        Cpu *other = &cpus[i];
+        if (other != cpu && other->current == other->idle && !other->need_resched) {
+            resched_cpu(other);
+            break;
+        }
+    }
+}
+
+// with interrupts disabled and no run queue lock held
+static Thread *steal_thread(Cpu *cpu) {
+    Cpu *victim = nullptr;
+    u32 longest = 0;
+    for (u32 i = 0; i < cpu_count; ++i) {
+        Cpu *other = &cpus[i];
+        u32 length = __atomic_load_n(&other->run_queue_length, __ATOMIC_RELAXED);
+        if (other != cpu && length > longest) {
+            victim = other;
+            longest = length;
+        }
+    }
+    
+    if (!victim) return nullptr;
+    
+    spin_lock(&victim->run_queue_lock);
+    Thread *thread = run_queue_take_stealable(victim);
+    spin_unlock(&victim->run_queue_lock);
+    
+    if (thread) {
+        thread->cpu = cpu;
+        cpu->steals++;
+    }
+    
+    return thread;
+}
+
+// right after a switch, on whichever cpu we came back on
+static void finish_switch() {
+    Cpu *cpu = this_cpu();
+    Thread *prev = cpu->switched_from;
+    cpu->switched_from = nullptr;
+    
+    if (prev) __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+}
+
+// with interrupts disabled. The current thread goes to the back of the run queue if it is still running.
+static void schedule() {
+    Cpu *cpu = this_cpu();
+    Thread *prev = cpu->current;
+    
+    spin_lock(&cpu->run_queue_lock);
+    Thread *next = run_queue_pop(cpu);
+    if (prev->state == THREAD_RUNNING) {
+        if (!next) {
+            spin_unlock(&cpu->run_queue_lock);
+            return;
+        }
+        
+        prev->state = THREAD_READY;
+        if (prev != cpu->idle) run_queue_push(cpu, prev);
+    }
+    
+    // under the lock, so that a thread queued from another cpu right after this either sees the slice
+    // armed or arms it itself
+    if (cpu->run_queue_head) {
+        start_slice(cpu);
+    } else {
+        timer_cancel(&cpu->slice_timer);
+    }
+    spin_unlock(&cpu->run_queue_lock);
+    
+    // prev blocked or exited and we have nothing else
+    if (!next) next = steal_thread(cpu);
+    if (!next) next = cpu->idle;
+    
+    if (next == prev) {
+        next->state = THREAD_RUNNING;
+        return;
+    }
+    
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE)) asm volatile("pause");
+    
+    next->state = THREAD_RUNNING;
+    next->cpu = cpu;
+    next->on_cpu = true;
+    next->switches++;
+    
+    u64 now = clock_monotonic_ns();
+    if (prev == cpu->idle) cpu->idle_ns += now - cpu->last_switch_ns;
+    cpu->last_switch_ns = now;
+    cpu->switches++;
+    
+    cpu->current = next;
+    cpu->switched_from = prev;
+    cpu->need_resched = false;
+    
+    fpu_save(prev->fpu_state);
+    fpu_restore(next->fpu_state);
+    _switch_stack(&prev->esp, next->esp);
+    finish_switch();
+}
+
+Thread *thread_current() {
+    // we could be moved to another cpu between reading GS and reading current
+    u32 eflags = DISABLE_INTERRUPTS();
+    Thread *thread = this_cpu()->current;
+    RESTORE_INTERRUPTS(eflags);
+    return thread;
+}
+
+void thread_yield() {
+    u32 eflags = DISABLE_INTERRUPTS();
+    schedule();
+    RESTORE_INTERRUPTS(eflags);
+}
+
+void thread_prepare_block() {
+    Cpu *cpu = this_cpu();
+    kassert(cpu->current != cpu->idle);
+    
+    // a full barrier, whatever we look at next can't be read before a waker can see that we are blocked
+    __atomic_store_n(&cpu->current->state, THREAD_BLOCKED, __ATOMIC_SEQ_CST);
+}
+
+void thread_block() {
+    schedule();
+}
+
+void thread_wake(Thread *thread) {
+    if (!thread) return;
+    
+    // a blocked thread is in no run queue and nobody else moves it, so cpu is the one it blocked on. If it
+    // isn't blocked cpu may be stale, but then there is nothing to do anyway.
+    u32 eflags = DISABLE_INTERRUPTS();
+    Cpu *cpu = thread->cpu;
+    
+    spin_lock(&cpu->run_queue_lock);
+    bool woken = (thread->state == THREAD_BLOCKED);
+    if (woken) {
+        thread->state = THREAD_READY;
+        run_queue_push(cpu, thread);
+    }
+    spin_unlock(&cpu->run_queue_lock);
+    
+    if (woken) run_queue_added(cpu);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+static void sleep_timer_callback(void *data) {
+    thread_wake(reinterpret_cast<Thread *>(data));
+}
+
+void thread_block_until(u64 deadline_ns) {
+    Thread *thread = this_cpu()->current;
+    timer_start(&thread->sleep_timer, deadline_ns, sleep_timer_callback, thread);
+    schedule();
+    
+    // in case somebody else woke us first. A callback that already started may still wake us once we block again.
+    timer_cancel(&thread->sleep_timer);
+}
+
+void thread_sleep_until(u64 deadline_ns) {
+    u32 eflags = DISABLE_INTERRUPTS();
+    thread_prepare_block();
+    thread_block_until(deadline_ns);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+void thread_preempt() {
+    Cpu *cpu = this_cpu();
+    if (!cpu->current || !cpu->need_resched) return;
+    
+    // we interrupted a spin lock holder, need_resched stays set until the next interrupt finds it done. Its
+    // count would go along to another cpu otherwise, and everybody else would spin until it ran again.
+    if (cpu->spin_locks_held) return;
+    
+    cpu->need_resched = false;
+    schedule();
+}
+
+void thread_exit() {
+    DISABLE_INTERRUPTS();
+    
+    Thread *thread = this_cpu()->current;
+    kassert(thread->stack && "the boot thread can't exit");
+    
+    spin_lock(&scheduler.dead_lock);
+    thread->state = THREAD_DEAD;
+    thread->next = scheduler.dead;
+    scheduler.dead = thread;
+    spin_unlock(&scheduler.dead_lock);
+    schedule();
+    
+    kassert(!"a dead thread was scheduled");
+}
+
+static void thread_start() {
+    // we came here through schedule(), which always runs with interrupts disabled
+    finish_switch();
+    asm volatile("sti");
+    
+    Thread *thread = thread_current();
+    thread->entry(thread->arg);
+    thread_exit();
+}
+
+static void reap_dead_threads() {
+    u32 eflags = spin_lock_irqsave(&scheduler.dead_lock);
+    Thread *dead = scheduler.dead;
+    scheduler.dead = nullptr;
+    spin_unlock_irqrestore(&scheduler.dead_lock, eflags);
+    
+    // a thread that just exited on another cpu may not be off its stack yet, those go back for next time
+    Thread *keep = nullptr;
+    Thread *keep_tail = nullptr;
+    while (dead) {
+        Thread *next = dead->next;
+        if (__atomic_load_n(&dead->on_cpu, __ATOMIC_ACQUIRE)) {
+            dead->next = keep;
+            keep = dead;
+            if (!keep_tail) keep_tail = dead;
+        } else {
+            heap_free(dead->stack);
+            heap_free(dead);
+        }
+        dead = next;
+    }
+    
+    if (keep) {
+        eflags = spin_lock_irqsave(&scheduler.dead_lock);
+        keep_tail->next = scheduler.dead;
+        scheduler.dead = keep;
+        spin_unlock_irqrestore(&scheduler.dead_lock, eflags);
+    }
+}
+
+static Thread *thread_alloc(String name, thread_entry_type entry, void *arg) {
+    Thread *thread = reinterpret_cast<Thread *>(heap_alloc(sizeof(Thread)));
+    zero_memory(thread, sizeof(Thread));
+    
+    // heap pages are backed on the first touch, but a page fault on the stack it is running on would
+    // be a double fault. Zeroing it now backs the whole stack.
+    u8 *stack = reinterpret_cast<u8 *>(heap_alloc(THREAD_STACK_SIZE));
+    zero_memory(stack, THREAD_STACK_SIZE);
+    
+    thread->stack = stack;
+    thread->fpu_state = stack + THREAD_STACK_SIZE - THREAD_FPU_STATE_SIZE;
+    thread->name = name;
+    thread->entry = entry;
+    thread->arg = arg;
+    thread->state = THREAD_READY;
+    thread->id = __atomic_fetch_add(&scheduler.next_id, 1, __ATOMIC_RELAXED);
+    
+    // the new thread starts out with a copy of our FPU state, fnsave has to be undone
+    u32 eflags = DISABLE_INTERRUPTS();
+    fpu_save(thread->fpu_state);
+    fpu_restore(thread->fpu_state);
+    RESTORE_INTERRUPTS(eflags);
+    
+    // what _switch_stack() pops: edi, esi, ebx and ebp, then thread_start() as the return address. Above
+    // that a return address for thread_start() itself, which never returns, placed so that the stack is
+    // 16 byte aligned when thread_start() is entered.
+    u32 *top = reinterpret_cast<u32 *>(thread->fpu_state);
+    *--top = 0;
+    *--top = reinterpret_cast<u32>(&thread_start);
+    for (u32 i = 0; i < 4; ++i) *--top = 0;
+    thread->esp = reinterpret_cast<u32>(top);
+    
+    return thread;
+}
+
+Thread *thread_create(String name, thread_entry_type entry, void *arg) {
+    Thread *thread = thread_alloc(name, entry, arg);
+    
+    u32 eflags = DISABLE_INTERRUPTS();
+    Cpu *cpu = this_cpu();
+    spin_lock(&cpu->run_queue_lock);
+    run_queue_push(cpu, thread);
+    spin_unlock(&cpu->run_queue_lock);
+    run_queue_added(cpu);
+    RESTORE_INTERRUPTS(eflags);
+    
+    return thread;
+}
+
+// reaps dead threads, steals work and zeroes pages for the zero page pool while there is nothing else
+// to do, halts once there is nothing left to steal and the pool is full
+static void idle_thread(void *arg) {
+    UNUSED(arg);
+    
+    while (true) {
+        reap_dead_threads();
+        bool zero_pool_full = !page_zero_pool_refill();
+        
+        u32 eflags = DISABLE_INTERRUPTS();
+        Cpu *cpu = this_cpu();
+        if (!cpu->run_queue_head) {
+            Thread *stolen = steal_thread(cpu);
+            if (stolen) {
+                spin_lock(&cpu->run_queue_lock);
+                run_queue_push(cpu, stolen);
+                spin_unlock(&cpu->run_queue_lock);
+            } else if (zero_pool_full && !cpu->need_resched) {
+                // sti only takes effect after the next instruction, a wakeup can't slip in between the check and the hlt
+                asm volatile("sti; hlt");
+            }
+        }
+        RESTORE_INTERRUPTS(eflags);
+        
+        thread_yield();
+    }
+}
+
+void threads_init() {
+    Cpu *cpu = this_cpu();
+    
+    Thread *boot = &scheduler.boot_thread;
+    boot->name = "kernel";
+    boot->fpu_state = boot_thread_fpu_state;
+    boot->state = THREAD_RUNNING;
+    boot->switches = 1;
+    boot->cpu = cpu;
+    boot->on_cpu = true;
+    
+    scheduler.next_id = 1;
+    scheduler.dead = nullptr;
+    
+    cpu->idle = thread_alloc("idle", idle_thread, nullptr);
+    cpu->idle->cpu = cpu;
+    
+    u32 eflags = DISABLE_INTERRUPTS();
+    cpu->online_ns = clock_monotonic_ns();
+    cpu->last_switch_ns = cpu->online_ns;
+    cpu->current = boot;
+    RESTORE_INTERRUPTS(eflags);
+}
+
+u32 threads_prepare_cpu(Cpu *cpu) {
+    Thread *idle = thread_alloc("idle", idle_thread, nullptr);
+    idle->state = THREAD_RUNNING;
+    idle->switches = 1;
+    idle->cpu = cpu;
+    idle->on_cpu = true;
+    cpu->idle = idle;
+    
+    // the frame thread_alloc() made is never used, the cpu just starts at the top. Room for a return
+    // address keeps the stack aligned the way a call would have.
+    return reinterpret_cast<u32>(idle->fpu_state) - 4;
+}
+
+void threads_init_ap() {
+    Cpu *cpu = this_cpu();
+    cpu->online_ns = clock_monotonic_ns();
+    cpu->last_switch_ns = cpu->online_ns;
+    cpu->current = cpu->idle;
+}
+
+void threads_run_idle() {
+    asm volatile("sti");
+    idle_thread(nullptr);
+}
+
+Cpu_Sched_Stats thread_get_cpu_stats(u32 cpu_index) {
+    kassert(cpu_index < cpu_count);
+    Cpu *cpu = &cpus[cpu_index];
+    Cpu_Sched_Stats stats;
+    
+    u32 eflags = spin_lock_irqsave(&cpu->run_queue_lock);
+    u64 now = clock_monotonic_ns();
+    stats.apic_id = cpu->apic_id;
+    stats.current = cpu->current->name;
+    stats.online_ns = now - cpu->online_ns;
+    stats.idle_ns = cpu->idle_ns;
+    if (cpu->current == cpu->idle) stats.idle_ns += now - cpu->last_switch_ns;
+    stats.switches = cpu->switches;
+    stats.steals = cpu->steals;
+    stats.queue_length = cpu->run_queue_length;
+    stats.run_queue_lock = cpu->run_queue_lock.stats;
+    spin_unlock_irqrestore(&cpu->run_queue_lock, eflags);
+    
+    return stats;
+}
@@ -0,0 +1,411 @@
+#include "kernel.h"
+#include "cpu.h"
+#include "apic.h"
+#include "interrupts.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+
+// The clock is the TSC when there is one, calibrated against the PIT together with the local APIC timer.
+// Without a TSC it counts the ticks of whichever timer drives the interrupts. The local APIC timer counts
+// down from what it was armed with, so the ticks of the current count are added to that clock whenever it
+// is re-armed.
+//
+// The pending timers are a pairing heap made of the Timers the callers own, nothing is allocated in the
+// interrupt and there is no limit on how many there are. Starting one is O(1), taking out the earliest or
+// cancelling one is O(log n) amortized.
+//
+// Only the local APIC timer of the bootstrap cpu is used, every callback runs there. A timer started on
+// another cpu that becomes the earliest one gets the bootstrap cpu to re-arm with a LAPIC_TIMER_VECTOR IPI.
+// Callbacks are called without the lock held, so they can start timers of their own.
+
+#define PIT_CHN0_DATA 0x40
+#define PIT_CHN1_DATA 0x41
+#define PIT_CHN2_DATA 0x42
+#define PIT_CMD       0x43
+
+#define PIT_CMD_SEL_CHN0 (0 << 6)
+#define PIT_CMD_SEL_CHN1 (1 << 6)
+#define PIT_CMD_SEL_CHN2 (2 << 6)
+#define PIT_CMD_READBACK (3 << 6)
+
+#define PIT_CMD_ACCESS_LATCH (0 << 4)
+#define PIT_CMD_ACCESS_LO    (1 << 4)
+#define PIT_CMD_ACCESS_HI    (2 << 4)
+#define PIT_CMD_ACCESS_LOHI  (3 << 4)
+
+#define PIT_CMD_OP_INT      (0 << 1)
+#define PIT_CMD_OP_ONE_SHOT (1 << 1)
+#define PIT_CMD_OP_RATE_GEN (2 << 1)
+#define PIT_CMD_OP_SQR_WAVE (3 << 1)
+#define PIT_CMD_OP_SW_STROBE (4 << 1)
+#define PIT_CMD_OP_HW_STROBE (5 << 1)
+
+#define PIT_CHANNEL0 0
+#define PIT_CHANNEL1 1
+#define PIT_CHANNEL2 2
+
+// same as Mode 2
+// #define PIT_CMD_OP_RATE_GEN2 (6 << 1)
+// same as Mode 3
+// #define PIT_CMD_OP_SQR_WAVE2 (7 << 1)
+
+#define PIT_CMD_BINARY16 (0 << 0)
+#define PIT_CMD_BCD      (1 << 0)
+
+#define PIT_MIN_FREQ    8 // Hz
+#define PIT_MAX_FREQ    1193181
+
+u16 pit_read_count(u8 channel) {
+    kassert(channel <= PIT_CHANNEL2);
+    
+    u32 eflags = DISABLE_INTERRUPTS();
+    
+    io_write_u8(PIT_CMD, channel << 6);
+    u8 lo = io_read_u8(PIT_CHN0_DATA + channel);
+    u8 hi = io_read_u8(PIT_CHN0_DATA + channel);
+    
+    u16 count = lo | (hi << 8);
+    
+    RESTORE_INTERRUPTS(eflags);
+    
+    return count;
+}
+
+void pit_set_reload_value(u8 channel, u16 value) {
+    u32 eflags = DISABLE_INTERRUPTS();
+    
+    io_write_u8(PIT_CHN0_DATA + channel, value & 0xFF);
+    io_write_u8(PIT_CHN0_DATA + channel, (value >> 8) & 0xFF);
+    
+    RESTORE_INTERRUPTS(eflags);
+}
+
+// port B of the 8255 holds the gate and the output of channel 2, and the speaker that hangs off it
+#define PIT_PORT_B           0x61
+#define PIT_PORT_B_CHN2_GATE (1 << 0)
+#define PIT_PORT_B_SPEAKER   (1 << 1)
+#define PIT_PORT_B_CHN2_OUT  (1 << 5)
+
+// as long as channel 2 can count in one go
+#define TIMER_CALIBRATION_MS 50
+#define TIMER_MAX_ARM_NS      0xFFFFFFFF // keeps the conversion to local APIC ticks inside 64 bits, about 4 seconds
+#define LAPIC_TIMER_MAX_COUNT 0xFFFFFFFF
+
+struct {
+    Spin_Lock lock; // everything below
+    
+    bool use_lapic;
+    u32 ticks_per_second;
+    u64 ticks; // up to the start of the current local APIC count
+    u32 armed; // what the local APIC timer was last armed with
+    u32 pit_reload_value;
+    
+    // ns = (tsc - tsc_base) * tsc_mult >> tsc_shift
+    bool use_tsc;
+    u64 tsc_base;
+    u32 tsc_mult;
+    u32 tsc_shift;
+    
+    Timer *heap_root; // the earliest pending timer
+} timer;
+
+static u64 ticks_to_ns(u64 ticks) {
+    u64 seconds = div_u64(ticks, timer.ticks_per_second);
+    u32 rest = static_cast<u32>(ticks - seconds * timer.ticks_per_second);
+    return seconds * 1000000000 + div_u64(static_cast<u64>(rest) * 1000000000, timer.ticks_per_second);
+}
+
+// with interrupts disabled
+static u64 clock_ticks() {
+    if (!timer.use_lapic) return timer.ticks;
+    return timer.ticks + (timer.armed - lapic_read(LAPIC_TIMER_CURRENT_COUNT));
+}
+
+// the multiplication is split in two halves so neither can overflow
+static u64 tsc_to_ns(u64 delta) {
+    u64 high = (delta >> 32) * timer.tsc_mult;
+    u64 low = (delta & 0xFFFFFFFF) * timer.tsc_mult;
+    return (high << (32 - timer.tsc_shift)) + (low >> timer.tsc_shift);
+}
+
+u64 clock_monotonic_ns() {
+    if (timer.use_tsc) return tsc_to_ns(_read_tsc() - timer.tsc_base);
+    if (!timer.ticks_per_second) return 0;
+    
+    u32 eflags = spin_lock_irqsave(&timer.lock);
+    u64 now = ticks_to_ns(clock_ticks());
+    spin_unlock_irqrestore(&timer.lock, eflags);
+    
+    return now;
+}
+
+void udelay(u32 us) {
+    // the fallback clocks only move in the timer interrupt, which may well be off. An I/O port write
+    // takes about a microsecond.
+    if (!timer.use_tsc) {
+        for (u32 i = 0; i < us; ++i) io_wait();
+        return;
+    }
+    
+    u64 end = clock_monotonic_ns() + static_cast<u64>(us) * 1000;
+    while (clock_monotonic_ns() < end) asm volatile("pause");
+}
+
+void mdelay(u32 ms) {
+    for (u32 i = 0; i < ms; ++i) udelay(1000);
+}
+
+// a and b are roots of heaps of their own, with no siblings. The later one becomes the first child of the other.
+static Timer *heap_meld(Timer *a, Timer *b) {
+    if (!a) return b;
+    if (!b) return a;
+    
+    if (b->deadline_ns < a->deadline_ns) {
+        Timer *swap = a;
+        a = b;
+        b = swap;
+    }
+    
+    b->heap_prev = a;
+    b->heap_sibling = a->heap_child;
+    if (a->heap_child) a->heap_child->heap_prev = b;
+    a->heap_child = b;
+    return a;
+}
+
+// melds a list of siblings into one heap: pairs them up left to right, then melds the pairs right to left.
+// No recursion, this runs in the timer interrupt.
+static Timer *heap_merge_pairs(Timer *first) {
+    Timer *pairs = nullptr; // the melded pairs in reverse, linked through heap_sibling
+    while (first) {
+        Timer *a = first;
+        Timer *b = a->heap_sibling;
+        first = b ? b->heap_sibling : nullptr;
+        
+        a->heap_prev = nullptr;
+        a->heap_sibling = nullptr;
+        if (b) {
+            b->heap_prev = nullptr;
+            b->heap_sibling = nullptr;
+        }
+        
+        Timer *pair = heap_meld(a, b);
+        pair->heap_sibling = pairs;
+        pairs = pair;
+    }
+    
+    Timer *root = nullptr;
+    while (pairs) {
+        Timer *next = pairs->heap_sibling;
+        pairs->heap_sibling = nullptr;
+        root = heap_meld(root, pairs);
+        pairs = next;
+    }
+    
+    return root;
+}
+
+static void heap_insert(Timer *t) {
+    t->pending = true;
+    t->heap_child = nullptr;
+    t->heap_sibling = nullptr;
+    t->heap_prev = nullptr;
+    timer.heap_root = heap_meld(timer.heap_root, t);
+}
+
+static void heap_remove(Timer *t) {
+    Timer *children = heap_merge_pairs(t->heap_child);
+    
+    if (t == timer.heap_root) {
+        timer.heap_root = children;
+    } else {
+        // cut it out of the list of its parent, its children go back in as a heap of their own
+        if (t->heap_prev->heap_child == t) t->heap_prev->heap_child = t->heap_sibling;
+        else t->heap_prev->heap_sibling = t->heap_sibling;
+        if (t->heap_sibling) t->heap_sibling->heap_prev = t->heap_prev;
+        
+        timer.heap_root = heap_meld(timer.heap_root, children);
+    }
+    
+    t->pending = false;
+    t->heap_child = nullptr;
+    t->heap_sibling = nullptr;
+    t->heap_prev = nullptr;
+}
+
+// on the bootstrap cpu, with the lock held. With nothing pending the timer still runs, it may be keeping the clock.
+static void lapic_timer_arm() {
+    timer.ticks += timer.armed - lapic_read(LAPIC_TIMER_CURRENT_COUNT);
+    
+    u32 count = LAPIC_TIMER_MAX_COUNT;
+    if (timer.heap_root) {
+        u64 now = timer.use_tsc ? clock_monotonic_ns() : ticks_to_ns(timer.ticks);
+        u64 deadline = timer.heap_root->deadline_ns;
+        u64 delta_ns = (deadline > now) ? deadline - now : 0;
+        if (delta_ns > TIMER_MAX_ARM_NS) delta_ns = TIMER_MAX_ARM_NS;
+        
+        // rounded up, going off early would only mean arming it again
+        u64 ticks = div_u64(delta_ns * timer.ticks_per_second + 999999999, 1000000000);
+        if (ticks == 0) ticks = 1;
+        if (ticks < LAPIC_TIMER_MAX_COUNT) count = static_cast<u32>(ticks);
+    }
+    
+    timer.armed = count;
+    lapic_write(LAPIC_TIMER_INITIAL_COUNT, count);
+}
+
+// in the timer interrupt. The Timer may be started again by its callback, or by somebody else while the
+// callback runs, so the callback and its data are taken out before the lock is dropped.
+static void timer_expire() {
+    while (true) {
+        spin_lock(&timer.lock);
+        u64 now = timer.use_tsc ? clock_monotonic_ns() : ticks_to_ns(clock_ticks());
+        if (!timer.heap_root || timer.heap_root->deadline_ns > now) break;
+        
+        Timer *t = timer.heap_root;
+        heap_remove(t);
+        timer_callback_type callback = t->callback;
+        void *data = t->data;
+        spin_unlock(&timer.lock);
+        
+        callback(data);
+    }
+    
+    if (timer.use_lapic) lapic_timer_arm();
+    spin_unlock(&timer.lock);
+}
+
+void lapic_timer_interrupt() {
+    timer_expire();
+}
+
+irq_result_type pit_irq_handler(s32 irq, void *dev) {
+    UNUSED(irq);
+    UNUSED(dev);
+    
+    spin_lock(&timer.lock);
+    timer.ticks += timer.pit_reload_value;
+    spin_unlock(&timer.lock);
+    
+    timer_expire();
+    return IRQ_RESULT_HANDLED;
+}
+
+void timer_start(Timer *t, u64 deadline_ns, timer_callback_type callback, void *data) {
+    u32 eflags = spin_lock_irqsave(&timer.lock);
+    
+    if (t->pending) heap_remove(t);
+    
+    t->deadline_ns = deadline_ns;
+    t->callback = callback;
+    t->data = data;
+    heap_insert(t);
+    
+    bool new_first = timer.use_lapic && timer.heap_root == t;
+    bool on_bsp = this_cpu() == &cpus[0];
+    if (new_first && on_bsp) lapic_timer_arm();
+    
+    spin_unlock(&timer.lock);
+    if (new_first && !on_bsp) lapic_send_ipi(cpus[0].apic_id, LAPIC_TIMER_VECTOR);
+    RESTORE_INTERRUPTS(eflags);
+}
+
+// the local APIC timer stays armed for a cancelled timer, it goes off once and finds nothing due. The
+// callback may already be running on the bootstrap cpu when this returns.
+void timer_cancel(Timer *t) {
+    u32 eflags = spin_lock_irqsave(&timer.lock);
+    if (t->pending) heap_remove(t);
+    spin_unlock_irqrestore(&timer.lock, eflags);
+}
+
+bool timer_pending(Timer *t) {
+    return t->pending;
+}
+
+// counts local APIC timer ticks and TSC ticks while channel 2 of the PIT runs down once. Interrupts are off.
+static void timer_calibrate(u32 *lapic_elapsed, u64 *tsc_elapsed, u32 *pit_count) {
+    u16 count = PIT_MAX_FREQ * TIMER_CALIBRATION_MS / 1000;
+    *pit_count = count;
+    
+    u8 port_b = io_read_u8(PIT_PORT_B) & ~(PIT_PORT_B_SPEAKER | PIT_PORT_B_CHN2_GATE);
+    io_write_u8(PIT_PORT_B, port_b);
+    
+    // in mode 0 the output stays low until the count reaches 0, and nothing is counted while the gate is low
+    io_write_u8(PIT_CMD, PIT_CMD_SEL_CHN2 | PIT_CMD_ACCESS_LOHI | PIT_CMD_OP_INT);
+    pit_set_reload_value(PIT_CHANNEL2, count);
+    
+    if (timer.use_lapic) {
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+        lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    }
+    
+    io_write_u8(PIT_PORT_B, port_b | PIT_PORT_B_CHN2_GATE);
+    if (timer.use_lapic) lapic_write(LAPIC_TIMER_INITIAL_COUNT, LAPIC_TIMER_MAX_COUNT);
+    u64 tsc_start = timer.use_tsc ? _read_tsc() : 0;
+    
+    while (!(io_read_u8(PIT_PORT_B) & PIT_PORT_B_CHN2_OUT)) {}
+    
+    *tsc_elapsed = timer.use_tsc ? _read_tsc() - tsc_start : 0;
+    *lapic_elapsed = 0;
+    if (timer.use_lapic) {
+        *lapic_elapsed = LAPIC_TIMER_MAX_COUNT - lapic_read(LAPIC_TIMER_CURRENT_COUNT);
+        lapic_write(LAPIC_TIMER_INITIAL_COUNT, 0);
+    }
+    
+    io_write_u8(PIT_PORT_B, port_b);
+}
+
+void timer_init() {
+    u32 eflags = DISABLE_INTERRUPTS();
+    
+    timer.ticks = 0;
+    timer.armed = 0;
+    timer.heap_root = nullptr;
+    timer.use_lapic = irq_use_apic;
+    timer.use_tsc = cpu_features.tsc;
+    
+    u32 lapic_elapsed;
+    u64 tsc_elapsed;
+    u32 pit_count;
+    timer_calibrate(&lapic_elapsed, &tsc_elapsed, &pit_count);
+    
+    if (timer.use_tsc) {
+        // the largest shift that still leaves the multiplier in 32 bits, the more bits the less it drifts
+        u32 calibration_ns = static_cast<u32>(div_u64(static_cast<u64>(pit_count) * 1000000000, PIT_MAX_FREQ));
+        timer.tsc_shift = 32;
+        u64 mult = div_u64(static_cast<u64>(calibration_ns) << timer.tsc_shift, static_cast<u32>(tsc_elapsed));
+        while (mult > 0xFFFFFFFF) {
+            timer.tsc_shift--;
+            mult = div_u64(static_cast<u64>(calibration_ns) << timer.tsc_shift, static_cast<u32>(tsc_elapsed));
+        }
+        
+        timer.tsc_mult = static_cast<u32>(mult);
+        timer.tsc_base = _read_tsc();
+        
+        u32 tsc_khz = static_cast<u32>(div_u64(tsc_elapsed * PIT_MAX_FREQ, pit_count * 1000));
+        kprint("timer: TSC at %u kHz, invariant %u\n", tsc_khz, cpu_features.invariant_tsc);
+        if (!cpu_features.invariant_tsc) kprint("timer: the TSC may change speed with the cpu, the clock will drift then\n");
+    }
+    
+    if (timer.use_lapic) {
+        timer.ticks_per_second = static_cast<u32>(div_u64(static_cast<u64>(lapic_elapsed) * PIT_MAX_FREQ, pit_count));
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONE_SHOT | LAPIC_TIMER_VECTOR);
+        lapic_timer_arm();
+        
+        kprint("timer: local APIC timer at %u kHz, one-shot\n", timer.ticks_per_second / 1000);
+    } else {
+        // its 16 bit count would run out after 55ms anyway, so it just keeps ticking
+        timer.pit_reload_value = PIT_MAX_FREQ / TIMER_PIT_FALLBACK_HZ;
+        timer.ticks_per_second = PIT_MAX_FREQ;
+        
+        io_write_u8(PIT_CMD, PIT_CMD_SEL_CHN0 | PIT_CMD_ACCESS_LOHI | PIT_CMD_OP_RATE_GEN);
+        pit_set_reload_value(PIT_CHANNEL0, static_cast<u16>(timer.pit_reload_value));
+        register_irq_handler(0, "PIT", pit_irq_handler, nullptr);
+        irq_unmask(0);
+        
+        kprint("timer: no local APIC, the PIT ticks at %u Hz\n", TIMER_PIT_FALLBACK_HZ);
+    }
+    
+    RESTORE_INTERRUPTS(eflags);
+}
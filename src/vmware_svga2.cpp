@@ -40,6 +40,9 @@
 #define SVGA_FIFO_NEXT_CMD 2
 #define SVGA_FIFO_STOP     3
 
+// the framebuffer is mapped at DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS, the FIFO goes after the largest framebuffer we allow
+#define SVGA_FIFO_VIRTUAL_ADDRESS (DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS + 0x02000000)
+
 struct VMW_SVGA_Driver {
     u16 index_port;
     u16 value_port;
@@ -49,6 +52,9 @@ struct VMW_SVGA_Driver {
     u32 bounce_buffer_count;
     u32 bounce_buffer_allocated;
     u32 *bounce_buffer;
+    
+    u32 vram_physical;
+    u32 vram_size;
 } svga_driver;
 
 struct SVGA_Cmd_Update {
@@ -95,7 +101,7 @@ void svga_fifo_full(VMW_SVGA_Driver *svga) {
 void svga_commit_all(VMW_SVGA_Driver *svga) {
     svga_fifo_full(svga);
     
-    u32 *fifo = reinterpret_cast<u32 *>(DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS + 0x400000);
+    u32 *fifo = reinterpret_cast<u32 *>(SVGA_FIFO_VIRTUAL_ADDRESS);
     
     u32 max = fifo[SVGA_FIFO_MAX];
     u32 min = fifo[SVGA_FIFO_MIN];
@@ -205,10 +211,10 @@ void svga_draw_rect(VMW_SVGA_Driver *svga, s32 x, s32 y, s32 width, s32 height,
     
     u32 offset = svga_read_reg(svga, SVGA_REG_FB_OFFSET);
     u32 *vram = reinterpret_cast<u32 *>(DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS + offset);
+    if (x1 <= x0) return;
+    
     for (s32 cy = y0; cy < y1; ++cy) {
-        for (s32 cx = x0; cx < x1; ++cx) {
-            vram[cx + cy * screen_width] = color;
-        }
+        memset32(&vram[x0 + cy * screen_width], color, x1 - x0);
     }
     
     // svga_cmd_update_rect(svga, x0, y0, x1-x0, y1-y0);
@@ -289,6 +295,23 @@ void svga_update_screen(VMW_SVGA_Driver *svga) {
     svga_cmd_update_rect(svga, 0, 0, screen_width, screen_height);
 }
 
+u32 svga_framebuffer_bytes(VMW_SVGA_Driver *svga) {
+    u32 screen_width = svga_read_reg(svga, SVGA_REG_WIDTH);
+    u32 screen_height = svga_read_reg(svga, SVGA_REG_HEIGHT);
+    u32 bpp = svga_read_reg(svga, SVGA_REG_BITS_PER_PIXEL);
+    return screen_width * screen_height * (bpp / 8);
+}
+
+// VRAM is mapped write-combining normally. The uncached mapping sets both PCD and PWT (strong UC),
+// PCD alone is UC- which a write-combining MTRR would still turn into WC.
+void svga_map_vram(VMW_SVGA_Driver *svga, bool write_combining) {
+    u32 flags = PAGE_PRESENT | PAGE_READ_WRITE | PAGE_GLOBAL_BIT | PAGE_SIZE_4MiB;
+    if (write_combining) flags |= PAGE_WRITE_COMBINING;
+    else                 flags |= PAGE_DO_NOT_CACHE | PAGE_USE_WRITE_THROUGH;
+    
+    map_range(svga->vram_physical, DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS, svga->vram_size / PAGE_SIZE, flags);
+}
+
 void create_svga_driver(Pci_Device_Config *header) {
     kassert( (header->header_type & (~PCI_HEADER_MULTIFUNCTION_BIT)) == 0);
     
@@ -334,28 +357,19 @@ void create_svga_driver(Pci_Device_Config *header) {
     kprint("MEM START: %X\n", mem_start);
     kprint("MEM SIZE : %u\n", mem_size);
     
-    u32 *table = reinterpret_cast<u32 *>(heap_alloc(PAGE_SIZE));
-    for (int i = 0; i < 1024; ++i) {
-        table[i] = PAGE_READ_WRITE;
-    }
-    
-    u32 *table2 = reinterpret_cast<u32 *>(heap_alloc(PAGE_SIZE));
-    for (int i = 0; i < 1024; ++i) {
-        table2[i] = PAGE_READ_WRITE;
-    }
+    // we map all of VRAM rather than just the framebuffer, it's usually a whole number of 4MiB pages
+    u32 vram_size = svga_read_reg(svga, SVGA_REG_VRAM_SIZE);
+    u32 vram_window = SVGA_FIFO_VIRTUAL_ADDRESS - DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS;
+    if (vram_size < fb_size) vram_size = fb_size;
+    if (vram_size > vram_window) vram_size = vram_window;
+    kassert(fb_size <= vram_window);
     
-    map_page_table(table, DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS);
-    map_page_table(table2, DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS + 0x400000);
-    
-    for (u32 phys = 0; phys < fb_size / 4; phys += PAGE_SIZE) {
-        map_page(phys + fb_start, DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS + phys, PAGE_PRESENT | PAGE_READ_WRITE | PAGE_DO_NOT_CACHE);
-    }
-    
-    for (u32 phys = 0; phys < mem_size; phys += PAGE_SIZE) {
-        map_page(phys + mem_start, DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS + 0x400000 + phys, PAGE_PRESENT | PAGE_READ_WRITE | PAGE_DO_NOT_CACHE);
-    }
+    svga->vram_physical = fb_start;
+    svga->vram_size = (vram_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    svga_map_vram(svga, true);
+    map_range(mem_start, SVGA_FIFO_VIRTUAL_ADDRESS, (mem_size + PAGE_SIZE - 1) / PAGE_SIZE, PAGE_PRESENT | PAGE_READ_WRITE | PAGE_DO_NOT_CACHE | PAGE_GLOBAL_BIT | PAGE_SIZE_4MiB);
     
-    u32 *fifo = reinterpret_cast<u32 *>(DRIVER_SAFE_USERLAND_VIRTUAL_ADDRESS + 0x400000);
+    u32 *fifo = reinterpret_cast<u32 *>(SVGA_FIFO_VIRTUAL_ADDRESS);
     fifo[SVGA_FIFO_MIN] = 16;
     fifo[SVGA_FIFO_MAX]  = 16 + (10 * 1024);
     fifo[SVGA_FIFO_NEXT_CMD] = 16;
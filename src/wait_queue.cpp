@@ -0,0 +1,142 @@
+#include "kernel.h"
+#include "spinlock.h"
+#include "thread.h"
+#include "timer.h"
+#include "wait_queue.h"
+
+// A waiter checks its condition, puts itself in the queue and marks itself blocked, all with the lock held,
+// so a waker that changes the condition under the same lock either runs before the check or finds it in
+// the queue. A thread_wake() that lands between dropping the lock and thread_block() isn't lost either.
+//
+// wake_one takes the entry out of the queue before waking it. A waiter that was woken by its deadline or
+// spuriously is still in the queue and stays there until it gives up or gets what it waited for.
+
+// the queue functions want the lock of the queue held
+static void wait_queue_append(Wait_Queue *queue, Wait_Entry *entry) {
+    entry->next = nullptr;
+    entry->queued = true;
+    if (queue->tail) {
+        queue->tail->next = entry;
+    } else {
+        queue->head = entry;
+    }
+    
+    queue->tail = entry;
+}
+
+static void wait_queue_unlink(Wait_Queue *queue, Wait_Entry *entry) {
+    Wait_Entry *prev = nullptr;
+    for (Wait_Entry *it = queue->head; it; prev = it, it = it->next) {
+        if (it != entry) continue;
+        
+        if (prev) prev->next = it->next;
+        else queue->head = it->next;
+        if (queue->tail == it) queue->tail = prev;
+        break;
+    }
+    
+    entry->next = nullptr;
+    entry->queued = false;
+}
+
+static bool wake_first(Wait_Queue *queue) {
+    Wait_Entry *entry = queue->head;
+    if (!entry) return false;
+    
+    queue->head = entry->next;
+    if (!queue->head) queue->tail = nullptr;
+    entry->next = nullptr;
+    entry->queued = false;
+    
+    // still under the lock, the entry is gone as soon as its thread gets the lock back
+    thread_wake(entry->thread);
+    return true;
+}
+
+bool wait_queue_wait(Wait_Queue *queue, wait_condition_type try_take, void *data, u64 deadline_ns) {
+    Wait_Entry entry;
+    entry.thread = thread_current();
+    entry.next = nullptr;
+    entry.queued = false;
+    
+    u32 eflags = spin_lock_irqsave(&queue->lock);
+    bool taken = try_take(data);
+    while (!taken) {
+        if (deadline_ns && clock_monotonic_ns() >= deadline_ns) break;
+        
+        if (!entry.queued) wait_queue_append(queue, &entry);
+        thread_prepare_block();
+        spin_unlock(&queue->lock);
+        
+        if (deadline_ns) {
+            thread_block_until(deadline_ns);
+        } else {
+            thread_block();
+        }
+        
+        spin_lock(&queue->lock);
+        taken = try_take(data);
+    }
+    
+    if (entry.queued) wait_queue_unlink(queue, &entry);
+    spin_unlock_irqrestore(&queue->lock, eflags);
+    return taken;
+}
+
+void wait_queue_wake_one(Wait_Queue *queue) {
+    u32 eflags = spin_lock_irqsave(&queue->lock);
+    wake_first(queue);
+    spin_unlock_irqrestore(&queue->lock, eflags);
+}
+
+void wait_queue_wake_all(Wait_Queue *queue) {
+    u32 eflags = spin_lock_irqsave(&queue->lock);
+    while (wake_first(queue)) {}
+    spin_unlock_irqrestore(&queue->lock, eflags);
+}
+
+void completion_reset(Completion *completion) {
+    u32 eflags = spin_lock_irqsave(&completion->waiters.lock);
+    completion->done = 0;
+    spin_unlock_irqrestore(&completion->waiters.lock, eflags);
+}
+
+void complete(Completion *completion) {
+    u32 eflags = spin_lock_irqsave(&completion->waiters.lock);
+    completion->done++;
+    wake_first(&completion->waiters);
+    spin_unlock_irqrestore(&completion->waiters.lock, eflags);
+}
+
+static bool completion_try_take(void *data) {
+    Completion *completion = reinterpret_cast<Completion *>(data);
+    if (!completion->done) return false;
+    
+    completion->done--;
+    return true;
+}
+
+bool completion_wait(Completion *completion, u64 deadline_ns) {
+    return wait_queue_wait(&completion->waiters, completion_try_take, completion, deadline_ns);
+}
+
+static bool mutex_try_take(void *data) {
+    Mutex *mutex = reinterpret_cast<Mutex *>(data);
+    if (mutex->owner) return false;
+    
+    mutex->owner = thread_current();
+    return true;
+}
+
+void mutex_lock(Mutex *mutex) {
+    kassert(mutex->owner != thread_current() && "mutex_lock on a mutex we already hold");
+    wait_queue_wait(&mutex->waiters, mutex_try_take, mutex, 0);
+}
+
+void mutex_unlock(Mutex *mutex) {
+    u32 eflags = spin_lock_irqsave(&mutex->waiters.lock);
+    kassert(mutex->owner == thread_current() && "mutex_unlock on a mutex we don't hold");
+    mutex->owner = nullptr;
+    wake_first(&mutex->waiters);
+    spin_unlock_irqrestore(&mutex->waiters.lock, eflags);
+}
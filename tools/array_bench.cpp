@@ -0,0 +1,162 @@
+// times appending to Array<T> with exact and with doubling growth, with and without in place resizes
+// build: g++ -O2 -std=c++11 -Wno-write-strings -funsigned-char -iquote include tools/array_bench.cpp -o array_bench
+// use:   array_bench
+//
+// Every run appends BENCH_APPENDS u32s to fresh arrays on a fresh kernel heap. "exact" grows the capacity to
+// count+1 before every add, which is what Array<T> used to do, "doubling" is what add() does now. The allocator
+// either supports ALLOCATOR_MODE_RESIZE through the heap or refuses it, which forces alloc+copy+free every time.
+// With two arrays appended in turn neither one sits at the watermark, so resizes only work out when the heap
+// has a free span right above the array.
+
+// no GS to count held locks in and no other cpus to answer shootdowns for
+#define SPINLOCK_PER_CPU 0
+
+// the kernel's versions would take the place of libc's, so they get other names here
+#define strlen kernel_strlen
+#define memcpy kernel_memcpy
+#define memmove kernel_memmove
+#define memset kernel_memset
+#define memset32 kernel_memset32
+#define zero_memory kernel_zero_memory
+
+#include "../src/memory.cpp"
+#include "../src/heap.cpp"
+
+#undef strlen
+#undef memcpy
+#undef memmove
+#undef memset
+#undef memset32
+#undef zero_memory
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// the heap expects its address space at HEAP_VIRTUAL_BASE_ADDRESS, so we reserve that range up front
+// and make the paging functions no-ops
+#define HOST_HEAP_SIZE (1024u * 1024u * 1024u)
+
+#define BENCH_APPENDS 100000
+
+Cpu_Features cpu_features;
+
+u32 host_next_page = 0x00100000;
+
+u32 alloc_zeroed_page() {
+	u32 page = host_next_page;
+	host_next_page += PAGE_SIZE;
+	return page;
+}
+
+void map_range(u32 physical, u32 virtual_addr, u32 count, u32 flags) {
+	(void) physical; (void) virtual_addr; (void) count; (void) flags;
+}
+
+bool map_page_if_unmapped(u32 physical, u32 virtual_addr, u32 flags) {
+	(void) physical; (void) virtual_addr; (void) flags;
+	return true;
+}
+
+void free_page(u32 physical) {
+	(void) physical;
+}
+
+extern "C" {
+	void _kassert(bool arg, char *s, char *file, u32 line) {
+		if (arg) return;
+		fprintf(stderr, "Assertion failed: %s,%u: %s\n", file, line, s);
+		abort();
+	}
+
+	u32 _read_eflags() { return 0; }
+	u32 _write_eflags(u32 eflags) { return eflags; }
+}
+
+struct Counters {
+	u32 allocs;
+	u32 frees;
+	u32 resizes;
+	u32 resizes_in_place;
+};
+
+Counters counters;
+bool allow_resize;
+
+// heap_allocator() disables interrupts, which we cant do in user mode, so this goes to the heap directly
+void *bench_allocator(ALLOCATOR_MODE mode, void *existing, s64 size) {
+	if (mode == ALLOCATOR_MODE_ALLOC) {
+		counters.allocs++;
+		return _heap_alloc(static_cast<u32>(size));
+	} else if (mode == ALLOCATOR_MODE_FREE) {
+		counters.frees++;
+		_heap_free(existing);
+		return nullptr;
+	}
+
+	counters.resizes++;
+	if (!allow_resize || !_heap_resize(existing, static_cast<u32>(size))) return nullptr;
+
+	counters.resizes_in_place++;
+	return existing;
+}
+
+double now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void run(const char *name, bool exact, bool resize, u32 num_arrays) {
+	init_heap();
+	counters = {};
+	allow_resize = resize;
+
+	Array<u32> arrays[2];
+	for (u32 a = 0; a < num_arrays; ++a) arrays[a].allocator = bench_allocator;
+
+	double start = now_ns();
+	for (u32 i = 0; i < BENCH_APPENDS; ++i) {
+		Array<u32> *array = &arrays[i % num_arrays];
+		if (exact) array->reserve(array->count + 1);
+		array->add(i);
+	}
+	double elapsed = now_ns() - start;
+
+	for (u32 a = 0; a < num_arrays; ++a) {
+		Array<u32> *array = &arrays[a];
+		for (s64 i = 0; i < array->count; ++i) {
+			if ((*array)[i] != static_cast<u32>(i * num_arrays + a)) {
+				fprintf(stderr, "%s: element %lld of array %u is wrong\n", name, static_cast<long long>(i), a);
+				abort();
+			}
+		}
+		bench_allocator(ALLOCATOR_MODE_FREE, array->data, 0);
+	}
+
+	printf("%-28s %10.1f ns/append %7u allocs %7u resizes %7u in place  heap %8.1f KiB\n",
+		   name, elapsed / BENCH_APPENDS, counters.allocs, counters.resizes, counters.resizes_in_place,
+		   heap_info.watermark / 1024.0);
+}
+
+int main() {
+	void *base = mmap(reinterpret_cast<void *>(HEAP_VIRTUAL_BASE_ADDRESS), HOST_HEAP_SIZE, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+	if (base != reinterpret_cast<void *>(HEAP_VIRTUAL_BASE_ADDRESS)) {
+		fprintf(stderr, "could not reserve the heap address range at %X\n", HEAP_VIRTUAL_BASE_ADDRESS);
+		return 1;
+	}
+
+	cpu_features.sse2 = __builtin_cpu_supports("sse2");
+
+	run("exact",                        true,  false, 1);
+	run("exact, resize",                true,  true,  1);
+	run("doubling",                     false, false, 1);
+	run("doubling, resize",             false, true,  1);
+	run("exact, resize, 2 arrays",      true,  true,  2);
+	run("doubling, 2 arrays",           false, false, 2);
+	run("doubling, resize, 2 arrays",   false, true,  2);
+
+	return 0;
+}
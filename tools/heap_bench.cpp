@@ -0,0 +1,267 @@
+// replays alloc/free traces against the kernel heap and reports throughput and fragmentation
+// build: g++ -O2 -std=c++11 -Wno-write-strings -funsigned-char -iquote include tools/heap_bench.cpp -o heap_bench
+// use:   heap_bench [trace_file]
+//
+// A trace file has one operation per line, "a <id> <size>" allocates a block and names it <id>,
+// "f <id>" frees it again. Without a trace file a handful of synthetic workloads are run that mimic
+// what the kernel does (Array growth, String_Builder growth, sprint temporaries, Nuklear buffers).
+
+// no GS to count held locks in and no other cpus to answer shootdowns for
+#define SPINLOCK_PER_CPU 0
+
+#include "../src/heap.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// the heap expects its address space at HEAP_VIRTUAL_BASE_ADDRESS, so we reserve that range up front
+// and make the paging functions no-ops
+#define HOST_HEAP_SIZE (1024u * 1024u * 1024u)
+
+u32 host_next_page = 0x00100000;
+
+u32 alloc_zeroed_page() {
+	u32 page = host_next_page;
+	host_next_page += PAGE_SIZE;
+	return page;
+}
+
+void map_range(u32 physical, u32 virtual_addr, u32 count, u32 flags) {
+	(void) physical; (void) virtual_addr; (void) count; (void) flags;
+}
+
+bool map_page_if_unmapped(u32 physical, u32 virtual_addr, u32 flags) {
+	(void) physical; (void) virtual_addr; (void) flags;
+	return true;
+}
+
+void free_page(u32 physical) {
+	(void) physical;
+}
+
+void _kassert(bool arg, char *s, char *file, u32 line) {
+	if (arg) return;
+	fprintf(stderr, "Assertion failed: %s,%u: %s\n", file, line, s);
+	abort();
+}
+
+u32 _read_eflags() { return 0; }
+u32 _write_eflags(u32 eflags) { return eflags; }
+
+void *zero_memory(void *_dst, u32 size) {
+	u8 *dst = reinterpret_cast<u8 *>(_dst);
+	for (u32 i = 0; i < size; ++i) dst[i] = 0;
+	return _dst;
+}
+
+struct Op {
+	u32 id;
+	u32 size; // 0 means free
+};
+
+struct Trace {
+	Op *ops;
+	u32 count;
+	u32 allocated;
+	u32 max_id;
+};
+
+void trace_add(Trace *trace, u32 id, u32 size) {
+	if (trace->count == trace->allocated) {
+		trace->allocated = trace->allocated ? trace->allocated * 2 : 1024;
+		trace->ops = reinterpret_cast<Op *>(realloc(trace->ops, trace->allocated * sizeof(Op)));
+	}
+	trace->ops[trace->count].id = id;
+	trace->ops[trace->count].size = size;
+	trace->count++;
+	if (id + 1 > trace->max_id) trace->max_id = id + 1;
+}
+
+u64 rng_state = 0x9E3779B97F4A7C15ull;
+
+u32 rng() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return static_cast<u32>(rng_state);
+}
+
+// mostly small objects with a long tail, a random subset stays alive
+void make_churn_trace(Trace *trace, u32 num_ops) {
+	u32 live[4096];
+	u32 live_count = 0;
+	u32 next_id = 0;
+
+	for (u32 i = 0; i < num_ops; ++i) {
+		bool do_alloc = (live_count == 0) || (live_count < 4096 && (rng() % 100) < 55);
+		if (do_alloc) {
+			u32 r = rng() % 100;
+			u32 size;
+			if (r < 70)      size = 8 + rng() % 120;
+			else if (r < 90) size = 128 + rng() % 1920;
+			else if (r < 98) size = 2048 + rng() % 14336;
+			else             size = 16384 + rng() % 245760;
+
+			trace_add(trace, next_id, size);
+			live[live_count++] = next_id++;
+		} else {
+			u32 index = rng() % live_count;
+			trace_add(trace, live[index], 0);
+			live[index] = live[--live_count];
+		}
+	}
+
+	for (u32 i = 0; i < live_count; ++i) trace_add(trace, live[i], 0);
+}
+
+// String_Builder grows its buffer 32 bytes at a time, freeing the old one
+void make_string_builder_trace(Trace *trace, u32 num_builders, u32 final_length) {
+	u32 next_id = 0;
+	for (u32 b = 0; b < num_builders; ++b) {
+		u32 current = next_id++;
+		trace_add(trace, current, 32);
+		for (u32 length = 64; length <= final_length; length += 32) {
+			u32 grown = next_id++;
+			trace_add(trace, grown, length);
+			trace_add(trace, current, 0);
+			current = grown;
+		}
+		// keep every other builder around, like the terminal backlog
+		if (b & 1) trace_add(trace, current, 0);
+	}
+}
+
+// Array<T> starts at 32 elements and doubles when it runs out, this ignores the in place resizes
+void make_array_trace(Trace *trace, u32 num_arrays, u32 element_size, u32 final_count) {
+	u32 next_id = 0;
+	for (u32 a = 0; a < num_arrays; ++a) {
+		u32 current = next_id++;
+		trace_add(trace, current, 32 * element_size);
+		for (u32 count = 64; count / 2 < final_count; count *= 2) {
+			u32 grown = next_id++;
+			trace_add(trace, grown, count * element_size);
+			trace_add(trace, current, 0);
+			current = grown;
+		}
+		trace_add(trace, current, 0);
+	}
+}
+
+bool load_trace(Trace *trace, char *path) {
+	FILE *file = fopen(path, "r");
+	if (!file) return false;
+
+	char op;
+	u32 id, size;
+	while (fscanf(file, " %c %u", &op, &id) == 2) {
+		if (op == 'a') {
+			if (fscanf(file, " %u", &size) != 1) break;
+			trace_add(trace, id, size ? size : 1);
+		} else if (op == 'f') {
+			trace_add(trace, id, 0);
+		}
+	}
+
+	fclose(file);
+	return true;
+}
+
+double now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void replay(const char *name, Trace *trace) {
+	init_heap();
+
+	void **blocks = reinterpret_cast<void **>(calloc(trace->max_id, sizeof(void *)));
+	u32 *sizes = reinterpret_cast<u32 *>(calloc(trace->max_id, sizeof(u32)));
+
+	u64 live_bytes = 0;
+	u64 peak_live_bytes = 0;
+	u64 peak_span_bytes = 0;
+	u64 bump_bytes = 0; // what the old watermark allocator would have consumed
+
+	double start = now_ns();
+	for (u32 i = 0; i < trace->count; ++i) {
+		Op op = trace->ops[i];
+		if (op.size) {
+			void *mem = _heap_alloc(op.size);
+			// touch the block so that a broken allocator handing out overlapping memory shows up
+			reinterpret_cast<u8 *>(mem)[0] = static_cast<u8>(op.id);
+			reinterpret_cast<u8 *>(mem)[op.size - 1] = static_cast<u8>(op.id);
+
+			blocks[op.id] = mem;
+			sizes[op.id] = op.size;
+			live_bytes += op.size;
+			bump_bytes += (op.size + 7) & ~7u;
+			if (live_bytes > peak_live_bytes) peak_live_bytes = live_bytes;
+			if (heap_info.watermark > peak_span_bytes) peak_span_bytes = heap_info.watermark;
+		} else if (blocks[op.id]) {
+			u8 *mem = reinterpret_cast<u8 *>(blocks[op.id]);
+			if (mem[0] != static_cast<u8>(op.id) || mem[sizes[op.id] - 1] != static_cast<u8>(op.id)) {
+				fprintf(stderr, "%s: block %u was overwritten\n", name, op.id);
+				abort();
+			}
+
+			_heap_free(mem);
+			live_bytes -= sizes[op.id];
+			blocks[op.id] = nullptr;
+		}
+	}
+	double elapsed = now_ns() - start;
+
+	// heap_get_stats() disables interrupts, which we cant do in user mode
+	Heap_Stats stats = heap_info.stats;
+	printf("%-16s %9u ops %8.1f ns/op  peak live %8.1f KiB  peak heap %8.1f KiB  overhead %5.1f%%  bump allocator %9.1f KiB\n",
+		   name, trace->count, elapsed / trace->count,
+		   peak_live_bytes / 1024.0, peak_span_bytes / 1024.0,
+		   peak_span_bytes ? 100.0 * (1.0 - (double) peak_live_bytes / peak_span_bytes) : 0.0,
+		   bump_bytes / 1024.0);
+	printf("%-16s end state: %u slabs, %u large spans, %u KiB in free spans, %u bytes still allocated\n",
+		   "", stats.slab_count, stats.large_span_count, stats.free_span_bytes / 1024, stats.allocated_bytes);
+
+	free(blocks);
+	free(sizes);
+}
+
+int main(int argc, char **argv) {
+	void *base = mmap(reinterpret_cast<void *>(HEAP_VIRTUAL_BASE_ADDRESS), HOST_HEAP_SIZE, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+	if (base != reinterpret_cast<void *>(HEAP_VIRTUAL_BASE_ADDRESS)) {
+		fprintf(stderr, "could not reserve the heap address range at %X\n", HEAP_VIRTUAL_BASE_ADDRESS);
+		return 1;
+	}
+
+	if (argc > 1) {
+		Trace trace = {};
+		if (!load_trace(&trace, argv[1])) {
+			fprintf(stderr, "could not read trace %s\n", argv[1]);
+			return 1;
+		}
+		replay(argv[1], &trace);
+		free(trace.ops);
+		return 0;
+	}
+
+	Trace churn = {};
+	make_churn_trace(&churn, 2000000);
+	replay("churn", &churn);
+
+	Trace builders = {};
+	make_string_builder_trace(&builders, 64, 8192);
+	replay("string_builder", &builders);
+
+	Trace arrays = {};
+	make_array_trace(&arrays, 16, 16, 2000);
+	replay("array_growth", &arrays);
+
+	free(churn.ops);
+	free(builders.ops);
+	free(arrays.ops);
+
+	return 0;
+}
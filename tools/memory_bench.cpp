@@ -0,0 +1,184 @@
+// compares the throughput of the kernel's memcpy/memset/memmove against the byte loops they replaced and libc
+// build: g++ -O2 -std=c++11 -Wno-write-strings -funsigned-char -iquote include tools/memory_bench.cpp -o memory_bench
+// use:   memory_bench
+//
+// Every size is run with the destination 16 byte aligned and misaligned by one byte against an aligned source.
+// memcpy is run once with the rep movsd path only and once with the SSE2 path allowed, which it takes when
+// source and destination can't both be dword aligned. Before timing anything the results are checked against
+// the byte loops for a spread of sizes and offsets.
+
+// no GS to count held locks in and no other cpus to answer shootdowns for
+#define SPINLOCK_PER_CPU 0
+
+// the kernel's versions would take the place of libc's, so they get other names here
+#define strlen kernel_strlen
+#define memcpy kernel_memcpy
+#define memmove kernel_memmove
+#define memset kernel_memset
+#define memset32 kernel_memset32
+#define zero_memory kernel_zero_memory
+
+#include "../src/memory.cpp"
+
+#undef strlen
+#undef memcpy
+#undef memmove
+#undef memset
+#undef memset32
+#undef zero_memory
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+Cpu_Features cpu_features;
+
+extern "C" {
+	void _kassert(bool arg, char *s, char *file, u32 line) {
+		if (arg) return;
+		fprintf(stderr, "Assertion failed: %s,%u: %s\n", file, line, s);
+		abort();
+	}
+}
+
+// what main.cpp used to have, the loops must not be turned into library calls
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+void byte_memcpy(void *dst, void *src, u32 num) {
+	u8 *_dst = reinterpret_cast<u8 *>(dst);
+	u8 *_src = reinterpret_cast<u8 *>(src);
+	for (u32 i = 0; i < num; ++i) _dst[i] = _src[i];
+}
+
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+void byte_memset(void *dst, u8 value, u32 num) {
+	u8 *_dst = reinterpret_cast<u8 *>(dst);
+	for (u32 i = 0; i < num; ++i) _dst[i] = value;
+}
+
+double now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+u64 rng_state = 0x9E3779B97F4A7C15ull;
+
+u32 rng() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return static_cast<u32>(rng_state);
+}
+
+#define MAX_SIZE (4 * 1024 * 1024)
+
+bool have_sse2;
+
+u8 *buffer_a;
+u8 *buffer_b;
+u8 *expected;
+
+void fail(const char *what, u32 size, u32 dst_offset, u32 src_offset) {
+	fprintf(stderr, "%s: wrong result for size %u, dst offset %u, src offset %u (sse2 %u)\n",
+			what, size, dst_offset, src_offset, cpu_features.sse2);
+	exit(1);
+}
+
+void check() {
+	static const u32 sizes[] = { 0, 1, 3, 4, 7, 15, 16, 17, 63, 64, 65, 255, 511, 512, 513, 1000, 4096, 4099, 65537 };
+	u32 region = 65537 + 64;
+
+	for (u32 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		u32 size = sizes[s];
+		for (u32 dst_offset = 0; dst_offset < 17; ++dst_offset) {
+			for (u32 src_offset = 0; src_offset < 17; src_offset += 3) {
+				for (u32 i = 0; i < region; ++i) buffer_a[i] = static_cast<u8>(rng());
+				for (u32 i = 0; i < region; ++i) buffer_b[i] = static_cast<u8>(rng());
+
+				byte_memcpy(expected, buffer_b, region);
+				byte_memcpy(expected + dst_offset, buffer_a + src_offset, size);
+				kernel_memcpy(buffer_b + dst_offset, buffer_a + src_offset, size);
+				if (memcmp(expected, buffer_b, region)) fail("memcpy", size, dst_offset, src_offset);
+
+				byte_memset(expected + dst_offset, 0xA5, size);
+				kernel_memset(buffer_b + dst_offset, 0xA5, size);
+				if (memcmp(expected, buffer_b, region)) fail("memset", size, dst_offset, src_offset);
+
+				// overlapping both ways, libc's memmove is the reference
+				memcpy(expected, buffer_a, region);
+				memmove(expected + dst_offset, expected + src_offset, size);
+				kernel_memmove(buffer_a + dst_offset, buffer_a + src_offset, size);
+				if (memcmp(expected, buffer_a, region)) fail("memmove", size, dst_offset, src_offset);
+			}
+
+			u32 *words = reinterpret_cast<u32 *>(buffer_b) + dst_offset;
+			kernel_memset32(words, 0xFF272822, size / 4);
+			for (u32 i = 0; i < size / 4; ++i) {
+				if (words[i] != 0xFF272822) fail("memset32", size, dst_offset, 0);
+			}
+		}
+	}
+}
+
+// returns MB/s
+template <typename F>
+double measure(u32 size, F f) {
+	u32 repeats = (256 * 1024 * 1024) / (size + 64);
+	if (repeats < 16) repeats = 16;
+
+	f();
+	double start = now_ns();
+	for (u32 i = 0; i < repeats; ++i) f();
+	double elapsed = now_ns() - start;
+
+	return (static_cast<double>(size) * repeats / (1024.0 * 1024.0)) / (elapsed / 1e9);
+}
+
+void run(u32 size, u32 misalign) {
+	u8 *dst = buffer_a + misalign;
+	u8 *src = buffer_b;
+
+	double copy_bytes = measure(size, [&]() { byte_memcpy(dst, src, size); });
+	cpu_features.sse2 = false;
+	double copy_rep = measure(size, [&]() { kernel_memcpy(dst, src, size); });
+	cpu_features.sse2 = have_sse2;
+	double copy_sse = measure(size, [&]() { kernel_memcpy(dst, src, size); });
+	double copy_libc = measure(size, [&]() { memcpy(dst, src, size); });
+
+	double set_bytes = measure(size, [&]() { byte_memset(dst, 0x5A, size); });
+	double set_kernel = measure(size, [&]() { kernel_memset(dst, 0x5A, size); });
+	double set_libc = measure(size, [&]() { memset(dst, 0x5A, size); });
+
+	printf("%8u %s  memcpy %8.0f %8.0f %8.0f %8.0f   memset %8.0f %8.0f %8.0f\n", size, misalign ? "+1" : "  ",
+		   copy_bytes, copy_rep, copy_sse, copy_libc, set_bytes, set_kernel, set_libc);
+
+	// compilers are clever, make sure the copies are used
+	if (dst[size / 2] == 0x42 && src[size / 3] == 0x17) printf(" ");
+}
+
+int main() {
+	buffer_a = reinterpret_cast<u8 *>(aligned_alloc(64, MAX_SIZE + 64));
+	buffer_b = reinterpret_cast<u8 *>(aligned_alloc(64, MAX_SIZE + 64));
+	expected = reinterpret_cast<u8 *>(aligned_alloc(64, MAX_SIZE + 64));
+	for (u32 i = 0; i < MAX_SIZE + 64; ++i) buffer_b[i] = static_cast<u8>(rng());
+
+	have_sse2 = __builtin_cpu_supports("sse2");
+
+	cpu_features.sse2 = false;
+	check();
+	if (have_sse2) {
+		cpu_features.sse2 = true;
+		check();
+	} else {
+		printf("no sse2 on this cpu, the sse2 columns use the rep path\n");
+	}
+
+	printf("MB/s        size      bytes  rep movs     sse2     libc            bytes rep stos     libc\n");
+	for (u32 size = 16; size <= MAX_SIZE; size *= 4) {
+		run(size, 0);
+		run(size, 1);
+	}
+
+	return 0;
+}
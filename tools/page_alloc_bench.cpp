@@ -0,0 +1,200 @@
+// measures frame allocation latency of the page allocator at different levels of memory occupancy
+// build: g++ -O2 -std=c++11 -Wno-write-strings -funsigned-char -iquote include tools/page_alloc_bench.cpp -o page_alloc_bench
+// use:   page_alloc_bench
+//
+// Memory is filled to the given occupancy with single pages that are freed again in random order, so
+// the remaining free pages are scattered all over the place, which is the bad case for any search.
+// Single pages are also run through next_free_page()/free_page() and the magazine cache in front of
+// the buddy allocator. As a reference the same allocations are done with the linear bitmap scan that next_free_page() used
+// to do on an identical bitmap.
+
+// no GS to count held locks in and no other cpus to answer shootdowns for
+#define SPINLOCK_PER_CPU 0
+
+// we are in user mode, cli would fault. Replaced before kernel.h, which pulls in the inline locks through heap.h
+#include "kernel_c.h"
+#undef DISABLE_INTERRUPTS
+#define DISABLE_INTERRUPTS() _read_eflags()
+
+#include "kernel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// there is no GS set up for us, every cpu is cpus[0]
+#include "smp.h"
+#define this_cpu bench_this_cpu
+
+Cpu cpus[APIC_MAX_CPUS];
+u32 cpu_count = 1;
+
+Cpu *bench_this_cpu() {
+	return &cpus[0];
+}
+
+#include "../src/page_allocator.cpp"
+
+extern "C" {
+	void _kassert(bool arg, char *s, char *file, u32 line) {
+		if (arg) return;
+		fprintf(stderr, "Assertion failed: %s,%u: %s\n", file, line, s);
+		abort();
+	}
+	
+	u32 _read_eflags() { return 0; }
+	u32 _write_eflags(u32 eflags) { return eflags; }
+	
+	void *zero_memory(void *_dst, u32 size) {
+		u8 *dst = reinterpret_cast<u8 *>(_dst);
+		for (u32 i = 0; i < size; ++i) dst[i] = 0;
+		return _dst;
+	}
+	
+	void kprint(char *s, ...) {
+		(void) s;
+	}
+	
+	// the pages are fake, there is nothing to zero
+	void zero_physical_page(u32 physical) {
+		(void) physical;
+	}
+}
+
+void *heap_allocator(ALLOCATOR_MODE mode, void *existing, s64 size) {
+	(void) mode; (void) existing; (void) size;
+	return nullptr;
+}
+
+u8 __KERNEL_MEMORY_START[1];
+u8 __KERNEL_MEMORY_END[1];
+
+#define BENCH_MEMORY_START 0x00100000
+#define BENCH_MEMORY_END   0xFFFFF000
+#define BENCH_NUM_ALLOCS   4096
+#define BENCH_ROUNDS       64
+#define BENCH_BURST        16
+
+u64 rng_state = 0x9E3779B97F4A7C15ull;
+
+u32 rng() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return static_cast<u32>(rng_state);
+}
+
+double now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// what next_free_page() did before the buddy allocator
+u32 linear_scan_alloc(u32 *bitmap, u32 num_pages) {
+	u32 buffer_count = num_pages / 32;
+	for (u32 j = 0; j < buffer_count; ++j) {
+		u32 value = bitmap[j];
+		if (value == 0xFFFFFFFF) continue;
+		
+		for (int k = 0; k < 32; ++k) {
+			if (((value >> k) & 1) == 0) {
+				u32 page = (j * 32) + k;
+				bitmap[j] |= (1 << k);
+				return page;
+			}
+		}
+	}
+	
+	return 0xFFFFFFFF;
+}
+
+void reset_allocator() {
+	page_allocator_stats = {};
+	for (u32 i = 0; i < APIC_MAX_CPUS; ++i) page_caches[i] = {};
+	bitmap_pool_used = 0;
+	
+	make_bitmap_entry(&bitmap_entry_storage[0], BENCH_MEMORY_START, BENCH_MEMORY_END);
+	bitmap_entries.data = &bitmap_entry_storage[0];
+	bitmap_entries.allocated = PAGE_ALLOCATOR_MAX_REGIONS;
+	bitmap_entries.count = 1;
+	
+	buddy_seed(&bitmap_entry_storage[0]);
+}
+
+void run(u32 occupancy_percent, u32 *pages, u32 *allocs) {
+	reset_allocator();
+	
+	u32 total = page_allocator_stats.free_pages;
+	for (u32 i = 0; i < total; ++i) pages[i] = alloc_pages(0);
+	
+	// shuffle and give back everything above the occupancy we want
+	for (u32 i = total - 1; i > 0; --i) {
+		u32 j = rng() % (i + 1);
+		u32 t = pages[i]; pages[i] = pages[j]; pages[j] = t;
+	}
+	
+	u32 keep = (u32) (((u64) total * occupancy_percent) / 100);
+	for (u32 i = keep; i < total; ++i) free_pages(pages[i], 0);
+	
+	double alloc_ns = 0;
+	double free_ns = 0;
+	for (u32 round = 0; round < BENCH_ROUNDS; ++round) {
+		double start = now_ns();
+		for (u32 i = 0; i < BENCH_NUM_ALLOCS; ++i) allocs[i] = alloc_pages(0);
+		double mid = now_ns();
+		for (u32 i = 0; i < BENCH_NUM_ALLOCS; ++i) free_pages(allocs[i], 0);
+		double end = now_ns();
+		
+		alloc_ns += mid - start;
+		free_ns += end - mid;
+	}
+	
+	// single pages through the magazine cache, in short bursts of allocs and frees like the heap
+	// growing and shrinking by a few pages at a time
+	double cached_ns = 0;
+	for (u32 round = 0; round < BENCH_ROUNDS; ++round) {
+		double start = now_ns();
+		for (u32 i = 0; i < BENCH_NUM_ALLOCS; i += BENCH_BURST) {
+			for (u32 j = 0; j < BENCH_BURST; ++j) allocs[j] = next_free_page();
+			for (u32 j = 0; j < BENCH_BURST; ++j) free_page(allocs[j]);
+		}
+		cached_ns += now_ns() - start;
+	}
+	
+	// the linear scan works on a copy of the page bitmap in the same state
+	Bitmap_Entry *entry = &bitmap_entry_storage[0];
+	u32 word_count = (entry->num_pages + 31) / 32;
+	u32 *bitmap = reinterpret_cast<u32 *>(malloc(word_count * sizeof(u32)));
+	for (u32 i = 0; i < word_count; ++i) bitmap[i] = entry->buffer[i];
+	
+	double linear_ns = 0;
+	for (u32 round = 0; round < BENCH_ROUNDS; ++round) {
+		double start = now_ns();
+		for (u32 i = 0; i < BENCH_NUM_ALLOCS; ++i) allocs[i] = linear_scan_alloc(bitmap, entry->num_pages);
+		linear_ns += now_ns() - start;
+		
+		for (u32 i = 0; i < BENCH_NUM_ALLOCS; ++i) bitmap_clear(bitmap, allocs[i]);
+	}
+	free(bitmap);
+	
+	u32 num_ops = BENCH_ROUNDS * BENCH_NUM_ALLOCS;
+	Page_Allocator_Stats stats = page_allocator_stats;
+	Page_Cache *cache = this_cpu_page_cache();
+	printf("%3u%% occupied  %7u pages free  alloc %7.1f ns  free %7.1f ns  cached alloc+free %6.1f ns (%u hits, %u misses)  linear scan alloc %9.1f ns\n",
+		   occupancy_percent, stats.free_pages, alloc_ns / num_ops, free_ns / num_ops, cached_ns / num_ops,
+		   cache->hits, cache->misses, linear_ns / num_ops);
+}
+
+int main() {
+	u32 *pages = reinterpret_cast<u32 *>(malloc(PAGE_ALLOCATOR_MAX_PAGES * sizeof(u32)));
+	u32 *allocs = reinterpret_cast<u32 *>(malloc(BENCH_NUM_ALLOCS * sizeof(u32)));
+	
+	run(10, pages, allocs);
+	run(50, pages, allocs);
+	run(95, pages, allocs);
+	
+	free(pages);
+	free(allocs);
+	return 0;
+}